@@ -0,0 +1,428 @@
+// benchmarks for the ray tracer's hot kernels (scalar vs. SIMD batch types, photon map formats & lookups)
+
+
+// libraries, namespace
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include "library/loadXML.cpp"
+using namespace std;
+
+
+// benchmark settings
+int benchPoints = 1 << 16;
+int benchLights = 16;
+int benchTriangles = 1 << 12;
+int benchRays = 256;
+int benchRepeat = 10;
+int benchPhotons = 1 << 20;
+int benchQueries = 1 << 12;
+int benchNearest = 100;
+int benchGridPhotons[] = {1 << 16, 1 << 18, 1 << 20};
+float benchShininess = 20.0;
+
+
+// random data for the benchmarks
+mt19937 rnd;
+uniform_real_distribution<float> dist{-1.0, 1.0};
+Point randomPoint(){
+  return Point(dist(rnd), dist(rnd), dist(rnd));
+}
+Color randomColor(){
+  return Color(dist(rnd) * 0.5 + 0.5, dist(rnd) * 0.5 + 0.5, dist(rnd) * 0.5 + 0.5);
+}
+
+
+// time a kernel (best of several runs, in milliseconds)
+template <class F> double timeKernel(F kernel, float &result){
+  double best = FLOAT_MAX;
+  for(int r = 0; r < benchRepeat; r++){
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    result = kernel();
+    chrono::duration<double, milli> t = chrono::high_resolution_clock::now() - start;
+    if(t.count() < best)
+      best = t.count();
+  }
+  return best;
+}
+
+
+// print out one line of benchmark results
+void report(string name, double scalar, double simd, float scalarResult, float simdResult){
+  cout << name << ": scalar " << scalar << " ms, simd " << simd << " ms, speedup " << scalar / simd << "x";
+  cout << " (check " << scalarResult << " / " << simdResult << ")" << endl;
+}
+
+
+// benchmark vector math (dot, cross, normalize)
+void benchVectorMath(){
+
+  // setup points (array of structures and structure of arrays)
+  vector<Point> a(benchPoints), b(benchPoints);
+  for(int i = 0; i < benchPoints; i++){
+    a[i] = randomPoint();
+    b[i] = randomPoint();
+  }
+
+  // scalar kernel
+  float scalarResult, simdResult;
+  double scalar = timeKernel([&](){
+    float sum = 0.0;
+    for(int i = 0; i < benchPoints; i++){
+      Point c = (a[i] ^ b[i]).GetNormalized();
+      sum += c % a[i] + a[i] % b[i];
+    }
+    return sum;
+  }, scalarResult);
+
+  // batch kernel
+  vector<Point3x8> a8(benchPoints / 8), b8(benchPoints / 8);
+  for(int i = 0; i < benchPoints / 8; i++){
+    a8[i].Load(&a[i * 8]);
+    b8[i].Load(&b[i * 8]);
+  }
+  double simd = timeKernel([&](){
+    Float8 sum = Float8(0.0);
+    for(int i = 0; i < benchPoints / 8; i++){
+      Point3x8 c = (a8[i] ^ b8[i]).GetNormalized();
+      sum += c % a8[i] + a8[i] % b8[i];
+    }
+    return sum.Sum();
+  }, simdResult);
+  report("vector math (dot, cross, normalize)", scalar, simd, scalarResult, simdResult);
+}
+
+
+// benchmark the blinn-phong shading loop (diffuse & specular multiply-adds over all lights)
+void benchShading(){
+
+  // setup shading points (position, normal, view vector, material colors)
+  vector<Point> p(benchPoints), n(benchPoints), v(benchPoints);
+  vector<Color> diff(benchPoints), spec(benchPoints);
+  for(int i = 0; i < benchPoints; i++){
+    p[i] = randomPoint();
+    n[i] = randomPoint().GetNormalized();
+    v[i] = randomPoint().GetNormalized();
+    diff[i] = randomColor();
+    spec[i] = randomColor();
+  }
+
+  // setup lights (position & intensity)
+  vector<Point> lightPos(benchLights);
+  vector<Color> lightInt(benchLights);
+  for(int l = 0; l < benchLights; l++){
+    lightPos[l] = randomPoint() * 10.0;
+    lightInt[l] = randomColor();
+  }
+
+  // scalar kernel (same arithmetic as BlinnMaterial::shade)
+  float scalarResult, simdResult;
+  double scalar = timeKernel([&](){
+    Color total = Color(0.0);
+    for(int i = 0; i < benchPoints; i++){
+      Color c = Color(0.0);
+      for(int l = 0; l < benchLights; l++){
+        Point dir = (lightPos[l] - p[i]).GetNormalized();
+        float geom = n[i] % dir;
+        Point half = (v[i] + dir).GetNormalized();
+        float s = pow(max(half % n[i], 0.0f), benchShininess);
+        if(geom > 0)
+          c += lightInt[l] * geom * (diff[i] + s * spec[i]);
+      }
+      total += c;
+    }
+    return total.Grey();
+  }, scalarResult);
+
+  // batch kernel (eight shading points at a time, lights broadcast)
+  int batches = benchPoints / 8;
+  vector<Point3x8> p8(batches), n8(batches), v8(batches);
+  vector<Color8> diff8(batches), spec8(batches);
+  for(int i = 0; i < batches; i++){
+    p8[i].Load(&p[i * 8]);
+    n8[i].Load(&n[i * 8]);
+    v8[i].Load(&v[i * 8]);
+    diff8[i].Load(&diff[i * 8]);
+    spec8[i].Load(&spec[i * 8]);
+  }
+  double simd = timeKernel([&](){
+    Color8 total = Color8(Color(0.0));
+    float lanes[8];
+    for(int i = 0; i < batches; i++){
+      Color8 c = Color8(Color(0.0));
+      for(int l = 0; l < benchLights; l++){
+        Point3x8 dir = (Point3x8(lightPos[l]) - p8[i]).GetNormalized();
+        Float8 geom = n8[i] % dir;
+        Point3x8 half = (v8[i] + dir).GetNormalized();
+        (half % n8[i]).Max(Float8(0.0)).Store(lanes);
+        for(int j = 0; j < 8; j++)
+          lanes[j] = pow(lanes[j], benchShininess);
+        Float8 s = Float8(lanes);
+        Color8 term = Color8(lightInt[l]) * geom * (diff8[i] + spec8[i] * s);
+        c += Color8::Select(geom > Float8(0.0), term, Color8(Color(0.0)));
+      }
+      total += c;
+    }
+    return total.Sum().Grey();
+  }, simdResult);
+  report("blinn-phong shading loop", scalar, simd, scalarResult, simdResult);
+}
+
+
+// intersect one ray with eight triangles at once (Moller-Trumbore, front & back faces)
+// triangles are given by a vertex and two edge vectors per lane
+// returns a lane mask of hits between the bias and tMax, with hit distances in t
+Float8 intersectTriangles8(const Point &pos, const Point &dir, const Point3x8 &a, const Point3x8 &e1, const Point3x8 &e2, float bias, float tMax, Float8 &t){
+  
+  // broadcast the ray to all lanes
+  Point3x8 p = Point3x8(pos);
+  Point3x8 d = Point3x8(dir);
+  
+  // calculate the determinant (reject rays parallel to the triangle)
+  Point3x8 P = d ^ e2;
+  Float8 determ = e1 % P;
+  Float8 valid = (determ > Float8(bias)) | (determ < Float8(-bias));
+  Float8 inv = Float8(1.0) / determ;
+  
+  // calculate the barycentric coordinates
+  Point3x8 T = p - a;
+  Float8 u = (T % P) * inv;
+  Point3x8 Q = T ^ e1;
+  Float8 v = (d % Q) * inv;
+  valid = valid & (u >= Float8(0.0)) & (v >= Float8(0.0)) & (u + v <= Float8(1.0));
+  
+  // calculate the distance to hit each triangle
+  t = (e2 % Q) * inv;
+  valid = valid & (t > Float8(bias)) & (t < Float8(tMax));
+  return valid;
+}
+
+
+// benchmark ray-triangle intersection (Moller-Trumbore)
+void benchIntersection(){
+
+  // setup triangles (vertex & edges) and rays
+  vector<Point> a(benchTriangles), e1(benchTriangles), e2(benchTriangles);
+  for(int i = 0; i < benchTriangles; i++){
+    a[i] = randomPoint() * 10.0;
+    e1[i] = randomPoint();
+    e2[i] = randomPoint();
+  }
+  vector<Point> pos(benchRays), dir(benchRays);
+  for(int r = 0; r < benchRays; r++){
+    pos[r] = randomPoint() * 10.0;
+    dir[r] = randomPoint().GetNormalized();
+  }
+  float bias = 0.001;
+
+  // scalar kernel (closest hit for each ray)
+  float scalarResult, simdResult;
+  double scalar = timeKernel([&](){
+    float sum = 0.0;
+    for(int r = 0; r < benchRays; r++){
+      float closest = FLOAT_MAX;
+      for(int i = 0; i < benchTriangles; i++){
+        Point P = dir[r] ^ e2[i];
+        float determ = e1[i] % P;
+        if(determ < bias && determ > -bias)
+          continue;
+        float inv = 1.0 / determ;
+        Point T = pos[r] - a[i];
+        float u = (T % P) * inv;
+        if(u < 0.0 || u > 1.0)
+          continue;
+        Point Q = T ^ e1[i];
+        float v = (dir[r] % Q) * inv;
+        if(v < 0.0 || u + v > 1.0)
+          continue;
+        float t = (e2[i] % Q) * inv;
+        if(t > bias && t < closest)
+          closest = t;
+      }
+      if(closest < FLOAT_MAX)
+        sum += closest;
+    }
+    return sum;
+  }, scalarResult);
+
+  // batch kernel (one ray against eight triangles at a time)
+  int batches = benchTriangles / 8;
+  vector<Point3x8> a8(batches), e18(batches), e28(batches);
+  for(int i = 0; i < batches; i++){
+    a8[i].Load(&a[i * 8]);
+    e18[i].Load(&e1[i * 8]);
+    e28[i].Load(&e2[i * 8]);
+  }
+  double simd = timeKernel([&](){
+    float sum = 0.0;
+    for(int r = 0; r < benchRays; r++){
+      Float8 closest = Float8(FLOAT_MAX);
+      for(int i = 0; i < batches; i++){
+        Float8 t;
+        Float8 hit = intersectTriangles8(pos[r], dir[r], a8[i], e18[i], e28[i], bias, FLOAT_MAX, t);
+        closest = Float8::Select(hit, closest.Min(t), closest);
+      }
+      float lanes[8];
+      closest.Store(lanes);
+      float c = FLOAT_MAX;
+      for(int j = 0; j < 8; j++)
+        c = min(c, lanes[j]);
+      if(c < FLOAT_MAX)
+        sum += c;
+    }
+    return sum;
+  }, simdResult);
+  report("ray-triangle intersection", scalar, simd, scalarResult, simdResult);
+}
+
+
+// random photons on the six walls of a box (20 wide), arriving from inside, and query points on the walls
+vector<Photon> boxPhotons(int count){
+  vector<Photon> photons(count);
+  for(int i = 0; i < count; i++){
+    Point pos = randomPoint() * 10.0;
+    int axis = i % 3;
+    float side = i % 6 < 3 ? -10.0 : 10.0;
+    pos[axis] = side;
+    Point normal = Point(0.0, 0.0, 0.0);
+    normal[axis] = -side / 10.0;
+    Point dir = (randomPoint() - normal * 2.0).GetNormalized();
+    Color c = randomColor() * 1e-6;
+    float power[3] = {c.r, c.g, c.b};
+    encodePhoton(&photons[i], power, &pos.x, &dir.x, &normal.x);
+  }
+  return photons;
+}
+void boxQueries(vector<Point> &pos, vector<Point> &normal){
+  pos.resize(benchQueries);
+  normal.resize(benchQueries);
+  for(int q = 0; q < benchQueries; q++){
+    pos[q] = randomPoint() * 10.0;
+    int axis = q % 3;
+    pos[q][axis] = q % 6 < 3 ? -10.0 : 10.0;
+    normal[q] = Point(0.0, 0.0, 0.0);
+    normal[q][axis] = -pos[q][axis] / 10.0;
+  }
+}
+BalancedPhotonMap* boxPhotonMap(vector<Photon> &photons){
+  PhotonMap *map = createPhotonMap(photons.size());
+  storePhotons(map, photons.data(), photons.size());
+  return balancePhotonMap(map);
+}
+
+
+// benchmark photon map queries (full vs. compact photons), with the memory of each
+void benchPhotonMap(){
+  
+  // setup photons and query points
+  vector<Photon> photons = boxPhotons(benchPhotons);
+  vector<Point> pos, normal;
+  boxQueries(pos, normal);
+  
+  // build the same balanced map twice, and compact one of them
+  BalancedPhotonMap *maps[2];
+  for(int m = 0; m < 2; m++)
+    maps[m] = boxPhotonMap(photons);
+  compactPhotonMap(maps[1]);
+  
+  // time the nearest photon queries on each map
+  float result[2];
+  double time[2];
+  for(int m = 0; m < 2; m++){
+    time[m] = timeKernel([&](){
+      float sum = 0.0;
+      for(int q = 0; q < benchQueries; q++){
+        float irrad[3];
+        irradianceEstimate(maps[m], irrad, &pos[q].x, &normal[q].x, 2.0, benchNearest);
+        sum += irrad[0] + irrad[1] + irrad[2];
+      }
+      return sum;
+    }, result[m]);
+  }
+  cout << "photon map queries: full " << time[0] << " ms (" << photonMapBytes(maps[0]) / 1048576.0 << " MB), compact ";
+  cout << time[1] << " ms (" << photonMapBytes(maps[1]) / 1048576.0 << " MB), speedup " << time[0] / time[1] << "x";
+  cout << " (check " << result[0] << " / " << result[1] << ")" << endl;
+  destroyPhotonMap(maps[0]);
+  destroyPhotonMap(maps[1]);
+}
+
+
+// benchmark fixed radius photon queries (balanced kd-tree vs. hashed grid) for several photon counts
+// (the radius holds benchNearest photons on average, so the nearest photon search is timed too)
+void benchPhotonGrid(){
+  vector<Point> pos, normal;
+  boxQueries(pos, normal);
+  for(int count : benchGridPhotons){
+    vector<Photon> photons = boxPhotons(count);
+    float radius = sqrt(benchNearest * 2400.0 / (count * M_PI));
+    
+    // build the kd-tree & the grid on one thread (the kd-tree is balanced serially), then the grid on all threads
+    int threads = max((int) thread::hardware_concurrency(), 1);
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    BalancedPhotonMap *map = boxPhotonMap(photons);
+    chrono::duration<double, milli> kdBuild = chrono::high_resolution_clock::now() - start;
+    start = chrono::high_resolution_clock::now();
+    PhotonGrid *grid = buildPhotonGrid(map, radius, 1);
+    chrono::duration<double, milli> gridBuild = chrono::high_resolution_clock::now() - start;
+    destroyPhotonGrid(grid);
+    start = chrono::high_resolution_clock::now();
+    grid = buildPhotonGrid(map, radius, threads);
+    chrono::duration<double, milli> gridBuildThreads = chrono::high_resolution_clock::now() - start;
+    
+    // nearest photons (kd-tree), photons within radius (kd-tree), photons within radius (grid)
+    float nearestResult, kdResult, gridResult;
+    double nearest = timeKernel([&](){
+      float sum = 0.0;
+      for(int q = 0; q < benchQueries; q++){
+        float irrad[3];
+        irradianceEstimate(map, irrad, &pos[q].x, &normal[q].x, radius, benchNearest);
+        sum += irrad[0] + irrad[1] + irrad[2];
+      }
+      return sum;
+    }, nearestResult);
+    double kd = timeKernel([&](){
+      float sum = 0.0;
+      for(int q = 0; q < benchQueries; q++){
+        float flux[3];
+        sum += photonsWithin(map, flux, &pos[q].x, &normal[q].x, radius);
+      }
+      return sum;
+    }, kdResult);
+    double hashed = timeKernel([&](){
+      float sum = 0.0;
+      for(int q = 0; q < benchQueries; q++){
+        float flux[3];
+        sum += photonsInRadius(grid, flux, &pos[q].x, &normal[q].x, radius);
+      }
+      return sum;
+    }, gridResult);
+    cout << "photon grid (" << count << " photons): build (1 thread) kd-tree " << kdBuild.count() << " ms, grid " << gridBuild.count() << " ms";
+    cout << ", grid (" << threads << " threads) " << gridBuildThreads.count() << " ms; ";
+    cout << "queries nearest " << nearest << " ms, kd-tree " << kd << " ms, grid " << hashed << " ms, speedup " << kd / hashed << "x";
+    cout << " (check " << kdResult << " / " << gridResult << ")" << endl;
+    destroyPhotonGrid(grid);
+    destroyPhotonMap(map);
+  }
+}
+
+
+// run all benchmarks
+int main(){
+#if defined(CY_SIMD_AVX)
+  cout << "SIMD: AVX" << endl;
+#elif defined(CY_SIMD_SSE)
+  cout << "SIMD: SSE" << endl;
+#else
+  cout << "SIMD: scalar fallback" << endl;
+#endif
+  benchVectorMath();
+  benchShading();
+  benchIntersection();
+  benchPhotonMap();
+  benchPhotonGrid();
+}
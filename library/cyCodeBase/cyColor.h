@@ -14,6 +14,9 @@
 ///
 /// cyColor is color class that holds floating point color values
 ///
+/// cyColor8 is a structure-of-arrays batch of eight colors whose
+/// operations map onto SIMD instructions (see cySIMD.h).
+///
 //-------------------------------------------------------------------------------
 
 #ifndef _CY_COLOR_H_INCLUDED_
@@ -21,6 +24,10 @@
 
 //-------------------------------------------------------------------------------
 
+#include "cySIMD.h"
+
+//-------------------------------------------------------------------------------
+
 /// Color class
 
 class cyColor
@@ -93,6 +100,74 @@ public:
 //-------------------------------------------------------------------------------
 
 
+/// Batch of eight colors (structure of arrays)
+class cyColor8
+{
+	friend cyColor8 operator*( const float v, const cyColor8 &c ) { return c*v; }			///< Multiplication with a constant
+	friend cyColor8 operator*( const cyFloat8 &v, const cyColor8 &c ) { return c*v; }		///< Multiplication with a batch of constants
+
+public:
+
+	cyFloat8 r, g, b;
+
+	///@name Constructors
+	cyColor8() { }
+	cyColor8( const cyFloat8 &_r, const cyFloat8 &_g, const cyFloat8 &_b ) : r(_r), g(_g), b(_b) {}
+	cyColor8( const cyColor &c ) : r(c.r), g(c.g), b(c.b) {}								///< Broadcasts a color to all lanes
+	cyColor8( const cyColor *c ) { Load(c); }
+
+	///@name Set & Get value functions
+	cyColor8& Black() { r.Zero(); g.Zero(); b.Zero(); return *this; }
+	cyColor8& Load( const cyColor *c )														///< Gathers eight colors from an array
+	{
+		CY_SIMD_ALIGN(32) float t[3][8];
+		for ( int i=0; i<8; i++ ) { t[0][i]=c[i].r; t[1][i]=c[i].g; t[2][i]=c[i].b; }
+		r.Load(t[0]); g.Load(t[1]); b.Load(t[2]);
+		return *this;
+	}
+	void Store( cyColor *c ) const															///< Scatters the eight colors into an array
+	{
+		CY_SIMD_ALIGN(32) float t[3][8];
+		r.Store(t[0]); g.Store(t[1]); b.Store(t[2]);
+		for ( int i=0; i<8; i++ ) c[i].Set(t[0][i],t[1][i],t[2][i]);
+	}
+	cyColor Get( int i ) const { return cyColor(r[i],g[i],b[i]); }							///< Returns a single lane (slow)
+	void Set( int i, const cyColor &c ) { r.SetLane(i,c.r); g.SetLane(i,c.g); b.SetLane(i,c.b); }	///< Sets a single lane (slow)
+	cyColor Sum() const { return cyColor(r.Sum(),g.Sum(),b.Sum()); }						///< Adds up all lanes
+
+	///@name Gray-scale functions
+	cyFloat8 Grey() const { return (r+g+b)*(1.0f/3.0f); }
+	cyFloat8 Luma2() const { return r*0.2126f + g*0.7152f + b*0.0722f; }
+
+	///@name Binary operators
+	cyColor8 operator+( const cyColor8 &c ) const { return cyColor8(r+c.r, g+c.g, b+c.b); }
+	cyColor8 operator-( const cyColor8 &c ) const { return cyColor8(r-c.r, g-c.g, b-c.b); }
+	cyColor8 operator*( const cyColor8 &c ) const { return cyColor8(r*c.r, g*c.g, b*c.b); }
+	cyColor8 operator/( const cyColor8 &c ) const { return cyColor8(r/c.r, g/c.g, b/c.b); }
+	cyColor8 operator*( const cyFloat8 &n ) const { return cyColor8(r*n, g*n, b*n); }
+	cyColor8 operator*(float n) const { return cyColor8(r*n, g*n, b*n); }
+	cyColor8 operator/(float n) const { return *this * (1.0f/n); }
+
+	///@name Assignment operators
+	cyColor8& operator+=( const cyColor8 &c ) { r+=c.r; g+=c.g; b+=c.b; return *this; }
+	cyColor8& operator-=( const cyColor8 &c ) { r-=c.r; g-=c.g; b-=c.b; return *this; }
+	cyColor8& operator*=( const cyColor8 &c ) { r*=c.r; g*=c.g; b*=c.b; return *this; }
+	cyColor8& operator*=( const cyFloat8 &n ) { r*=n; g*=n; b*=n; return *this; }
+	cyColor8& operator*=(float n) { r*=n; g*=n; b*=n; return *this; }
+
+	/// Multiply-add: returns this + a*c
+	cyColor8 MulAdd( const cyColor8 &a, const cyColor8 &c ) const { return cyColor8(r+a.r*c.r, g+a.g*c.g, b+a.b*c.b); }
+
+	/// Returns a for true lanes of the mask, b otherwise
+	static cyColor8 Select( const cyFloat8 &mask, const cyColor8 &a, const cyColor8 &b )
+	{
+		return cyColor8( cyFloat8::Select(mask,a.r,b.r), cyFloat8::Select(mask,a.g,b.g), cyFloat8::Select(mask,a.b,b.b) );
+	}
+};
+
+//-------------------------------------------------------------------------------
+
+
 /// Color class with alpha
 class cyColorA
 {
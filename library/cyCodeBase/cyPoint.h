@@ -22,6 +22,9 @@
 ///
 /// glVertex3fv( &myvector.x );
 ///
+/// cyPoint3x8 is a structure-of-arrays batch of eight 3D points whose
+/// operations map onto SIMD instructions (see cySIMD.h).
+///
 //-------------------------------------------------------------------------------
 
 #ifndef _CY_POINT_H_INCLUDED_
@@ -30,6 +33,7 @@
 //-------------------------------------------------------------------------------
 
 #include <math.h>
+#include "cySIMD.h"
 
 //-------------------------------------------------------------------------------
 
@@ -275,11 +279,87 @@ public:
 
 //-------------------------------------------------------------------------------
 
+/// Batch of eight 3D points (structure of arrays)
+class cyPoint3x8
+{
+	friend cyPoint3x8 operator*( const float v, const cyPoint3x8 &pt ) { return pt*v; }			///< Multiplication with a constant
+	friend cyPoint3x8 operator*( const cyFloat8 &v, const cyPoint3x8 &pt ) { return pt*v; }		///< Multiplication with a batch of constants
+
+public:
+
+	cyFloat8 x, y, z;
+
+	///@name Constructors
+	cyPoint3x8() { }
+	cyPoint3x8( const cyFloat8 &_x, const cyFloat8 &_y, const cyFloat8 &_z ) : x(_x), y(_y), z(_z) {}
+	cyPoint3x8( const cyPoint3f &pt ) : x(pt.x), y(pt.y), z(pt.z) {}							///< Broadcasts a point to all lanes
+	cyPoint3x8( const cyPoint3f *pt ) { Load(pt); }
+
+	///@name Set & Get value functions
+	cyPoint3x8& Zero() { x.Zero(); y.Zero(); z.Zero(); return *this; }
+	cyPoint3x8& Load( const cyPoint3f *pt )															///< Gathers eight points from an array
+	{
+		CY_SIMD_ALIGN(32) float t[3][8];
+		for ( int i=0; i<8; i++ ) { t[0][i]=pt[i].x; t[1][i]=pt[i].y; t[2][i]=pt[i].z; }
+		x.Load(t[0]); y.Load(t[1]); z.Load(t[2]);
+		return *this;
+	}
+	void Store( cyPoint3f *pt ) const																///< Scatters the eight points into an array
+	{
+		CY_SIMD_ALIGN(32) float t[3][8];
+		x.Store(t[0]); y.Store(t[1]); z.Store(t[2]);
+		for ( int i=0; i<8; i++ ) pt[i].Set(t[0][i],t[1][i],t[2][i]);
+	}
+	cyPoint3f Get( int i ) const { return cyPoint3f(x[i],y[i],z[i]); }								///< Returns a single lane (slow)
+	void Set( int i, const cyPoint3f &pt ) { x.SetLane(i,pt.x); y.SetLane(i,pt.y); z.SetLane(i,pt.z); }	///< Sets a single lane (slow)
+
+	///@name Length and Normalize functions
+	void		Normalize()		{ cyFloat8 s = cyFloat8(1.0f)/Length(); *this *= s; }
+	cyPoint3x8	GetNormalized()	const { cyFloat8 s = cyFloat8(1.0f)/Length(); return *this * s; }
+	cyFloat8	LengthSquared()	const { return x*x + y*y + z*z; }
+	cyFloat8	Length()		const { return LengthSquared().Sqrt(); }
+
+	///@name Unary operators
+	cyPoint3x8 operator-() const { return cyPoint3x8(-x,-y,-z); }
+	cyPoint3x8 operator+() const { return *this; }
+
+	///@name Binary operators
+	cyPoint3x8 operator+( const cyPoint3x8 &pt ) const { return cyPoint3x8(x+pt.x, y+pt.y, z+pt.z); }
+	cyPoint3x8 operator-( const cyPoint3x8 &pt ) const { return cyPoint3x8(x-pt.x, y-pt.y, z-pt.z); }
+	cyPoint3x8 operator*( const cyPoint3x8 &pt ) const { return cyPoint3x8(x*pt.x, y*pt.y, z*pt.z); }
+	cyPoint3x8 operator/( const cyPoint3x8 &pt ) const { return cyPoint3x8(x/pt.x, y/pt.y, z/pt.z); }
+	cyPoint3x8 operator*( const cyFloat8 &n ) const { return cyPoint3x8(x*n, y*n, z*n); }
+	cyPoint3x8 operator/( const cyFloat8 &n ) const { return cyPoint3x8(x/n, y/n, z/n); }
+	cyPoint3x8 operator*(float n) const { return cyPoint3x8(x*n, y*n, z*n); }
+	cyPoint3x8 operator/(float n) const { return *this * (1.0f/n); }
+
+	///@name Assignment operators
+	cyPoint3x8& operator+=( const cyPoint3x8 &pt ) { x+=pt.x; y+=pt.y; z+=pt.z; return *this; }
+	cyPoint3x8& operator-=( const cyPoint3x8 &pt ) { x-=pt.x; y-=pt.y; z-=pt.z; return *this; }
+	cyPoint3x8& operator*=( const cyFloat8 &n ) { x*=n; y*=n; z*=n; return *this; }
+	cyPoint3x8& operator*=(float n) { x*=n; y*=n; z*=n; return *this; }
+
+	///@name Cross product and dot product
+	cyPoint3x8	Cross	 ( const cyPoint3x8 &pt ) const { return cyPoint3x8(y*pt.z-z*pt.y, z*pt.x-x*pt.z, x*pt.y-y*pt.x); }	///< Cross product
+	cyPoint3x8	operator^( const cyPoint3x8 &pt ) const { return Cross(pt); }						///< Cross product
+	cyFloat8	Dot		 ( const cyPoint3x8 &pt ) const { return x*pt.x + y*pt.y + z*pt.z; }		///< Dot product
+	cyFloat8	operator%( const cyPoint3x8 &pt ) const { return Dot(pt); }						///< Dot product
+
+	/// Returns a for true lanes of the mask, b otherwise
+	static cyPoint3x8 Select( const cyFloat8 &mask, const cyPoint3x8 &a, const cyPoint3x8 &b )
+	{
+		return cyPoint3x8( cyFloat8::Select(mask,a.x,b.x), cyFloat8::Select(mask,a.y,b.y), cyFloat8::Select(mask,a.z,b.z) );
+	}
+};
+
+//-------------------------------------------------------------------------------
+
 
 namespace cy {
 	typedef cyPoint2f Point2f;
 	typedef cyPoint3f Point3f;
 	typedef cyPoint4f Point4f;
+	typedef cyPoint3x8 Point3x8;
 }
 
 
@@ -0,0 +1,203 @@
+// cyCodeBase extension for the ray tracer
+//-------------------------------------------------------------------------------
+///
+/// \file		cySIMD.h
+/// \version	1.0
+///
+/// \brief 8-wide float vector used by the batch point and color classes.
+///
+///
+/// @copydoc cyFloat8
+///
+/// cyFloat8 holds eight floats and maps its operators onto AVX, SSE or plain
+/// scalar code, depending on what the compiler is allowed to generate.
+/// The dispatch is done at compile time:
+///
+///   __AVX__  : one 256-bit register
+///   __SSE__  : two 128-bit registers
+///   otherwise: a scalar loop over eight floats
+///
+/// Defining CY_SIMD_SCALAR before including forces the scalar code path.
+/// Lanes are stored as plain floats (loaded/stored unaligned), so cyFloat8
+/// and the batch classes built on it can be kept in std::vector.
+///
+/// Comparison operators return a mask (all bits set for true lanes) that can
+/// be passed to Select() or tested with Any() and All().
+///
+//-------------------------------------------------------------------------------
+
+#ifndef _CY_SIMD_H_INCLUDED_
+#define _CY_SIMD_H_INCLUDED_
+
+//-------------------------------------------------------------------------------
+
+#include <math.h>
+
+#if defined(CY_SIMD_SCALAR)
+#elif defined(__AVX__)
+# define CY_SIMD_AVX
+# include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+# define CY_SIMD_SSE
+# include <xmmintrin.h>
+#else
+# define CY_SIMD_SCALAR
+#endif
+
+#if defined(_MSC_VER)
+# define CY_SIMD_ALIGN(x) __declspec(align(x))
+#else
+# define CY_SIMD_ALIGN(x) __attribute__((aligned(x)))
+#endif
+
+//-------------------------------------------------------------------------------
+
+/// 8-wide float vector
+
+class cyFloat8
+{
+	friend cyFloat8 operator+( const float v, const cyFloat8 &f ) { return cyFloat8(v)+f; }	///< Addition with a constant
+	friend cyFloat8 operator-( const float v, const cyFloat8 &f ) { return cyFloat8(v)-f; }	///< Subtraction from a constant
+	friend cyFloat8 operator*( const float v, const cyFloat8 &f ) { return cyFloat8(v)*f; }	///< Multiplication with a constant
+
+public:
+
+	float f[8];		///< lanes
+
+#if defined(CY_SIMD_AVX)
+	cyFloat8( __m256 v ) { _mm256_storeu_ps(f,v); }
+	__m256 V() const { return _mm256_loadu_ps(f); }
+#elif defined(CY_SIMD_SSE)
+	cyFloat8( __m128 lo, __m128 hi ) { _mm_storeu_ps(f,lo); _mm_storeu_ps(f+4,hi); }
+	__m128 Lo() const { return _mm_loadu_ps(f); }
+	__m128 Hi() const { return _mm_loadu_ps(f+4); }
+#endif
+
+	///@name Constructors
+	cyFloat8() { }
+	cyFloat8( float s ) { Set(s); }
+	cyFloat8( const float *p ) { Load(p); }
+
+	///@name Set & Get value functions
+	cyFloat8& Zero() { return Set(0.0f); }
+	cyFloat8& Set( float s ) { for ( int i=0; i<8; i++ ) f[i]=s; return *this; }				///< Broadcasts a value to all lanes
+	cyFloat8& Load( const float *p ) { for ( int i=0; i<8; i++ ) f[i]=p[i]; return *this; }	///< Loads eight floats
+	void Store( float *p ) const { for ( int i=0; i<8; i++ ) p[i]=f[i]; }					///< Stores eight floats
+
+	///@name Access operators
+	float operator[]( int i ) const { return f[i]; }
+	void  SetLane( int i, float s ) { f[i]=s; }
+
+	///@name Unary operators
+	cyFloat8 operator-() const { return cyFloat8(0.0f) - *this; }
+	cyFloat8 operator+() const { return *this; }
+
+	///@name Binary operators
+#if defined(CY_SIMD_AVX)
+	cyFloat8 operator+( const cyFloat8 &b ) const { return cyFloat8(_mm256_add_ps(V(),b.V())); }
+	cyFloat8 operator-( const cyFloat8 &b ) const { return cyFloat8(_mm256_sub_ps(V(),b.V())); }
+	cyFloat8 operator*( const cyFloat8 &b ) const { return cyFloat8(_mm256_mul_ps(V(),b.V())); }
+	cyFloat8 operator/( const cyFloat8 &b ) const { return cyFloat8(_mm256_div_ps(V(),b.V())); }
+	cyFloat8 operator&( const cyFloat8 &b ) const { return cyFloat8(_mm256_and_ps(V(),b.V())); }
+	cyFloat8 operator|( const cyFloat8 &b ) const { return cyFloat8(_mm256_or_ps(V(),b.V())); }
+#elif defined(CY_SIMD_SSE)
+	cyFloat8 operator+( const cyFloat8 &b ) const { return cyFloat8(_mm_add_ps(Lo(),b.Lo()),_mm_add_ps(Hi(),b.Hi())); }
+	cyFloat8 operator-( const cyFloat8 &b ) const { return cyFloat8(_mm_sub_ps(Lo(),b.Lo()),_mm_sub_ps(Hi(),b.Hi())); }
+	cyFloat8 operator*( const cyFloat8 &b ) const { return cyFloat8(_mm_mul_ps(Lo(),b.Lo()),_mm_mul_ps(Hi(),b.Hi())); }
+	cyFloat8 operator/( const cyFloat8 &b ) const { return cyFloat8(_mm_div_ps(Lo(),b.Lo()),_mm_div_ps(Hi(),b.Hi())); }
+	cyFloat8 operator&( const cyFloat8 &b ) const { return cyFloat8(_mm_and_ps(Lo(),b.Lo()),_mm_and_ps(Hi(),b.Hi())); }
+	cyFloat8 operator|( const cyFloat8 &b ) const { return cyFloat8(_mm_or_ps(Lo(),b.Lo()),_mm_or_ps(Hi(),b.Hi())); }
+#else
+	cyFloat8 operator+( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]+b.f[i]; return r; }
+	cyFloat8 operator-( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]-b.f[i]; return r; }
+	cyFloat8 operator*( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]*b.f[i]; return r; }
+	cyFloat8 operator/( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]/b.f[i]; return r; }
+	cyFloat8 operator&( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=FromBits(Bits(f[i])&Bits(b.f[i])); return r; }
+	cyFloat8 operator|( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=FromBits(Bits(f[i])|Bits(b.f[i])); return r; }
+#endif
+	cyFloat8 operator+(float n) const { return *this + cyFloat8(n); }
+	cyFloat8 operator-(float n) const { return *this - cyFloat8(n); }
+	cyFloat8 operator*(float n) const { return *this * cyFloat8(n); }
+	cyFloat8 operator/(float n) const { return *this * cyFloat8(1.0f/n); }
+
+	///@name Assignment operators
+	cyFloat8& operator+=( const cyFloat8 &b ) { *this = *this + b; return *this; }
+	cyFloat8& operator-=( const cyFloat8 &b ) { *this = *this - b; return *this; }
+	cyFloat8& operator*=( const cyFloat8 &b ) { *this = *this * b; return *this; }
+	cyFloat8& operator/=( const cyFloat8 &b ) { *this = *this / b; return *this; }
+	cyFloat8& operator+=(float n) { *this = *this + n; return *this; }
+	cyFloat8& operator-=(float n) { *this = *this - n; return *this; }
+	cyFloat8& operator*=(float n) { *this = *this * n; return *this; }
+	cyFloat8& operator/=(float n) { *this = *this / n; return *this; }
+
+	///@name Comparison operators (return lane masks)
+#if defined(CY_SIMD_AVX)
+	cyFloat8 operator< ( const cyFloat8 &b ) const { return cyFloat8(_mm256_cmp_ps(V(),b.V(),_CMP_LT_OQ)); }
+	cyFloat8 operator<=( const cyFloat8 &b ) const { return cyFloat8(_mm256_cmp_ps(V(),b.V(),_CMP_LE_OQ)); }
+	cyFloat8 operator> ( const cyFloat8 &b ) const { return cyFloat8(_mm256_cmp_ps(V(),b.V(),_CMP_GT_OQ)); }
+	cyFloat8 operator>=( const cyFloat8 &b ) const { return cyFloat8(_mm256_cmp_ps(V(),b.V(),_CMP_GE_OQ)); }
+#elif defined(CY_SIMD_SSE)
+	cyFloat8 operator< ( const cyFloat8 &b ) const { return cyFloat8(_mm_cmplt_ps(Lo(),b.Lo()),_mm_cmplt_ps(Hi(),b.Hi())); }
+	cyFloat8 operator<=( const cyFloat8 &b ) const { return cyFloat8(_mm_cmple_ps(Lo(),b.Lo()),_mm_cmple_ps(Hi(),b.Hi())); }
+	cyFloat8 operator> ( const cyFloat8 &b ) const { return cyFloat8(_mm_cmpgt_ps(Lo(),b.Lo()),_mm_cmpgt_ps(Hi(),b.Hi())); }
+	cyFloat8 operator>=( const cyFloat8 &b ) const { return cyFloat8(_mm_cmpge_ps(Lo(),b.Lo()),_mm_cmpge_ps(Hi(),b.Hi())); }
+#else
+	cyFloat8 operator< ( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=Mask(f[i]< b.f[i]); return r; }
+	cyFloat8 operator<=( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=Mask(f[i]<=b.f[i]); return r; }
+	cyFloat8 operator> ( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=Mask(f[i]> b.f[i]); return r; }
+	cyFloat8 operator>=( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=Mask(f[i]>=b.f[i]); return r; }
+#endif
+
+	///@name Mask functions
+#if defined(CY_SIMD_AVX)
+	int  MoveMask() const { return _mm256_movemask_ps(V()); }									///< One bit per lane, set for true lanes
+#elif defined(CY_SIMD_SSE)
+	int  MoveMask() const { return _mm_movemask_ps(Lo()) | (_mm_movemask_ps(Hi())<<4); }
+#else
+	int  MoveMask() const { int m=0; for ( int i=0; i<8; i++ ) if ( Bits(f[i])>>31 ) m|=(1<<i); return m; }
+#endif
+	bool Any() const { return MoveMask() != 0; }
+	bool All() const { return MoveMask() == 0xFF; }
+
+	///@name Math functions
+#if defined(CY_SIMD_AVX)
+	cyFloat8 Sqrt() const { return cyFloat8(_mm256_sqrt_ps(V())); }
+	cyFloat8 Min( const cyFloat8 &b ) const { return cyFloat8(_mm256_min_ps(V(),b.V())); }
+	cyFloat8 Max( const cyFloat8 &b ) const { return cyFloat8(_mm256_max_ps(V(),b.V())); }
+	static cyFloat8 Select( const cyFloat8 &mask, const cyFloat8 &a, const cyFloat8 &b ) { return cyFloat8(_mm256_blendv_ps(b.V(),a.V(),mask.V())); }	///< Returns a for true lanes, b otherwise
+#elif defined(CY_SIMD_SSE)
+	cyFloat8 Sqrt() const { return cyFloat8(_mm_sqrt_ps(Lo()),_mm_sqrt_ps(Hi())); }
+	cyFloat8 Min( const cyFloat8 &b ) const { return cyFloat8(_mm_min_ps(Lo(),b.Lo()),_mm_min_ps(Hi(),b.Hi())); }
+	cyFloat8 Max( const cyFloat8 &b ) const { return cyFloat8(_mm_max_ps(Lo(),b.Lo()),_mm_max_ps(Hi(),b.Hi())); }
+	static cyFloat8 Select( const cyFloat8 &mask, const cyFloat8 &a, const cyFloat8 &b )
+	{
+		return cyFloat8(_mm_or_ps(_mm_and_ps(mask.Lo(),a.Lo()),_mm_andnot_ps(mask.Lo(),b.Lo())),
+		                _mm_or_ps(_mm_and_ps(mask.Hi(),a.Hi()),_mm_andnot_ps(mask.Hi(),b.Hi())));
+	}
+#else
+	cyFloat8 Sqrt() const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=(float)sqrt(f[i]); return r; }
+	cyFloat8 Min( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]<b.f[i]?f[i]:b.f[i]; return r; }
+	cyFloat8 Max( const cyFloat8 &b ) const { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=f[i]>b.f[i]?f[i]:b.f[i]; return r; }
+	static cyFloat8 Select( const cyFloat8 &mask, const cyFloat8 &a, const cyFloat8 &b ) { cyFloat8 r; for ( int i=0; i<8; i++ ) r.f[i]=(Bits(mask.f[i])>>31)?a.f[i]:b.f[i]; return r; }
+#endif
+
+	/// Horizontal sum of all lanes
+	float Sum() const { return ((f[0]+f[1])+(f[2]+f[3]))+((f[4]+f[5])+(f[6]+f[7])); }
+
+#if defined(CY_SIMD_SCALAR)
+private:
+	static unsigned int Bits( float s ) { union { float f; unsigned int u; } c; c.f=s; return c.u; }
+	static float FromBits( unsigned int u ) { union { float f; unsigned int u; } c; c.u=u; return c.f; }
+	static float Mask( bool b ) { return FromBits( b ? 0xFFFFFFFFu : 0u ); }
+#endif
+};
+
+//-------------------------------------------------------------------------------
+
+namespace cy {
+	typedef cyFloat8 Float8;
+}
+
+//-------------------------------------------------------------------------------
+
+#endif
@@ -11,15 +11,16 @@ namespace scene{
 class GenericLight: public Light{
   public:
     
+    // constructor (each light gets its own slot in the per-thread occluder cache)
+    GenericLight(){
+      occluderSlot = newOccluderSlot();
+    }
+    
     // calculate a shadow for any light (never call from ambient!)
     float shadow(Cone ray, float z = FLOAT_MAX){
       
-      // set initial hit info
-      HitInfo h = HitInfo();
-      h.z = z;
-      
-      // check ray from point to light, is it occluded?
-      bool occlude = traceRay(ray, h);
+      // check ray from point to light, is it occluded? (any hit will do)
+      bool occlude = traceShadowRay(ray, z, occluderSlot);
       
       // return 0 if in shadow, 1 if lit directly
       if(occlude)
@@ -27,6 +28,11 @@ class GenericLight: public Light{
       else
         return 1.0;
     }
+    
+  private:
+    
+    // slot in the occluder cache
+    int occluderSlot;
 };
 
 
@@ -77,30 +83,21 @@ class IndirectLight: public GenericLight{
     Color illuminate(Point p, Point n){
       
       // color for shading
-      Color indirect;
+      Color indirect = Color(0.0, 0.0, 0.0);
       
-      // multi-sampling for indirect lighting
+      // multi-sampling for indirect lighting (one tangent frame for all samples)
+      HemisphereSampler hemisphere = HemisphereSampler(n);
       for(int s = 0; s < samples; s++){
         
-        // randomize ray on a hemisphere
-        float phi = dist(rnd) * 2.0 * M_PI;
-        float the = acos(1.0 - 2.0 * dist(rnd)) / 2.0;
-        
-        // calculate hemisphere vectors
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % n > 0.5 || v0 % n < -0.5)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ n).GetNormalized();
-        v0 = (v1 ^ n).GetNormalized();
-        
-        // set up ray and hit info
-        Cone *r = new Cone();
-        r->pos = p;
-        r->dir = n.GetNormalized() * cos(the) + (v0 * cos(phi) + v1 * sin(  phi)) * sin(the);
+        // set up ray (cosine-weighted on the hemisphere, or toward the environment) and hit info
+        float weight;
+        Cone r = Cone();
+        r.pos = p;
+        r.dir = hemisphere.direction(s, weight);
         HitInfo hi = HitInfo();
         
-        // trace a new ray
-        bool hit = traceRay(*r, hi);
+        // trace a new ray (unless it has no weight)
+        bool hit = weight > 0.0 && traceRay(r, hi);
         
         // grab the node material hit
         Material *m;
@@ -112,11 +109,11 @@ class IndirectLight: public GenericLight{
         
         // shade our material
         if(hit && m)
-          indirect = (indirect * s + m->shade(*r, hi, lights)) / (float) (s + 1);
+          indirect = (indirect * s + m->shade(r, hi, lights) * weight) / (float) (s + 1);
         
         // otherwise, nothing to shade
         else
-          indirect = (indirect * s + environment.sampleEnvironment(r->dir)) / (float) (s + 1);
+          indirect = (indirect * s + environment.sampleEnvironment(r.dir) * weight) / (float) (s + 1);
       }
       
       // return the color
@@ -158,10 +155,6 @@ class IndirectLight: public GenericLight{
     
     // number of samples for global illumination
     int samples;
-    
-    // setup random generator for global illumination
-    mt19937 rnd;
-    uniform_real_distribution<float> dist{0.0, 1.0};
 };
 
 
@@ -176,30 +169,21 @@ class IrradianceCacheLight: public GenericLight{
     Color illuminate(Point p, Point n){
       
       // color for shading
-      Color indirect;
+      Color indirect = Color(0.0, 0.0, 0.0);
       
-      // multi-sampling for indirect lighting
+      // multi-sampling for indirect lighting (one tangent frame for all samples)
+      HemisphereSampler hemisphere = HemisphereSampler(n);
       for(int s = 0; s < samples; s++){
         
-        // randomize ray on a hemisphere
-        float phi = Halton(s, 3) * 2.0 * M_PI;
-        float the = acos(1.0 - 2.0 * Halton(s, 2)) / 2.0;
-        
-        // calculate hemisphere vectors
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % n > 0.5 || v0 % n < -0.5)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ n).GetNormalized();
-        v0 = (v1 ^ n).GetNormalized();
-        
-        // set up ray and hit info
-        Cone *r = new Cone();
-        r->pos = p;
-        r->dir = n.GetNormalized() * cos(the) + (v0 * cos(phi) + v1 * sin(  phi)) * sin(the);
+        // set up ray (cosine-weighted on the hemisphere, or toward the environment) and hit info
+        float weight;
+        Cone r = Cone();
+        r.pos = p;
+        r.dir = hemisphere.direction(s, weight);
         HitInfo hi = HitInfo();
         
-        // trace a new ray
-        bool hit = traceRay(*r, hi);
+        // trace a new ray (unless it has no weight)
+        bool hit = weight > 0.0 && traceRay(r, hi);
         
         // grab the node material hit
         Material *m;
@@ -211,11 +195,11 @@ class IrradianceCacheLight: public GenericLight{
         
         // shade our material
         if(hit && m)
-          indirect = (indirect * s + m->shade(*r, hi, lights)) / (float) (s + 1);
+          indirect = (indirect * s + m->shade(r, hi, lights) * weight) / (float) (s + 1);
         
         // otherwise, nothing to shade
         else
-          indirect = (indirect * s + environment.sampleEnvironment(r->dir)) / (float) (s + 1);
+          indirect = (indirect * s + environment.sampleEnvironment(r.dir) * weight) / (float) (s + 1);
       }
       
       // return the color
@@ -260,6 +244,171 @@ class IrradianceCacheLight: public GenericLight{
 };
 
 
+// world-space irradiance cache light definition (another type of indirect light)
+// interpolates cached irradiance records, and computes a new record (on a stratified
+// hemisphere, for Ward & Heckbert's gradients) where no record is close enough
+class IrradianceOctreeLight: public GenericLight{
+  public:
+    
+    // constructor
+    IrradianceOctreeLight(){
+      cache = NULL;
+    }
+    
+    // get color of indirect light from the cache (adding a record if needed)
+    Color illuminate(Point p, Point n){
+      Color c;
+      n.Normalize();
+      if(cache->lookup(p, n, c))
+        return c;
+      IrradianceRecord *r = computeRecord(p, n);
+      cache->insert(r);
+      return r->value;
+    }
+    
+    // get direction of indirect light (non-sensical)
+    Point direction(Point p){
+      return Point(0, 0, 0);
+    }
+    
+    // return true, since light is indirect
+    bool isAmbient(){
+      return true;
+    }
+    
+    // set the irradiance cache
+    void setCache(IrradianceCache *c){
+      cache = c;
+    }
+    
+    // set the light list
+    void setLightList(LightList *l){
+      lights = *l;
+    }
+    
+    // set the environment
+    void setEnvironment(TexturedColor c){
+      environment = c;
+    }
+    
+    // set the number of samples
+    void setSamples(int s){
+      samples = s;
+    }
+    
+  private:
+    
+    // irradiance cache
+    IrradianceCache *cache;
+    
+    // light list for all other lights
+    LightList lights;
+    
+    // environment variable
+    TexturedColor environment;
+    
+    // number of samples for global illumination
+    int samples;
+    
+    // compute a new irradiance record (samples on a jittered M x N grid, N about pi M)
+    IrradianceRecord* computeRecord(Point p, Point n){
+      int M = max(1, (int) (sqrt(samples / M_PI) + 0.5));
+      int N = max(1, samples / M);
+      
+      // tangent frame
+      Point u = Point(0.0, 1.0, 0.0);
+      if(u % n > 0.5 || u % n < -0.5)
+        u = Point(0.0, 0.0, 1.0);
+      Point v = (u ^ n).GetNormalized();
+      u = (v ^ n).GetNormalized();
+      
+      // incoming light & hit distance of each cell
+      vector<Color> L(M * N);
+      vector<float> R(M * N);
+      float invDist = 0.0;
+      for(int j = 0; j < M; j++){
+        for(int k = 0; k < N; k++){
+          
+          // cosine-weighted direction, jittered inside the cell
+          float sinT = sqrt((j + pixelRandom()) / M);
+          float phi = 2.0 * M_PI * (k + pixelRandom()) / N;
+          Cone r = Cone();
+          r.pos = p;
+          r.dir = n * sqrt(1.0 - sinT * sinT) + (u * cos(phi) + v * sin(phi)) * sinT;
+          HitInfo hi = HitInfo();
+          
+          // trace a new ray, shade the hit (or take the environment)
+          Material *m = NULL;
+          if(traceRay(r, hi) && hi.node)
+            m = hi.node->getMaterial();
+          if(m){
+            L[j * N + k] = m->shade(r, hi, lights);
+            R[j * N + k] = hi.z;
+            invDist += 1.0 / hi.z;
+          }else{
+            L[j * N + k] = environment.sampleEnvironment(r.dir);
+            R[j * N + k] = FLOAT_MAX;
+          }
+        }
+      }
+      
+      // value (irradiance over pi) & validity radius (harmonic mean distance)
+      IrradianceRecord *rec = new IrradianceRecord();
+      rec->p = p;
+      rec->n = n;
+      rec->value = Color(0.0, 0.0, 0.0);
+      for(int i = 0; i < M * N; i++)
+        rec->value += L[i];
+      rec->value /= (float) (M * N);
+      rec->radius = invDist > 0.0 ? M * N / invDist : FLOAT_MAX;
+      
+      // gradients (rotation about an axis, translation by Ward & Heckbert, scaled down by pi)
+      Point rot[3], trans[3];
+      for(int c = 0; c < 3; c++){
+        rot[c].Zero();
+        trans[c].Zero();
+      }
+      for(int k = 0; k < N; k++){
+        float phi = 2.0 * M_PI * (k + 0.5) / N;
+        float phiMinus = 2.0 * M_PI * k / N;
+        Point uk = u * cos(phi) + v * sin(phi);
+        Point vkMinus = v * cos(phiMinus) - u * sin(phiMinus);
+        int kPrev = (k + N - 1) % N;
+        for(int j = 0; j < M; j++){
+          float sinMinus = sqrt((float) j / M);
+          float sinPlus = sqrt((float) (j + 1) / M);
+          float sinCenter = sqrt((j + 0.5) / M);
+          float cosCenter = sqrt(1.0 - sinCenter * sinCenter);
+          Point axis = (n ^ (n * cosCenter + uk * sinCenter)) / cosCenter;
+          Color &l = L[j * N + k];
+          
+          // rotation: how much each cell's light gains by turning the normal toward it
+          for(int c = 0; c < 3; c++)
+            rot[c] += axis * (l[c] / (M * N));
+          
+          // translation: changes between cells, over the distance to what is seen there
+          if(j > 0){
+            float cos2 = 1.0 - sinMinus * sinMinus;
+            float d = min(R[j * N + k], R[(j - 1) * N + k]);
+            Color dl = l - L[(j - 1) * N + k];
+            for(int c = 0; c < 3; c++)
+              trans[c] += uk * (2.0 * M_PI / N * sinMinus * cos2 / d * dl[c]);
+          }
+          float d = min(R[j * N + k], R[j * N + kPrev]);
+          Color dl = l - L[j * N + kPrev];
+          for(int c = 0; c < 3; c++)
+            trans[c] += vkMinus * ((sinPlus - sinMinus) / d * dl[c]);
+        }
+      }
+      for(int c = 0; c < 3; c++){
+        rec->rotGrad[c] = rot[c];
+        rec->transGrad[c] = trans[c] / M_PI;
+      }
+      return rec;
+    }
+};
+
+
 // irradiance map light definition (another type of indirect light)
 class IrradianceMapLight: public GenericLight{
   public:
@@ -308,16 +457,19 @@ class PhotonMapLight: public GenericLight{
     // get color from photon map
     Color illuminate(Point p, Point n){
       
-      // grab color from photon map
-      float *irrad = new float[3];
-      float *position = new float[3];
+      // grab color from photon map (or its precomputed irradiance)
+      float irrad[3], position[3], normal[3];
       p.GetValue(position);
-      float *normal = new float[3];
       n.GetValue(normal);
-      irradianceEstimate(pm, irrad, position, normal, photonRad, maxPhotons);
+      if(irradianceMap)
+        irradianceLookup(irradianceMap, irrad, position, normal, photonRad);
+      else if(photonGrid)
+        irradianceEstimateGrid(photonGrid, irrad, position, normal, photonRad);
+      else
+        irradianceEstimate(pm, irrad, position, normal, photonRad, maxPhotons);
       
-      // return color
-      return Color(irrad);
+      // return color (with caustics)
+      return Color(irrad) + caustics(position, normal);
     }
     
     // get direction of photon map light (non-sensical)
@@ -337,12 +489,45 @@ class PhotonMapLight: public GenericLight{
       maxPhotons = i;
     }
     
+    // set precomputed irradiance (used instead of estimates from the photon map, if set)
+    void setIrradianceMap(BalancedPhotonMap *map){
+      irradianceMap = map;
+    }
+    
+    // set photon grid (fixed radius estimates instead of the nearest photons, if set)
+    void setPhotonGrid(PhotonGrid *grid){
+      photonGrid = grid;
+    }
+    
+    // set caustic map (added at the shading point, if set)
+    void setCausticMap(BalancedPhotonMap *map, float f, int i){
+      causticMap = map;
+      causticRad = f;
+      maxCaustic = i;
+    }
+    
   private:
     
-    // photon map
+    // photon map, precomputed irradiance & photon grid
     BalancedPhotonMap *pm;
+    BalancedPhotonMap *irradianceMap = NULL;
+    PhotonGrid *photonGrid = NULL;
     float photonRad = 1.0;
     int maxPhotons = 10.0;
+    
+    // caustic map (smaller radius & fewer photons)
+    BalancedPhotonMap *causticMap = NULL;
+    float causticRad = 1.0;
+    int maxCaustic = 10;
+    
+    // caustics at a shading point
+    Color caustics(float position[3], float normal[3]){
+      if(!causticMap)
+        return Color(0.0, 0.0, 0.0);
+      float irrad[3];
+      irradianceEstimate(causticMap, irrad, position, normal, causticRad, maxCaustic);
+      return Color(irrad);
+    }
 };
 
 
@@ -356,60 +541,80 @@ class MonteCarloPhotonMapLight: public GenericLight{
     // get color of indirect light by tracing a new ray
     Color illuminate(Point p, Point n){
       
-      // color for shading
-      Color indirect;
+      // buffers for the samples of this thread (kept between calls, so they are not reallocated)
+      static thread_local vector<float> positions, normals, irrads, weights;
+      static thread_local vector<int> hits;
+      static thread_local vector<Color> misses;
+      positions.clear();
+      normals.clear();
+      weights.resize(samples);
+      hits.resize(samples);
+      misses.resize(samples);
       
-      // multi-sampling for indirect lighting
+      // trace all samples first (one tangent frame for all samples)
+      HemisphereSampler hemisphere = HemisphereSampler(n);
       for(int s = 0; s < samples; s++){
         
-        // randomize ray on a hemisphere
-        float phi = dist(rnd) * 2.0 * M_PI;
-        float the = acos(1.0 - 2.0 * dist(rnd)) / 2.0;
-        
-        // calculate hemisphere vectors
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % n > 0.5 || v0 % n < -0.5)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ n).GetNormalized();
-        v0 = (v1 ^ n).GetNormalized();
-        
-        // set up ray and hit info
-        Cone *r = new Cone();
-        r->pos = p;
-        r->dir = n.GetNormalized() * cos(the) + (v0 * cos(phi) + v1 * sin(  phi)) * sin(the);
+        // set up ray (cosine-weighted on the hemisphere, or toward the environment) and hit info
+        float weight;
+        Cone r = Cone();
+        r.pos = p;
+        r.dir = hemisphere.direction(s, weight);
         HitInfo hi = HitInfo();
+        weights[s] = weight;
         
-        // trace a new ray
-        bool hit = traceRay(*r, hi);
+        // trace a new ray (unless it has no weight)
+        bool hit = weight > 0.0 && traceRay(r, hi);
         
         // grab the node material hit
-        Material *m;
+        Material *m = NULL;
         if(hit){
           Node *n = hi.node;
           if(n)
             m = n->getMaterial();
         }
         
-        // shade our material
+        // keep the hit to look up in the photon map
         if(hit && m){
-          
-          // grab color from photon map
-          float *irrad = new float[3];
-          float *position = new float[3];
+          hits[s] = positions.size() / 3;
+          float position[3], normal[3];
           hi.p.GetValue(position);
-          float *normal = new float[3];
           hi.n.GetValue(normal);
-          irradianceEstimate(pm, irrad, position, normal, photonRad, maxPhotons);
-          
-          // update current color
-          indirect = (indirect * s + Color(irrad)) / (float) (s + 1);
+          positions.insert(positions.end(), position, position + 3);
+          normals.insert(normals.end(), normal, normal + 3);
         
         // otherwise, nothing to shade
-        }else
-          indirect = (indirect * s + environment.sampleEnvironment(r->dir)) / (float) (s + 1);
+        }else{
+          hits[s] = -1;
+          misses[s] = environment.sampleEnvironment(r.dir);
+        }
       }
       
-      // return the color
+      // grab the colors of all hits from the photon map at once (or their precomputed irradiance)
+      irrads.resize(positions.size());
+      if(irradianceMap){
+        for(int k = 0; k < (int) positions.size(); k += 3)
+          irradianceLookup(irradianceMap, &irrads[k], &positions[k], &normals[k], photonRad);
+      }else if(photonGrid){
+        for(int k = 0; k < (int) positions.size(); k += 3)
+          irradianceEstimateGrid(photonGrid, &irrads[k], &positions[k], &normals[k], photonRad);
+      }else
+        irradianceEstimateBatch(pm, irrads.data(), positions.data(), normals.data(), positions.size() / 3, photonRad, maxPhotons);
+      
+      // average the samples (in sample order)
+      Color indirect = Color(0.0, 0.0, 0.0);
+      for(int s = 0; s < samples; s++){
+        Color c = hits[s] < 0 ? misses[s] : Color(&irrads[3 * hits[s]]);
+        indirect = (indirect * s + c * weights[s]) / (float) (s + 1);
+      }
+      
+      // return the color (with caustics at the shading point)
+      if(causticMap){
+        float position[3], normal[3];
+        p.GetValue(position);
+        n.GetValue(normal);
+        indirect += caustics(position, normal);
+      }
       return indirect;
     }
     
@@ -430,6 +635,23 @@ class MonteCarloPhotonMapLight: public GenericLight{
       maxPhotons = i;
     }
     
+    // set precomputed irradiance (used instead of estimates from the photon map, if set)
+    void setIrradianceMap(BalancedPhotonMap *map){
+      irradianceMap = map;
+    }
+    
+    // set photon grid (fixed radius estimates instead of the nearest photons, if set)
+    void setPhotonGrid(PhotonGrid *grid){
+      photonGrid = grid;
+    }
+    
+    // set caustic map (added at the shading point, if set)
+    void setCausticMap(BalancedPhotonMap *map, float f, int i){
+      causticMap = map;
+      causticRad = f;
+      maxCaustic = i;
+    }
+    
     // set the environment
     void setEnvironment(TexturedColor c){
       environment = c;
@@ -442,20 +664,32 @@ class MonteCarloPhotonMapLight: public GenericLight{
     
   private:
     
-    // photon map
+    // photon map, precomputed irradiance & photon grid
     BalancedPhotonMap *pm;
+    BalancedPhotonMap *irradianceMap = NULL;
+    PhotonGrid *photonGrid = NULL;
     float photonRad = 1.0;
     int maxPhotons = 10.0;
     
+    // caustic map (smaller radius & fewer photons)
+    BalancedPhotonMap *causticMap = NULL;
+    float causticRad = 1.0;
+    int maxCaustic = 10;
+    
+    // caustics at a shading point
+    Color caustics(float position[3], float normal[3]){
+      if(!causticMap)
+        return Color(0.0, 0.0, 0.0);
+      float irrad[3];
+      irradianceEstimate(causticMap, irrad, position, normal, causticRad, maxCaustic);
+      return Color(irrad);
+    }
+    
     // environment variable
     TexturedColor environment;
     
     // number of samples for global illumination
     int samples;
-    
-    // setup random generator for global illumination
-    mt19937 rnd;
-    uniform_real_distribution<float> dist{0.0, 1.0};
 };
 
 
@@ -492,6 +726,16 @@ class DirectLight: public GenericLight{
       dir = d.GetNormalized();
     }
     
+    // extensions for path tracing
+    
+    // sample the direct light (a single direction, infinitely far away)
+    Color sampleDirect(Point p, float u1, float u2, Point &d, float &distance, float &pdf){
+      d = -dir;
+      distance = FLOAT_MAX;
+      pdf = 0.0;
+      return intensity * M_PI;
+    }
+    
   private:
     
     // intensity (or color) of light
@@ -528,6 +772,10 @@ class PointLight: public GenericLight{
         r.dir = position - p;
         return shadow(r, 1.0) * scale * intensity;
       
+      // with Sobol soft shadows, cast only as many shadow rays as the penumbra needs
+      }else if(sobolShadowSampling){
+        return softShadow(p) * scale * intensity;
+      
       // otherwise, we have a spherical light, cast multiple shadow rays
       }else{
         
@@ -623,8 +871,98 @@ class PointLight: public GenericLight{
       return intensity;
     }
     
-    // calculate a random photon from our point light source
-    Cone randomPhoton(){
+    // extensions for many-light sampling
+    
+    // position & radius of the point light
+    bool getPosition(Point &p, float &radius){
+      p = position;
+      radius = size;
+      return true;
+    }
+    
+    // power of the point light
+    float getPower(){
+      return intensity.Grey();
+    }
+    
+    // extensions for path tracing
+    
+    // sample the point light (or a direction within the cone of the spherical light)
+    Color sampleDirect(Point p, float u1, float u2, Point &dir, float &distance, float &pdf){
+      
+      // direction & distance to light center
+      Point w = position - p;
+      float d = w.Length();
+      w /= d;
+      
+      // for a point light (or from inside a spherical light)
+      if(size == 0.0 || d <= size){
+        dir = w;
+        distance = d;
+        pdf = 0.0;
+        
+        // calculate the inverse square fall-off
+        float scale = 1.0;
+        if(invSqFO)
+          scale /= d * d;
+        return intensity * M_PI * scale;
+      }
+      
+      // get two vectors for spanning the cone towards the sphere
+      Point v0 = Point(0.0, 1.0, 0.0);
+      if(v0 % w > 0.5 || v0 % w < -0.5)
+        v0 = Point(0.0, 0.0, 1.0);
+      Point v1 = (v0 ^ w).GetNormalized();
+      v0 = (v1 ^ w).GetNormalized();
+      
+      // sample a direction uniformly within the cone
+      float cosMax = sqrt(1.0 - size * size / (d * d));
+      float cosT = 1.0 - u1 * (1.0 - cosMax);
+      float sinT = sqrt(1.0 - cosT * cosT);
+      float phi = u2 * 2.0 * M_PI;
+      dir = w * cosT + (v0 * cos(phi) + v1 * sin(phi)) * sinT;
+      
+      // distance to the near side of the sphere
+      float b = dir % (p - position);
+      float c = (p - position).LengthSquared() - size * size;
+      float disc = b * b - c;
+      distance = -b - sqrt(disc > 0.0 ? disc : 0.0);
+      
+      // return the radiance over the pdf
+      pdf = 1.0 / (2.0 * M_PI * (1.0 - cosMax));
+      return radiance(d) / pdf;
+    }
+    
+    // intersect a ray with the spherical light
+    bool intersectLight(Cone &r, float &t, Color &rad, float &pdf){
+      
+      // point lights cannot be hit
+      if(size == 0.0)
+        return false;
+      
+      // ray-sphere intersection (outside of the light only)
+      Point dir = r.dir.GetNormalized();
+      Point oc = r.pos - position;
+      float b = oc % dir;
+      float c = oc % oc - size * size;
+      float disc = b * b - c;
+      if(c <= 0.0 || disc < 0.0)
+        return false;
+      t = (-b - sqrt(disc)) / r.dir.Length();
+      if(t <= 0.0)
+        return false;
+      
+      // radiance & pdf of sampling this direction with sampleDirect
+      float d = oc.Length();
+      float cosMax = sqrt(1.0 - size * size / (d * d));
+      pdf = 1.0 / (2.0 * M_PI * (1.0 - cosMax));
+      rad = radiance(d);
+      return true;
+    }
+    
+    // calculate a random photon from our point light source (with the caller's random generator)
+    // the direction is picked from the projection map, if given (uniform over its cells)
+    Cone randomPhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, ProjectionMap *projection = NULL){
       
       // location of point light
       Point p = position;
@@ -635,23 +973,32 @@ class PointLight: public GenericLight{
         // rejection sampling
         Point o = Point(size, size, size);
         while(o.LengthSquared() > size * size){
-          o.x = dist2(rnd) * size;
-          o.y = dist2(rnd) * size;
-          o.z = dist2(rnd) * size;
+          o.x = (dist(rnd) * 2.0 - 1.0) * size;
+          o.y = (dist(rnd) * 2.0 - 1.0) * size;
+          o.z = (dist(rnd) * 2.0 - 1.0) * size;
         }
         
         // set position
         p += o;
       }
       
+      // random light direction toward specular surfaces
+      if(projection){
+        float u1 = dist(rnd);
+        float u2 = dist(rnd);
+        float u3 = dist(rnd);
+        Point d = projection->sample(u1, u2, u3);
+        return Cone(p, d);
+      }
+      
       // rejection sampling for random light direction
       Point d = Point(1.0, 1.0, 1.0);
       while(d.LengthSquared() > 1.0){
-        d.x = dist2(rnd);
-        d.y = dist2(rnd);
-        d.z = dist2(rnd);
+        d.x = dist(rnd) * 2.0 - 1.0;
+        d.y = dist(rnd) * 2.0 - 1.0;
+        d.z = dist(rnd) * 2.0 - 1.0;
       }
-      d.GetNormalized();
+      d.Normalize();
       
       // return our random photon
       return Cone(p, d);
@@ -675,23 +1022,21 @@ class PointLight: public GenericLight{
     // random number generation for light disk rotation
     mt19937 rnd;
     uniform_real_distribution<float> dist{0.0, 1.0};
-    uniform_real_distribution<float> dist2{-1.0, 1.0};
     
     bool invSqFO = false;
     
+    // radiance of the spherical light, seen from distance d
+    // (matches the irradiance of the same point light at that distance)
+    Color radiance(float d){
+      Color L = intensity / (size * size);
+      if(!invSqFO)
+        L *= d * d;
+      return L;
+    }
+    
     // calculate a randomized light position on a spherical light
     Cone getShadowRay(Point p, int c, float r){
       
-      // get original direction
-      Point dir = (position - p).GetNormalized();
-      
-      // get two vectors for spanning our light disk
-      Point v0 = Point(0.0, 1.0, 0.0);
-      if(v0 % dir > 0.5 || v0 % dir < -0.5)
-        v0 = Point(0.0, 0.0, 1.0);
-      Point v1 = (v0 ^ dir).GetNormalized();
-      v0 = (v1 ^ dir).GetNormalized();
-      
       // grab Halton sequence to shift point along light disk
       // first four points on the perimeter of the disk
       float diskRad;
@@ -715,7 +1060,24 @@ class PointLight: public GenericLight{
         diskRot = Halton(c - 4, 3) * 2.0 * M_PI;
       
       // compute our semi-random position inside the disk
-      Point pos = position + (v0 * diskRad * cos(diskRot + r)) + (v1 * diskRad * sin(diskRot + r));
+      return getShadowRay(p, diskRad, diskRot + r);
+    }
+    
+    // calculate a shadow ray to a position on the light disk (given in polar coordinates)
+    Cone getShadowRay(Point p, float diskRad, float diskRot){
+      
+      // get original direction
+      Point dir = (position - p).GetNormalized();
+      
+      // get two vectors for spanning our light disk
+      Point v0 = Point(0.0, 1.0, 0.0);
+      if(v0 % dir > 0.5 || v0 % dir < -0.5)
+        v0 = Point(0.0, 0.0, 1.0);
+      Point v1 = (v0 ^ dir).GetNormalized();
+      v0 = (v1 ^ dir).GetNormalized();
+      
+      // position on the disk
+      Point pos = position + (v0 * diskRad * cos(diskRot)) + (v1 * diskRad * sin(diskRot));
       
       // shadow ray to return
       Cone ray = Cone();
@@ -723,5 +1085,36 @@ class PointLight: public GenericLight{
       ray.dir = pos - p;
       return ray;
     }
+    
+    // soft shadow from Sobol points on the light disk, scrambled for each pixel
+    // every batch of 8 points is stratified over the disk, so the first batch finds most penumbras,
+    // and casting stops once the (binomial) variance of the mean is small enough
+    float softShadow(Point p){
+      
+      // new scramble for this shading point
+      unsigned int s0 = nextScramble();
+      unsigned int s1 = nextScramble();
+      
+      // cast batches of shadow rays
+      int count = 0;
+      float lit = 0.0;
+      while(count < shadowMax){
+        for(int i = 0; i < 8 && count < shadowMax; i++, count++){
+          float diskRad = sqrt(Sobol(count, 0, s0)) * size;
+          float diskRot = Sobol(count, 1, s1) * 2.0 * M_PI;
+          lit += shadow(getShadowRay(p, diskRad, diskRot), 1.0);
+        }
+        
+        // stop when fully lit, fully shadowed, or the estimate is steady
+        float mean = lit / count;
+        if(mean * (1.0 - mean) / count <= shadowSampleVariance)
+          break;
+      }
+      
+      // let the pixel sampler know about the penumbra
+      if(lit > 0.0 && lit < count)
+        pixelPenumbra = true;
+      return lit / count;
+    }
 };
 }
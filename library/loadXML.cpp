@@ -131,6 +131,11 @@ int loadScene(string file, bool p = false, int min = 8, int max = 32, bool gi =
   }
   nodeMaterialList.clear();
   
+  // compile each material into its shading variant
+  int numMaterials = materials.size();
+  for(int i = 0; i < numMaterials; i++)
+    materials[i]->compile();
+  
   // load camera from file
   camera.init();
   camera.dir += camera.pos;
@@ -481,6 +486,16 @@ void loadMaterial(XMLElement *e){
           // print out absorption color
           if(print)
             cout << "  absorption " << c.r << " " << c.g << " " << c.b << endl;
+        
+        // load emission color
+        }else if(val == "emission"){
+          readColor(child, c);
+          m->setEmission(c);
+          m->setEmissionTexture(loadTexture(child));
+          
+          // print out emission color
+          if(print)
+            cout << "  emission " << c.r << " " << c.g << " " << c.b << endl;
         }
       }
     
@@ -559,6 +574,16 @@ void loadMaterial(XMLElement *e){
           // print out absorption color
           if(print)
             cout << "  absorption " << c.r << " " << c.g << " " << c.b << endl;
+        
+        // load emission color
+        }else if(val == "emission"){
+          readColor(child, c);
+          m->setEmission(c);
+          m->setEmissionTexture(loadTexture(child));
+          
+          // print out emission color
+          if(print)
+            cout << "  emission " << c.r << " " << c.g << " " << c.b << endl;
         }
       }
     
@@ -880,3 +905,58 @@ void readFloat(XMLElement *e, float &f, string name){
   e->QueryDoubleAttribute(name.c_str(), &d);
   f = (float) d;
 }
+
+
+// FNV-1a hash (64-bit) of some bytes, continuing from a previous hash
+unsigned long long hashBytes(const char *data, int n, unsigned long long h = 14695981039346656037ULL){
+  for(int i = 0; i < n; i++){
+    h ^= (unsigned char) data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+// hash the contents of a file (or just its name, if it cannot be read)
+unsigned long long hashFile(string file, unsigned long long h){
+  ifstream f(file.c_str(), ios::in | ios::binary);
+  if(!f)
+    return hashBytes(file.c_str(), file.size(), h);
+  stringstream ss;
+  ss << f.rdbuf();
+  string data = ss.str();
+  return hashBytes(data.c_str(), data.size(), h);
+}
+
+
+// hash the files used by scene elements (triangular meshes & textures)
+void hashElement(XMLElement *e, unsigned long long &h){
+  for(XMLElement *child = e->FirstChildElement(); child != NULL; child = child->NextSiblingElement()){
+    const char *type = child->Attribute("type");
+    const char *name = child->Attribute("name");
+    if(string(child->Value()) == "object" && type && name && string(type) == "obj")
+      h = hashFile("objects/" + string(name) + ".txt", h);
+    const char *texture = child->Attribute("texture");
+    if(texture)
+      h = hashFile("textures/" + string(texture), h);
+    hashElement(child, h);
+  }
+}
+
+
+// hash a scene (geometry, materials, lights & the files they use, but not the camera or image)
+// so caches computed for a scene can be reused as long as the scene stays the same
+unsigned long long hashScene(string file){
+  XMLDocument doc(file.c_str());
+  if(doc.LoadFile(file.c_str()))
+    return 0;
+  XMLElement *xml = doc.FirstChildElement("xml");
+  XMLElement *scene = xml ? xml->FirstChildElement("scene") : NULL;
+  if(!scene)
+    return 0;
+  XMLPrinter printer;
+  scene->Accept(&printer);
+  unsigned long long h = hashBytes(printer.CStr(), printer.CStrSize());
+  hashElement(scene, h);
+  return h;
+}
@@ -6,12 +6,24 @@
 using namespace scene;
 
 
-// blinn-phong material definition (shading)
-class BlinnMaterial: public Material{
+// surface material definition (shared by blinn-phong & phong shading)
+// the shading function is specialized at compile time into variants that
+// strip out the terms a material does not use (see compile)
+class SurfaceMaterial: public Material{
   public:
-  
-    // constructor
-    BlinnMaterial(){
+    
+    // shading variants, from cheapest to most general
+    enum Variant{
+      DIFFUSE_ONLY,
+      DIFFUSE_SPECULAR,
+      MIRROR,
+      DIELECTRIC,
+      GLOSSY
+    };
+    
+    // constructor (blinn-phong or phong specular highlights)
+    SurfaceMaterial(bool b){
+      blinn = b;
       diffuse.setColor(0.5, 0.5, 0.5);
       specular.setColor(0.7, 0.7, 0.7);
       shininess = 20.0;
@@ -22,245 +34,50 @@ class BlinnMaterial: public Material{
       reflectionGlossiness = 0.0;
       refractionGlossiness = 0.0;
       emission.setColor(0.0, 0.0, 0.0);
+      
+      // the most general variant is correct for any settings, until compiled
+      variant = GLOSSY;
+      direct = true;
+      emits = true;
+      shader = selectShader(blinn, variant);
     }
     
-    // shading function (blinn-phong)
+    // shading function (calls the compiled variant)
     Color shade(Cone &r, HitInfo &h, LightList &lights, int bounceCount = 1){
+      return (this->*shader)(r, h, lights, bounceCount);
+    }
+    
+    // choose the cheapest shading variant for the loaded material settings
+    void compile(){
       
-      // initialize color at pixel
-      Color c;
-      c.Set(0.0, 0.0, 0.0);
-      
-      // update texture colors from texture
-      Color diff = diffuse.sample(h.uvw, h.duvw);
-      Color spec = specular.sample(h.uvw, h.duvw);
-      Color refl = reflection.sample(h.uvw, h.duvw);
-      Color refr = refraction.sample(h.uvw, h.duvw);
-      
-      // add shading from each light (back & front hits)
-      int numLights = lights.size();
-      for(int i = 0; i < numLights; i++){
-        
-        // grab light
-        Light *light = lights[i];
-        
-        // ambient / indirect light check
-        if(light->isAmbient() && h.front){
-          
-          // add ambient / indirect lighting term
-          c += diff * light->illuminate(h.p, h.n);
-        
-        // otherwise, add diffuse and specular components from light
-        }else{
-          
-          // grab vector to light
-          Point l = -light->direction(h.p);
-          l.Normalize();
-          
-          // grab vector to camera
-          Point v = -r.dir;
-          v.Normalize();
-          
-          // grab normal
-          Point n = h.n;
-          n.Normalize();
-          
-          // calculate geometry term
-          float geom = n % l;
-          
-          // calculate half-way vector
-          Point half = v + l;
-          half.Normalize();
-          
-          // calculate total specular factor
-          float s = pow(half % n, shininess);
-          
-          // add specular and diffuse lighting terms (only if positive)
-          if(geom > 0)
-            c += light->illuminate(h.p, h.n) * geom * (diff + s * spec);
-        }
-      }
-      
-      // for smooth objects, set normal
-      Point normRefl, normRefr;
-      if(reflectionGlossiness == 0.0 && refractionGlossiness == 0.0){
-        normRefl = h.n;
-        normRefr = h.n;
-      
-      // otherwise, jitter the normal
-      }else{
-        
-        // get two vectors for spanning our normal
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % h.n < -0.9 || v0 % h.n > 0.9)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ h.n).GetNormalized();
-        
-        // compute randomization about the normal
-        float rad = sqrt(dist(rnd));
-        float radRefl = rad * reflectionGlossiness;
-        float radRefr = rad * refractionGlossiness;
-        float rot = dist(rnd) * 2.0 * M_PI;
-        
-        // compute new normal
-        Point norm1 = (h.n + (v0 * radRefl * cos(rot)) + (v1 * radRefl * sin(rot))).GetNormalized();
-        Point norm2 = (h.n + (v0 * radRefr * cos(rot)) + (v1 * radRefr * sin(rot))).GetNormalized();
-        
-        // determine which gets the new normal
-        if(reflectionGlossiness == 0.0)
-          normRefl = h.n;
-        else
-          normRefl = norm1;
-        if(refractionGlossiness == 0.0)
-          normRefr = h.n;
-        else
-          normRefr = norm2;
-      }
-      
-      // calculate and add reflection color (till out of bounces)
-      Color reflectionShade;
-      reflectionShade.Set(0.0, 0.0, 0.0);
-      
-      if(bounceCount > 0 && (refl.Grey() != 0.0 || refr.Grey() != 0.0)){
-        
-        // create reflected vector (normalize!)
-        Cone *reflect = new Cone();
-        reflect->pos = h.p;
-        reflect->dir = (2 * (normRefl % -r.dir) * normRefl + r.dir).GetNormalized();
-        
-        // update cones for texture filtering
-        reflect->radius = r.radiusAt(h.z);
-        reflect->tan = r.tan;
-        
-        // create and store reflected hit info
-        HitInfo reflectHI = HitInfo();
-        bool reflectHit = traceRay(*reflect, reflectHI);
-        
-        // grab the node material hit
-        if(reflectHit){
-          Node *n = reflectHI.node;
-          Material *m;
-          if(n)
-            m = n->getMaterial();
-          
-          // for the material, recursively add reflections, within bounce count
-          if(m)
-            reflectionShade = m->shade(*reflect, reflectHI, lights, bounceCount - 1);
-          
-          // for no material, show the hit
-          else
-            reflectionShade = Color(0.929, 0.929, 0.929);
-          
-          // only add reflection color for front hits
-          if(h.front)
-            c += refl * reflectionShade;
-        
-        // ray hits environment texture
-        }else{
-          Color env = environment.sampleEnvironment(reflect->dir);
-          c += refl * env;
-        }
-      }
+      // terms with a black base color contribute nothing (textures are modulated by it)
+      bool diff = active(diffuse);
+      bool spec = active(specular);
+      bool refl = active(reflection);
+      bool refr = active(refraction);
+      bool gloss = reflectionGlossiness != 0.0 || refractionGlossiness != 0.0;
       
-      // add refraction color (front and back face hits)
-      if(bounceCount > 0 && refraction.getColor().Grey() != 0.0){
-        
-        // create refracted vector
-        Cone *refract = new Cone();
-        refract->pos = h.p;
-        
-        // update cones for texture filtering
-        refract->radius = r.radiusAt(h.z);
-        refract->tan = r.tan;
-        
-        // variables for refraction calculation
-        Point v = -r.dir;
-        Point n;
-        float n1;
-        float n2;
-        
-        // handle front-face and back-face hits accordingly
-        if(h.front){
-          n1 = 1.0;
-          n2 = index;
-          n = normRefr;
-        }else{
-          n1 = index;
-          n2 = 1.0;
-          n = -normRefr;
-        }
-        
-        // calculate refraction ray direction
-        float c1 = n % v;
-        float s1 = sqrt(1.0 - c1 * c1);
-        float s2 = n1 / n2 * s1;
-        float c2 = sqrt(1.0 - s2 * s2);
-        Point p = (v - c1 * n).GetNormalized();
-        Point pt = s2 * -p;
-        Point nt = c2 * -n;
-        
-        // store ray direction (normalize!)
-        refract->dir = (pt + nt).GetNormalized();
-        
-        // only cast rays if not total internal reflection
-        if(s2 * s2 <= 1.0){
-            
-          // create and store refracted hit info
-          HitInfo refractHI = HitInfo();
-          bool refractHit = traceRay(*refract, refractHI);
-          
-          // grab the node material hit
-          if(refractHit){
-            Node *n = refractHI.node;
-            Material *m;
-            if(n)
-              m = n->getMaterial();
-            
-            // for the material, recursively add refractions, within bounce count
-            Color refractionShade = Color(0.0, 0.0, 0.0);
-            if(m)
-              refractionShade = m->shade(*refract, refractHI, lights, bounceCount - 1);
-            
-            // for no material, show the hit
-            else
-              refractionShade = Color(0.929, 0.929, 0.929);
-            
-            // Schlick's approximation for transmittance vs. reflectance
-            float r0 = (n1 - n2) / (n1 + n2);
-            r0 *= r0;
-            float r;
-            if(n1 <= n2)
-              r = r0 + (1.0 - r0) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1);
-            else
-              r = r0 + (1.0 - r0) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2);
-            float t = 1.0 - r;
-            
-            // compute total refraction color
-            Color refractionColor = refr * (t * refractionShade + r * reflectionShade);
-            
-            // attenuate refraction color by absorption
-            if(!refractHI.front){
-              refractionColor.r *= exp(-absorption.r * refractHI.z);
-              refractionColor.g *= exp(-absorption.g * refractHI.z);
-              refractionColor.b *= exp(-absorption.b * refractHI.z);
-            }
-            
-            // add refraction color
-            c += refractionColor;
-          
-          // ray hits environment texture
-          }else{
-            Color env = environment.sampleEnvironment(refract->dir);
-            c += env;
-          }
-        
-        // for total internal reflection
-        }else
-          c += refr * reflectionShade;
-      }
+      // pick the variant
+      if((refl || refr) && gloss)
+        variant = GLOSSY;
+      else if(refr)
+        variant = DIELECTRIC;
+      else if(refl)
+        variant = MIRROR;
+      else if(spec)
+        variant = DIFFUSE_SPECULAR;
+      else
+        variant = DIFFUSE_ONLY;
       
-      // return final shaded color
-      return c;
+      // skip the light loop entirely when neither diffuse nor specular terms exist
+      direct = diff || spec;
+      emits = active(emission);
+      shader = selectShader(blinn, variant);
+    }
+    
+    // get the compiled shading variant
+    Variant getVariant(){
+      return variant;
     }
     
     // set the diffuse color of the material
@@ -343,6 +160,148 @@ class BlinnMaterial: public Material{
       refractionGlossiness = gloss;
     }
     
+    // extensions for iterative path tracing
+    
+    // pick one reflection or refraction lobe at random, weighted by its contribution
+    // updates the path's cone, throughput and absorption, false when the path ends here
+    bool sampleBounce(Cone &r, HitInfo &h, Color &throughput, Color &absorb, float u){
+      
+      // weights & directions of the reflected and refracted lobes
+      Color wRefl, wRefr;
+      Point dirRefl, dirRefr;
+      specularLobes(r, h, wRefl, wRefr, dirRefl, dirRefr);
+      
+      // probabilities of each lobe
+      float pRefl = wRefl.Grey();
+      float pRefr = wRefr.Grey();
+      float pTot = pRefl + pRefr;
+      if(pTot <= 0.0)
+        return false;
+      
+      // update cone for texture filtering
+      r.radius = r.radiusAt(h.z);
+      r.pos = h.p;
+      
+      // follow the reflected lobe
+      if(u * pTot < pRefl){
+        r.dir = dirRefl;
+        throughput *= wRefl * (pTot / pRefl);
+        absorb.Set(0.0, 0.0, 0.0);
+      
+      // follow the refracted lobe (attenuated if it exits through a back face)
+      }else{
+        r.dir = dirRefr;
+        throughput *= wRefr * (pTot / pRefr);
+        absorb = absorption;
+      }
+      return true;
+    }
+    
+    // extensions for path tracing
+    
+    // emitted radiance at a hit
+    Color getEmission(HitInfo &h){
+      return emission.sample(h.uvw, h.duvw);
+    }
+    
+    // evaluate the diffuse & highlight BRDF times the cosine for light from direction l
+    // also returns the solid angle pdf that sampleBSDF would use for that direction
+    Color evalBSDF(Cone &r, HitInfo &h, Point &l, float &pdf){
+      
+      // update texture colors from texture
+      Color diff = diffuse.sample(h.uvw, h.duvw);
+      Color spec = specular.sample(h.uvw, h.duvw);
+      
+      // probability of picking the diffuse lobe
+      Color wRefl, wRefr;
+      Point dirRefl, dirRefr;
+      specularLobes(r, h, wRefl, wRefr, dirRefl, dirRefr);
+      float pDiff = (diff + spec).Grey();
+      float pTot = pDiff + wRefl.Grey() + wRefr.Grey();
+      
+      // no light from below the surface
+      Point n = facingNormal(r, h);
+      float geom = n % l;
+      if(pDiff <= 0.0 || geom <= 0.0){
+        pdf = 0.0;
+        return Color(0.0, 0.0, 0.0);
+      }
+      
+      // cosine-weighted hemisphere pdf
+      pdf = (pDiff / pTot) * geom / M_PI;
+      return brdf(r, n, l, diff, spec) * geom;
+    }
+    
+    // sample the next path direction from the diffuse, reflected or refracted lobe
+    // updates the path's cone, throughput and absorption of the current medium
+    // the pdf is returned in solid angle, or 0 for (specular) reflections and refractions
+    bool sampleBSDF(Cone &r, HitInfo &h, Color &throughput, Color &absorb, float &pdf, float u0, float u1, float u2){
+      
+      // update texture colors from texture
+      Color diff = diffuse.sample(h.uvw, h.duvw);
+      Color spec = specular.sample(h.uvw, h.duvw);
+      
+      // weights & directions of the reflected and refracted lobes
+      Color wRefl, wRefr;
+      Point dirRefl, dirRefr;
+      specularLobes(r, h, wRefl, wRefr, dirRefl, dirRefr);
+      
+      // probabilities of each lobe
+      float pDiff = (diff + spec).Grey();
+      float pRefl = wRefl.Grey();
+      float pRefr = wRefr.Grey();
+      float pTot = pDiff + pRefl + pRefr;
+      if(pTot <= 0.0)
+        return false;
+      
+      // update cone for texture filtering
+      Point n = facingNormal(r, h);
+      r.radius = r.radiusAt(h.z);
+      r.pos = h.p;
+      
+      // follow the diffuse lobe (cosine-weighted hemisphere)
+      float u = u0 * pTot;
+      if(u < pDiff){
+        
+        // calculate hemisphere vectors
+        Point v0 = Point(0.0, 1.0, 0.0);
+        if(v0 % n > 0.5 || v0 % n < -0.5)
+          v0 = Point(0.0, 0.0, 1.0);
+        Point v1 = (v0 ^ n).GetNormalized();
+        v0 = (v1 ^ n).GetNormalized();
+        
+        // calculate cosine-weighted direction
+        float phi = u1 * 2.0 * M_PI;
+        float sinT = sqrt(u2);
+        float cosT = sqrt(1.0 - u2);
+        Point l = n * cosT + (v0 * cos(phi) + v1 * sin(phi)) * sinT;
+        
+        // weight by the brdf (the cosine cancels with the pdf)
+        pdf = (pDiff / pTot) * cosT / M_PI;
+        if(pdf <= 0.0)
+          return false;
+        throughput *= brdf(r, n, l, diff, spec) * (cosT / pdf);
+        r.dir = l;
+      
+      // follow the reflected lobe (same medium)
+      }else if(u < pDiff + pRefl){
+        pdf = 0.0;
+        r.dir = dirRefl;
+        throughput *= wRefl * (pTot / pRefl);
+      
+      // follow the refracted lobe (entering or leaving the medium)
+      }else{
+        pdf = 0.0;
+        r.dir = dirRefr;
+        throughput *= wRefr * (pTot / pRefr);
+        if(h.front)
+          absorb = absorption;
+        else
+          absorb.Set(0.0, 0.0, 0.0);
+      }
+      return true;
+    }
+    
     // extensions for photon mapping
     
     // store the hit for the surface if true
@@ -350,8 +309,19 @@ class BlinnMaterial: public Material{
       return diffuse.getColor().Grey() > 0.0;
     }
     
-    // trace our next random photon through the scene if true
-    bool randomPhotonBounce(Cone &r, Color &c, HitInfo &h){
+    // diffuse color at a hit (what photons arriving there are seen with)
+    Color getDiffuse(HitInfo &h){
+      return diffuse.sample(h.uvw, h.duvw);
+    }
+    
+    // reflective or refractive surfaces can focus photons into caustics
+    bool isSpecularSurface(){
+      return reflection.getColor().Grey() > 0.0 || refraction.getColor().Grey() > 0.0;
+    }
+    
+    // trace our next random photon through the scene if true (with the caller's random generator)
+    // also reports whether the photon was reflected or refracted (instead of diffusely reflected)
+    bool randomPhotonBounce(Cone &r, Color &c, HitInfo &h, mt19937 &rnd, uniform_real_distribution<float> &dist, bool &specular){
       
       // store probabilities of each color
       float pReflDiff, pReflSpec, pRefr;
@@ -371,6 +341,7 @@ class BlinnMaterial: public Material{
       
       // get random component for material interaction
       float rand = dist(rnd);
+      specular = rand >= pReflDiff;
       
       // diffuse reflection
       if(rand < pReflDiff){
@@ -465,6 +436,22 @@ class BlinnMaterial: public Material{
     
   private:
     
+    // shading function type (one per compiled variant)
+    typedef Color (SurfaceMaterial::*Shader)(Cone &r, HitInfo &h, LightList &lights, int bounceCount);
+    
+    // compiled shading variant
+    Variant variant;
+    Shader shader;
+    
+    // whether to use blinn-phong (or phong) specular highlights
+    bool blinn;
+    
+    // whether any light loop (diffuse or specular) is needed
+    bool direct;
+    
+    // whether the material emits light
+    bool emits;
+    
     // colors for shading
     TexturedColor diffuse, specular;
     
@@ -492,149 +479,306 @@ class BlinnMaterial: public Material{
     
     // calculate emission color
     TexturedColor emission;
-};
-
-
-// phong material definition (shading)
-// blinn-phong material definition (shading)
-class PhongMaterial: public Material{
-  public:
-  
-    // constructor
-    PhongMaterial(){
-      diffuse.setColor(0.5, 0.5, 0.5);
-      specular.setColor(0.7, 0.7, 0.7);
-      shininess = 20.0;
-      reflection.setColor(0.0, 0.0, 0.0);
-      refraction.setColor(0.0, 0.0, 0.0);
-      absorption.Set(0.0, 0.0, 0.0);
-      index = 1.0;
-      reflectionGlossiness = 0.0;
-      refractionGlossiness = 0.0;
-      emission.setColor(0.0, 0.0, 0.0);
+    
+    // whether a textured color can contribute at all
+    static bool active(TexturedColor &c){
+      return c.getColor().Grey() != 0.0;
     }
     
-    // shading function (phong)
-    Color shade(Cone &r, HitInfo &h, LightList &lights, int bounceCount = 1){
+    // normal on the side of the surface the ray arrives from
+    Point facingNormal(Cone &r, HitInfo &h){
+      Point n = h.n.GetNormalized();
+      if(n % r.dir > 0.0)
+        n = -n;
+      return n;
+    }
+    
+    // diffuse & highlight BRDF for light from direction l (normalized to match the shade terms)
+    Color brdf(Cone &r, Point &n, Point &l, Color &diff, Color &spec){
       
-      // initialize color at pixel
-      Color c;
-      c.Set(0.0, 0.0, 0.0);
+      // grab vector to camera
+      Point v = -r.dir;
+      v.Normalize();
+      
+      // calculate total specular factor (blinn-phong or phong)
+      float s;
+      if(blinn){
+        Point half = v + l;
+        half.Normalize();
+        s = pow(half % n, shininess);
+      }else{
+        Point lr = l - 2.0 * (l % n) * n;
+        s = pow(lr % v, shininess);
+      }
+      return (diff + s * spec) / M_PI;
+    }
+    
+    // weights & directions of the reflected and refracted lobes at a hit
+    // (refractions are split by fresnel, and reflections only count on front hits, as in shade)
+    void specularLobes(Cone &r, HitInfo &h, Color &wRefl, Color &wRefr, Point &dirRefl, Point &dirRefr){
+      wRefl.Set(0.0, 0.0, 0.0);
+      wRefr.Set(0.0, 0.0, 0.0);
+      
+      // only variants with reflections or refractions have these lobes
+      if(variant < MIRROR)
+        return;
       
       // update texture colors from texture
-      Color diff = diffuse.sample(h.uvw, h.duvw);
-      Color spec = specular.sample(h.uvw, h.duvw);
       Color refl = reflection.sample(h.uvw, h.duvw);
-      Color refr = refraction.sample(h.uvw, h.duvw);
-      
-      // add shading from each light (back & front hits)
-      int numLights = lights.size();
-      for(int i = 0; i < numLights; i++){
-        
-        // grab light
-        Light *light = lights[i];
+      Color refr = Color(0.0, 0.0, 0.0);
+      if(variant >= DIELECTRIC)
+        refr = refraction.sample(h.uvw, h.duvw);
+      
+      // for smooth objects, keep the normal (otherwise, jitter it)
+      Point normRefl = h.n, normRefr = h.n;
+      if(variant == GLOSSY)
+        glossyNormals(h, normRefl, normRefr);
+      
+      // reflected lobe
+      if(h.front)
+        wRefl = refl;
+      dirRefl = (2 * (normRefl % -r.dir) * normRefl + r.dir).GetNormalized();
+      
+      // split refraction into transmitted and reflected parts
+      float fresnel;
+      if(refr.Grey() != 0.0){
+        if(refractDirection(r.dir, normRefr, h.front, dirRefr, fresnel)){
+          wRefl += refr * fresnel;
+          wRefr = refr * (1.0 - fresnel);
         
-        // ambient light check
-        if(light->isAmbient() && h.front){
-          
-          // add ambient lighting term
-          c += diff * light->illuminate(h.p, h.n);
-        
-        // otherwise, add diffuse and specular components from light
-        }else{
-          
-          // grab vector to light
-          Point l = -light->direction(h.p);
-          l.Normalize();
-          
-          // grab vector to camera
-          Point v = -r.dir;
-          v.Normalize();
-          
-          // grab normal
-          Point n = h.n;
-          n.Normalize();
-          
-          // calculate geometry term
-          float geom = n % l;
-          
-          // calculate reflection vector
-          Point refl = l - 2.0 * (l % n) * n;
-          
-          // calculate total specular factor
-          // (adjusted shininess to match blinn-phong values)
-          float s = pow(refl % v, shininess);
-          
-          // add specular and diffuse lighting terms (only if positive)
-          if(geom > 0)
-            c += light->illuminate(h.p, h.n) * geom * (diff + s * spec);
-        }
+        // for total internal reflection
+        }else
+          wRefl += refr;
       }
+    }
+    
+    // jitter the reflection & refraction normals for glossy surfaces
+    void glossyNormals(HitInfo &h, Point &normRefl, Point &normRefr){
+      
+      // smooth surfaces keep their normals
+      if(reflectionGlossiness == 0.0 && refractionGlossiness == 0.0)
+        return;
       
-      // for smooth objects, set normal
-      Point normRefl, normRefr;
-      if(reflectionGlossiness == 0.0 && refractionGlossiness == 0.0){
-        normRefl = h.n;
-        normRefr = h.n;
+      // get two vectors for spanning our normal
+      Point v0 = Point(0.0, 1.0, 0.0);
+      if(v0 % h.n < -0.9 || v0 % h.n > 0.9)
+        v0 = Point(0.0, 0.0, 1.0);
+      Point v1 = (v0 ^ h.n).GetNormalized();
       
-      // otherwise, jitter the normal
+      // compute randomization about the normal
+      float rad = sqrt(dist(rnd));
+      float radRefl = rad * reflectionGlossiness;
+      float radRefr = rad * refractionGlossiness;
+      float rot = dist(rnd) * 2.0 * M_PI;
+      
+      // compute new normals (only for glossy terms)
+      if(reflectionGlossiness != 0.0)
+        normRefl = (h.n + (v0 * radRefl * cos(rot)) + (v1 * radRefl * sin(rot))).GetNormalized();
+      if(refractionGlossiness != 0.0)
+        normRefr = (h.n + (v0 * radRefr * cos(rot)) + (v1 * radRefr * sin(rot))).GetNormalized();
+    }
+    
+    // calculate the refracted direction through the surface (false for total internal reflection)
+    // also returns the fresnel reflectance, using Schlick's approximation
+    bool refractDirection(Point &dir, Point &normal, bool front, Point &refracted, float &fresnel){
+      
+      // variables for refraction calculation
+      Point v = -dir;
+      Point n;
+      float n1;
+      float n2;
+      
+      // handle front-face and back-face hits accordingly
+      if(front){
+        n1 = 1.0;
+        n2 = index;
+        n = normal;
       }else{
+        n1 = index;
+        n2 = 1.0;
+        n = -normal;
+      }
+      
+      // calculate refraction ray direction
+      float c1 = n % v;
+      float s1 = sqrt(1.0 - c1 * c1);
+      float s2 = n1 / n2 * s1;
+      if(s2 * s2 <= 1.0){
+        float c2 = sqrt(1.0 - s2 * s2);
+        Point p = (v - c1 * n).GetNormalized();
+        Point pt = s2 * -p;
+        Point nt = c2 * -n;
+        refracted = (pt + nt).GetNormalized();
         
-        // get two vectors for spanning our normal
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % h.n < -0.9 || v0 % h.n > 0.9)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ h.n).GetNormalized();
+        // Schlick's approximation for transmittance vs. reflectance
+        float r0 = (n1 - n2) / (n1 + n2);
+        r0 *= r0;
+        if(n1 <= n2)
+          fresnel = r0 + (1.0 - r0) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1);
+        else
+          fresnel = r0 + (1.0 - r0) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2);
+        return true;
+      }
+      
+      // total internal reflection
+      return false;
+    }
+    
+    // look up the specialized shading function for a variant
+    static Shader selectShader(bool blinn, Variant v){
+      switch(v){
+        case DIFFUSE_ONLY:
+          return blinn ? &SurfaceMaterial::shadeVariant<true, DIFFUSE_ONLY> : &SurfaceMaterial::shadeVariant<false, DIFFUSE_ONLY>;
+        case DIFFUSE_SPECULAR:
+          return blinn ? &SurfaceMaterial::shadeVariant<true, DIFFUSE_SPECULAR> : &SurfaceMaterial::shadeVariant<false, DIFFUSE_SPECULAR>;
+        case MIRROR:
+          return blinn ? &SurfaceMaterial::shadeVariant<true, MIRROR> : &SurfaceMaterial::shadeVariant<false, MIRROR>;
+        case DIELECTRIC:
+          return blinn ? &SurfaceMaterial::shadeVariant<true, DIELECTRIC> : &SurfaceMaterial::shadeVariant<false, DIELECTRIC>;
+        default:
+          return blinn ? &SurfaceMaterial::shadeVariant<true, GLOSSY> : &SurfaceMaterial::shadeVariant<false, GLOSSY>;
+      }
+    }
+    
+    // diffuse and specular shading from a single (non-ambient) light
+    template <bool isBlinn, bool highlight> Color lightShade(Light *light, Cone &r, HitInfo &h, Color &diff, Color &spec){
+      
+      // grab vector to light
+      Point l = -light->direction(h.p);
+      l.Normalize();
+      
+      // grab normal
+      Point n = h.n;
+      n.Normalize();
+      
+      // calculate geometry term
+      float geom = n % l;
+      
+      // add specular and diffuse lighting terms (only if positive, which also skips
+      // the undefined direction of ambient lights on back faces)
+      if(!(geom > 0))
+        return Color(0.0, 0.0, 0.0);
+      
+      // diffuse only
+      if(!highlight)
+        return light->illuminate(h.p, h.n) * geom * diff;
+      
+      // grab vector to camera
+      Point v = -r.dir;
+      v.Normalize();
+      
+      // blinn-phong: half-way vector
+      float s;
+      if(isBlinn){
+        Point half = v + l;
+        half.Normalize();
+        s = pow(half % n, shininess);
+      
+      // phong: reflection vector
+      // (adjusted shininess to match blinn-phong values)
+      }else{
+        Point lr = l - 2.0 * (l % n) * n;
+        s = pow(lr % v, shininess);
+      }
+      return light->illuminate(h.p, h.n) * geom * (diff + s * spec);
+    }
+    
+    // shading function, specialized per variant (blinn-phong or phong highlights)
+    // terms not in the variant are removed at compile time, along with their texture lookups
+    template <bool isBlinn, int variantType> Color shadeVariant(Cone &r, HitInfo &h, LightList &lights, int bounceCount){
+      
+      // terms used by this variant
+      const bool highlight = variantType != DIFFUSE_ONLY;
+      const bool reflects = variantType >= MIRROR;
+      const bool refracts = variantType >= DIELECTRIC;
+      const bool glossy = variantType == GLOSSY;
+      
+      // initialize color at pixel (with any emitted light)
+      Color c;
+      c.Set(0.0, 0.0, 0.0);
+      if(emits)
+        c += emission.sample(h.uvw, h.duvw);
+      
+      // update texture colors from texture (only the terms in use)
+      Color diff = diffuse.sample(h.uvw, h.duvw);
+      Color spec = highlight ? specular.sample(h.uvw, h.duvw) : Color(0.0, 0.0, 0.0);
+      Color refl = reflects ? reflection.sample(h.uvw, h.duvw) : Color(0.0, 0.0, 0.0);
+      Color refr = refracts ? refraction.sample(h.uvw, h.duvw) : Color(0.0, 0.0, 0.0);
+      
+      // add shading from each light (back & front hits)
+      // lights in a light tree are not looped over, but picked a few at a time
+      int numLights = direct ? lights.size() : 0;
+      int skipFrom = lights.tree ? lights.treeStart : numLights;
+      for(int i = 0; i < numLights; i++){
         
-        // compute randomization about the normal
-        float rad = sqrt(dist(rnd));
-        float radRefl = rad * reflectionGlossiness;
-        float radRefr = rad * refractionGlossiness;
-        float rot = dist(rnd) * 2.0 * M_PI;
+        // skip over lights in the tree
+        if(i == skipFrom)
+          i = lights.treeEnd;
+        if(i >= numLights)
+          break;
         
-        // compute new normal
-        Point norm1 = (h.n + (v0 * radRefl * cos(rot)) + (v1 * radRefl * sin(rot))).GetNormalized();
-        Point norm2 = (h.n + (v0 * radRefr * cos(rot)) + (v1 * radRefr * sin(rot))).GetNormalized();
+        // grab light
+        Light *light = lights[i];
         
-        // determine which gets the new normal
-        if(reflectionGlossiness == 0.0)
-          normRefl = h.n;
-        else
-          normRefl = norm1;
-        if(refractionGlossiness == 0.0)
-          normRefr = h.n;
-        else
-          normRefr = norm2;
+        // ambient / indirect light check
+        if(light->isAmbient() && h.front){
+          
+          // add ambient / indirect lighting term
+          c += diff * light->illuminate(h.p, h.n);
+        
+        // otherwise, add diffuse and specular components from light
+        }else
+          c += lightShade<isBlinn, highlight>(light, r, h, diff, spec);
+      }
+      
+      // pick lights from the light tree by their estimated contribution (weighted by their probability)
+      if(direct && lights.tree){
+        int samples = lights.treeSamples;
+        for(int i = 0; i < samples; i++){
+          float pdf;
+          Light *light = lights.tree->pick(h.p, h.n, pixelRandom(), pdf);
+          if(light)
+            c += lightShade<isBlinn, highlight>(light, r, h, diff, spec) / (pdf * samples);
+        }
       }
       
-      // calculate and add reflection color (till out of bounces)
+      // stop here without reflections or refractions
+      if(!reflects || bounceCount <= 0)
+        return c;
+      
+      // for smooth objects, keep the normal (otherwise, jitter it)
+      Point normRefl = h.n, normRefr = h.n;
+      if(glossy)
+        glossyNormals(h, normRefl, normRefr);
+      
+      // calculate and add reflection color (also needed for the refraction's fresnel term)
       Color reflectionShade;
       reflectionShade.Set(0.0, 0.0, 0.0);
-      if(bounceCount > 0 && (refl.Grey() != 0.0 || refr.Grey() != 0.0)){
+      if(refl.Grey() != 0.0 || refr.Grey() != 0.0){
         
         // create reflected vector (normalize!)
-        Cone *reflect = new Cone();
-        reflect->pos = h.p;
-        reflect->dir = (2 * (normRefl % -r.dir) * normRefl + r.dir).GetNormalized();
+        Cone reflect;
+        reflect.pos = h.p;
+        reflect.dir = (2 * (normRefl % -r.dir) * normRefl + r.dir).GetNormalized();
         
         // update cones for texture filtering
-        reflect->radius = r.radiusAt(h.z);
-        reflect->tan = r.tan;
+        reflect.radius = r.radiusAt(h.z);
+        reflect.tan = r.tan;
         
         // create and store reflected hit info
         HitInfo reflectHI = HitInfo();
-        bool reflectHit = traceRay(*reflect, reflectHI);
+        bool reflectHit = traceRay(reflect, reflectHI);
         
         // grab the node material hit
         if(reflectHit){
           Node *n = reflectHI.node;
-          Material *m;
+          Material *m = NULL;
           if(n)
             m = n->getMaterial();
           
           // for the material, recursively add reflections, within bounce count
           if(m)
-            reflectionShade = m->shade(*reflect, reflectHI, lights, bounceCount - 1);
+            reflectionShade = m->shade(reflect, reflectHI, lights, bounceCount - 1);
           
           // for no material, show the hit
           else
@@ -646,82 +790,50 @@ class PhongMaterial: public Material{
         
         // ray hits environment texture
         }else{
-          Color env = environment.sampleEnvironment(reflect->dir);
+          Color env = environment.sampleEnvironment(reflect.dir);
           c += refl * env;
         }
       }
       
       // add refraction color (front and back face hits)
-      if(bounceCount > 0 && refr.Grey() != 0.0){
+      if(refracts && refr.Grey() != 0.0){
         
         // create refracted vector
-        Cone *refract = new Cone();
-        refract->pos = h.p;
+        Cone refract;
+        refract.pos = h.p;
         
         // update cones for texture filtering
-        refract->radius = r.radiusAt(h.z);
-        refract->tan = r.tan;
-        
-        // variables for refraction calculation
-        Point v = -r.dir;
-        Point n;
-        float n1;
-        float n2;
+        refract.radius = r.radiusAt(h.z);
+        refract.tan = r.tan;
         
-        // handle front-face and back-face hits accordingly
-        if(h.front){
-          n1 = 1.0;
-          n2 = index;
-          n = normRefr;
-        }else{
-          n1 = index;
-          n2 = 1.0;
-          n = -normRefr;
-        }
-        
-        // calculate refraction ray direction
-        float c1 = n % v;
-        float s1 = sqrt(1.0 - c1 * c1);
-        float s2 = n1 / n2 * s1;
-        float c2 = sqrt(1.0 - s2 * s2);
-        Point p = (v - c1 * n).GetNormalized();
-        Point pt = s2 * -p;
-        Point nt = c2 * -n;
-        
-        // store ray direction (normalize!)
-        refract->dir = (pt + nt).GetNormalized();
+        // calculate refraction ray direction & fresnel reflectance
+        float fresnel;
         
         // only cast rays if not total internal reflection
-        if(s2 * s2 <= 1.0){
-            
+        if(refractDirection(r.dir, normRefr, h.front, refract.dir, fresnel)){
+          
           // create and store refracted hit info
           HitInfo refractHI = HitInfo();
-          bool refractHit = traceRay(*refract, refractHI);
+          bool refractHit = traceRay(refract, refractHI);
           
           // grab the node material hit
           if(refractHit){
             Node *n = refractHI.node;
-            Material *m;
+            Material *m = NULL;
             if(n)
               m = n->getMaterial();
             
             // for the material, recursively add refractions, within bounce count
             Color refractionShade = Color(0.0, 0.0, 0.0);
             if(m)
-              refractionShade = m->shade(*refract, refractHI, lights, bounceCount - 1);
+              refractionShade = m->shade(refract, refractHI, lights, bounceCount - 1);
             
             // for no material, show the hit
             else
               refractionShade = Color(0.929, 0.929, 0.929);
             
-            // Schlick's approximation for transmittance vs. reflectance
-            float r0 = (n1 - n2) / (n1 + n2);
-            r0 *= r0;
-            float r;
-            if(n1 <= n2)
-              r = r0 + (1.0 - r0) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1) * (1 - c1);
-            else
-              r = r0 + (1.0 - r0) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2) * (1 - c2);
+            // fresnel weights for transmittance vs. reflectance
+            float r = fresnel;
             float t = 1.0 - r;
             
             // compute total refraction color
@@ -739,7 +851,7 @@ class PhongMaterial: public Material{
           
           // ray hits environment texture
           }else{
-            Color env = environment.sampleEnvironment(refract->dir);
+            Color env = environment.sampleEnvironment(refract.dir);
             c += env;
           }
         
@@ -751,234 +863,22 @@ class PhongMaterial: public Material{
       // return final shaded color
       return c;
     }
+};
+
+
+// blinn-phong material definition (shading)
+class BlinnMaterial: public SurfaceMaterial{
+  public:
     
-    // set the diffuse color of the material
-    void setDiffuse(Color c){
-      diffuse.setColor(c);
-    }
-    
-    // set the specular color of the material
-    void setSpecular(Color c){
-      specular.setColor(c);
-    }
-    
-    // set the shininess factor of the material
-    void setShininess(float s){
-      shininess = s;
-    }
-    
-    // set the reflection color of the material
-    void setReflection(Color c){
-      reflection.setColor(c);
-    }
-    
-    // set the refraction color of the material
-    void setRefraction(Color c){
-      refraction.setColor(c);
-    }
-    
-    // set the absorption color of the material
-    void setAbsorption(Color c){
-      absorption = c;
-    }
-    
-    // set the index of refraction of the material
-    void setRefractionIndex(float f){
-      index = f;
-    }
-    
-    // set the emission color of the material
-    void setEmission(Color c){
-      emission.setColor(c);
-    }
-    
-    // set the diffuse texture for the material
-    void setDiffuseTexture(TextureMap *map){
-      diffuse.setTexture(map);
-    }
-    
-    // set the specular texture for the material
-    void setSpecularTexture(TextureMap *map){
-      specular.setTexture(map);
-    }
-    
-    // set the reflection texture for the material
-    void setReflectionTexture(TextureMap *map){
-      reflection.setTexture(map);
-    }
-    
-    // set the refraction texture for the material
-    void setRefractionTexture(TextureMap *map){
-      refraction.setTexture(map);
-    }
-    
-    // set the emission texture for the material
-    void setEmissionTexture(TextureMap *map){
-      emission.setTexture(map);
-    }
-    
-    // set the environment texture
-    void setEnvironmentTexture(TexturedColor c){
-      environment = c;
-    }
-    
-    // set the reflection glossiness
-    void setReflectionGlossiness(float gloss){
-      reflectionGlossiness = gloss;
-    }
-    
-    // set the refraction glossiness
-    void setRefractionGlossiness(float gloss){
-      refractionGlossiness = gloss;
-    }
-    
-    // extensions for photon mapping
-    
-    // store the hit for the surface if true
-    bool isPhotonSurface(){
-      return diffuse.getColor().Grey() > 0.0;
-    }
-    
-    // trace our next random photon through the scene if true
-    bool randomPhotonBounce(Cone &r, Color &c, HitInfo &h){
-      
-      // store probabilities of each color
-      float pReflDiff, pReflSpec, pRefr;
-      
-      // grab color brightness
-      pReflDiff = diffuse.getColor().Grey();
-      pReflSpec = reflection.getColor().Grey();
-      pRefr = refraction.getColor().Grey();
-      
-      // rescale our brightness probabilities
-      float pTot = pReflDiff + pReflSpec + pRefr;
-      if(pTot > 1.0){
-        pReflDiff /= pTot;
-        pReflSpec /= pTot;
-        pRefr /= pTot;
-      }
-      
-      // get random component for material interaction
-      float rand = dist(rnd);
-      
-      // diffuse reflection
-      if(rand < pReflDiff){
-        
-        // modulate color
-        Color col = diffuse.getColor();
-        col /= col.Grey();
-        c *= col;
-        
-        // update photon position
-        r.pos = h.p;
-        
-        // calculate hemisphere vectors
-        Point v0 = Point(0.0, 1.0, 0.0);
-        if(v0 % h.n > 0.5 || v0 % h.n < -0.5)
-          v0 = Point(0.0, 0.0, 1.0);
-        Point v1 = (v0 ^ h.n).GetNormalized();
-        v0 = (v1 ^ h.n).GetNormalized();
-        
-        // calculate random direction along hemisphere
-        float phi = dist(rnd) * 2.0 * M_PI;
-        float the = acos(1.0 - dist(rnd));
-        r.dir = h.n.GetNormalized() * cos(the) + (v0 * cos(phi) + v1 * sin(  phi)) * sin(the);
-        
-        // continue tracing photon
-        return true;
-      
-      // specular reflection
-      }else if(rand < pReflDiff + pReflSpec){
-        
-        // modulate color
-        Color col = reflection.getColor();
-        col /= col.Grey();
-        c *= col;
-        
-        // update photon position
-        r.pos = h.p;
-        
-        // calculate reflected direction
-        r.dir = (2 * (h.n % -r.dir) * h.n + r.dir).GetNormalized();
-        
-        // continue tracing photon
-        return true;
-      
-      // refraction
-      }else if(rand < pReflDiff + pReflSpec + pRefr){
-        
-        // modulate color
-        Color col = refraction.getColor();
-        col /= col.Grey();
-        c *= col;
-        
-        // update photon position
-        r.pos = h.p;
-        
-        // store variables for refraction calculation
-        Point v = -r.dir;
-        Point n;
-        float n1;
-        float n2;
-        
-        // handle front-face and back-face hits accordingly
-        if(h.front){
-          n1 = 1.0;
-          n2 = index;
-          n = h.n;
-        }else{
-          n1 = index;
-          n2 = 1.0;
-          n = -h.n;
-        }
-        
-        // calculate refraction ray direction
-        float c1 = n % v;
-        float s1 = sqrt(1.0 - c1 * c1);
-        float s2 = n1 / n2 * s1;
-        float c2 = sqrt(1.0 - s2 * s2);
-        Point p = (v - c1 * n).GetNormalized();
-        Point pt = s2 * -p;
-        Point nt = c2 * -n;
-        
-        // calculate refracted direction
-        r.dir = (pt + nt).GetNormalized();
-        
-        // continue tracing photon
-        return true;
-      
-      // otherwise, absorbed
-      }else
-        return false;
-    }
-    
-  private:
-    
-    // colors for shading
-    TexturedColor diffuse, specular;
-    
-    // shininess factor for shading
-    float shininess;
-    
-    // colors for reflection, refraction
-    TexturedColor reflection, refraction;
-    
-    // index of refraction
-    float index;
-    
-    // color for absorption
-    Color absorption;
-    
-    // environment texture color
-    TexturedColor environment;
-    
-    // glossiness for reflections & refractions
-    float reflectionGlossiness, refractionGlossiness;
-    
-    // random number generation for light disk rotation
-    mt19937 rnd;
-    uniform_real_distribution<float> dist{0.0, 1.0};
+    // constructor
+    BlinnMaterial(): SurfaceMaterial(true){}
+};
+
+
+// phong material definition (shading)
+class PhongMaterial: public SurfaceMaterial{
+  public:
     
-    // colors for emission
-    TexturedColor emission;
+    // constructor
+    PhongMaterial(): SurfaceMaterial(false){}
 };
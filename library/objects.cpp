@@ -188,6 +188,21 @@ class TriObj: public Object, private cyTriMesh{
       return triang;
     }
     
+    // any-hit test for shadow rays, stops at the first blocking face in the BVH
+    bool occludeRay(Cone &r, float z, int &faceID){
+      faceID = -1;
+      return occludeBVHNode(r, z, faceID, bvh.GetRootNodeID());
+    }
+    
+    // re-test a single triangular face against a shadow ray
+    bool occludeFace(Cone &r, float z, int faceID){
+      if(faceID < 0)
+        return occludeRay(r, z, faceID);
+      HitInfo h = HitInfo();
+      h.z = z;
+      return intersectTriangle(r, h, HIT_FRONT, faceID);
+    }
+    
     // get triangular mesh bounding box
     BoundingBox getBoundBox(){
       return BoundingBox(GetBoundMin(), GetBoundMax());
@@ -352,4 +367,30 @@ class TriObj: public Object, private cyTriMesh{
       // return if we hit a face within this node
       return hit;
     }
+    
+    // cast a shadow ray into a BVH node, stopping at the first face closer than z
+    bool occludeBVHNode(Cone &r, float z, int &faceID, int nodeID){
+      
+      // skip nodes whose bounding box the ray misses
+      BoundingBox b = BoundingBox(bvh.GetNodeBounds(nodeID));
+      if(!b.intersectRay(r, z))
+        return false;
+      
+      // keep traversing the BVH hierarchy, until any hit
+      if(!bvh.IsLeafNode(nodeID))
+        return occludeBVHNode(r, z, faceID, bvh.GetFirstChildNode(nodeID)) || occludeBVHNode(r, z, faceID, bvh.GetSecondChildNode(nodeID));
+      
+      // for leaf nodes, trace ray into each triangular face
+      const unsigned int* faces = bvh.GetNodeElements(nodeID);
+      int size = bvh.GetNodeElementCount(nodeID);
+      for(int i = 0; i < size; i++){
+        HitInfo h = HitInfo();
+        h.z = z;
+        if(intersectTriangle(r, h, HIT_FRONT, faces[i])){
+          faceID = faces[i];
+          return true;
+        }
+      }
+      return false;
+    }
 };
@@ -12,6 +12,12 @@
 #include <math.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 #ifdef __mips
 #include <alloca.h>
@@ -33,10 +39,11 @@ typedef struct NearestPhotons {
   int max;
   int found;
   int got_heap;
+  int check_normal;              // only take photons with a similar normal
   float pos[3];
   float normal[3];
   float *dist2;
-  const Photon **index;
+  int *index;                    // photons found (indices in the map)
 } NearestPhotons;
 
 static void initTables(void)
@@ -83,11 +90,30 @@ PhotonMap *createPhotonMap(int max_photons)
 
 void destroyPhotonMap(BalancedPhotonMap *map)
 {
-  free(map->photons );
+  if (map->compact) {
+    free(map->compact->nodes);
+    free(map->compact->power);
+    free(map->compact->dirs);
+    free(map->compact);
+  } else if (map->mapped)
+    munmap(map->mapped, map->mapped_size);
+  else
+    free(map->photons );
   free(map);
 }
 
  
+/* decode_dir expands the two angle bytes of a direction
+ */
+//*****************************************************************
+static void decodeDir( float *dir, const unsigned char theta, const unsigned char phi )
+//*****************************************************************
+{
+  dir[0] = sintheta[theta]*cosphi[phi];
+  dir[1] = sintheta[theta]*sinphi[phi];
+  dir[2] = costheta[theta];
+}
+
 /* photon_dir returns the direction of a photon
  * at a given surface position
  */
@@ -95,71 +121,202 @@ void destroyPhotonMap(BalancedPhotonMap *map)
 static void photonDir( float *dir, const Photon *p )
 //*****************************************************************
 {
-  dir[0] = sintheta[p->theta]*cosphi[p->phi];
-  dir[1] = sintheta[p->theta]*sinphi[p->phi];
-  dir[2] = costheta[p->theta];
+  decodeDir( dir, p->theta, p->phi );
 }
 
+/* photon_normal returns the surface normal where
+ * a photon was stored
+ */
+//*****************************************************************
+static void photonNormal( float *n, const Photon *p )
+//*****************************************************************
+{
+  decodeDir( n, p->ntheta, p->nphi );
+}
 
-/* store puts a photon into the flat array that will form
- * the final kd-tree.
+/* compress a direction to the two angle bytes
+ */
+//*****************************************************************
+static void compressDir( unsigned char *theta_out, unsigned char *phi_out, const float dir[3] )
+//*****************************************************************
+{
+  int theta,phi;
+
+  theta = (int)( acos(dir[2])*(256.0/M_PI) );
+  if (theta>255)
+    *theta_out = 255;
+  else
+   *theta_out = (unsigned char)theta;
+
+  phi = (int)( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
+  if (phi>255)
+    *phi_out = 255;
+  else if (phi<0)
+    *phi_out = (unsigned char)(phi+256);
+  else
+    *phi_out = (unsigned char)phi;
+}
+
+
+/* encode fills in a photon record (position, power and
+ * compressed direction & normal) without adding it to a map.
  *
- * Call this function to store a photon.
+ * Used to build photon buffers that are merged later.
 */
 //***************************
-void storePhoton(
-  PhotonMap *map,
+void encodePhoton(
+  Photon *node,
   const float power[3],
   const float pos[3],
-  const float dir[3] )
+  const float dir[3],
+  const float normal[3] )
 //***************************
 {
+  static const float up[3] = { 0.0f, 0.0f, 1.0f };
   int i;
-  int theta,phi;
-  Photon *node;
-  if (map->stored_photons>=map->max_photons)
-	{
-	Photon *newMap=(Photon*)realloc(map->photons,sizeof(Photon)*(2*map->max_photons+1));
-	//printf("increasing map size to %d\n",map->max_photons*2);
-	if(newMap==NULL)
-		{
-		static int done=0;
-		if(!done)
-			fprintf(stderr,"Photon Map Full\n");
-		done=1;
-		return;
-		}
-	map->photons=newMap;
-	map->max_photons*=2;
-	}
-
- map->stored_photons++;
- node = &map->photons[map->stored_photons];
 
   for (i=0; i<3; i++) {
     node->pos[i] = pos[i];
+    node->power[i] = power[i];
+  }
 
-    if (node->pos[i] < map->bbox_min[i])
-      map->bbox_min[i] = node->pos[i];
-    if (node->pos[i] > map->bbox_max[i])
-      map->bbox_max[i] = node->pos[i];
+  compressDir( &node->theta, &node->phi, dir );
+  compressDir( &node->ntheta, &node->nphi, normal ? normal : up );
+}
 
-    node->power[i] = power[i];
+/* RGBE power (Ward, "Real Pixels", Graphics Gems II):
+ * three 8 bit mantissas sharing the exponent of the largest
+ */
+//*****************************************************************
+static void encodeRGBE( unsigned char *rgbe, const float power[3] )
+//*****************************************************************
+{
+  float v = power[0];
+  int e,i;
+  if (power[1]>v) v = power[1];
+  if (power[2]>v) v = power[2];
+  if (v<1e-32f) {
+    rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+    return;
+  }
+  v = frexpf(v,&e)*256.0f/v;
+  for (i=0; i<3; i++) {
+    int m = power[i]>0.0f ? (int)(power[i]*v+0.5f) : 0;
+    rgbe[i] = (unsigned char)(m>255 ? 255 : m);
   }
+  rgbe[3] = (unsigned char)(e+128);
+}
 
-  theta = (int)( acos(dir[2])*(256.0/M_PI) );
-  if (theta>255)
-    node->theta = 255;
-  else
-   node->theta = (unsigned char)theta;
+//*****************************************************************
+static void decodeRGBE( float *power, const unsigned char *rgbe )
+//*****************************************************************
+{
+  const float f = rgbe[3] ? ldexpf(1.0f,rgbe[3]-(128+8)) : 0.0f;
+  power[0] = rgbe[0]*f;
+  power[1] = rgbe[1]*f;
+  power[2] = rgbe[2]*f;
+}
 
-  phi = (int)( atan2(dir[1],dir[0])*(256.0/(2.0*M_PI)) );
-  if (phi>255)
-    node->phi = 255;
-  else if (phi<0)
-    node->phi = (unsigned char)(phi+256);
-  else
-    node->phi = (unsigned char)phi;
+/* The kd-tree searches read the photons through one of
+ * these, so the same search walks full & compact maps
+ */
+//******************************
+struct FullPhotonAccess {
+//******************************
+  const Photon *photons;
+  FullPhotonAccess(const BalancedPhotonMap *map) : photons(map->photons) {}
+  float pos(const int i, const int k) const { return photons[i].pos[k]; }
+  int plane(const int i) const { return photons[i].plane; }
+  void power(const int i, float *pw) const {
+    pw[0] = photons[i].power[0];
+    pw[1] = photons[i].power[1];
+    pw[2] = photons[i].power[2];
+  }
+  void dir(const int i, float *d) const { photonDir( d, &photons[i] ); }
+  void normal(const int i, float *n) const { photonNormal( n, &photons[i] ); }
+};
+
+//******************************
+struct CompactPhotonAccess {
+//******************************
+  const CompactPhotons *c;
+  CompactPhotonAccess(const BalancedPhotonMap *map) : c(map->compact) {}
+  float pos(const int i, const int k) const { return c->bbox_min[k]+c->step*c->nodes[i].pos[k]; }
+  int plane(const int i) const { return c->nodes[i].plane; }
+  void power(const int i, float *pw) const { decodeRGBE( pw, c->power[i] ); }
+  void dir(const int i, float *d) const { decodeDir( d, c->dirs[i][0], c->dirs[i][1] ); }
+  void normal(const int i, float *n) const { decodeDir( n, c->dirs[i][2], c->dirs[i][3] ); }
+};
+
+/* grow makes room for count more photons in the map
+ * returns 0 if the map is full
+*/
+//***************************
+static int growPhotonMap(PhotonMap *map, int count)
+//***************************
+{
+  int max_photons = map->max_photons;
+  Photon *newMap;
+  if (map->stored_photons+count<=max_photons)
+    return 1;
+  while (map->stored_photons+count>max_photons)
+    max_photons*=2;
+  newMap=(Photon*)realloc(map->photons,sizeof(Photon)*(max_photons+1));
+  //printf("increasing map size to %d\n",max_photons);
+  if(newMap==NULL)
+	{
+	static int done=0;
+	if(!done)
+		fprintf(stderr,"Photon Map Full\n");
+	done=1;
+	return 0;
+	}
+  map->photons=newMap;
+  map->max_photons=max_photons;
+  return 1;
+}
+
+/* store puts a photon into the flat array that will form
+ * the final kd-tree.
+ *
+ * Call this function to store a photon.
+*/
+//***************************
+void storePhoton(
+  PhotonMap *map,
+  const float power[3],
+  const float pos[3],
+  const float dir[3] )
+//***************************
+{
+  Photon node;
+  encodePhoton(&node, power, pos, dir);
+  storePhotons(map, &node, 1);
+}
+
+/* store_photons appends already encoded photons
+ * (see encodePhoton) to the map in order.
+*/
+//***************************
+void storePhotons(
+  PhotonMap *map,
+  const Photon *photons,
+  const int count )
+//***************************
+{
+  int i,j;
+  if (count<=0 || !growPhotonMap(map, count))
+    return;
+
+  memcpy(&map->photons[map->stored_photons+1], photons, sizeof(Photon)*count);
+  for (j=0; j<count; j++)
+    for (i=0; i<3; i++) {
+      if (photons[j].pos[i] < map->bbox_min[i])
+        map->bbox_min[i] = photons[j].pos[i];
+      if (photons[j].pos[i] > map->bbox_max[i])
+        map->bbox_max[i] = photons[j].pos[i];
+    }
+  map->stored_photons+=count;
 }
 
 /* scale_photon_power is used to scale the power of all
@@ -187,27 +344,29 @@ void scalePhotonPower(PhotonMap *map,
 // than the median in the upper half. The comparison
 // criteria is the axis (indicated by the axis parameter)
 // (inspired by routine in "Algorithms in C++" by Sedgewick)
+// The array holds photon indices, not the photons themselves.
 //*****************************************************************
 static void median_split(
-  Photon **p,
+  const Photon *photons,
+  int *p,
   const int start,               // start of photon block in array
   const int end,                 // end of photon block in array
   const int median,              // desired median number
   const int axis )               // axis to split along
 //*****************************************************************
 {
-#define swapPhoton(ph,a,b) { Photon *ph2=ph[a]; ph[a]=ph[b]; ph[b]=ph2; }
+#define swapPhoton(ph,a,b) { int ph2=ph[a]; ph[a]=ph[b]; ph[b]=ph2; }
   int left = start;
   int right = end;
 
   while ( right > left ) {
-    const float v = p[right]->pos[axis];
+    const float v = photons[p[right]].pos[axis];
     int i=left-1;
     int j=right;
     for (;;) {
-      while ( p[++i]->pos[axis] < v )
+      while ( photons[p[++i]].pos[axis] < v )
         ;
-      while ( p[--j]->pos[axis] > v && j>left )
+      while ( photons[p[--j]].pos[axis] > v && j>left )
         ;
       if ( i >= j )
         break;
@@ -223,16 +382,27 @@ static void median_split(
 }
 
 
+/* Blocks smaller than this are always balanced on the
+ * calling thread (forking them costs more than it saves)
+ */
+#define BALANCE_FORK_SIZE 65536
+
 // See "Realistic image synthesis using Photon Mapping" chapter 6
 // for an explanation of this function
+// The bounding box of the block is passed by value and
+// the left block is balanced on a new thread while
+// there are threads to spare.
 //****************************
 static void balance_segment(
-  PhotonMap *map,
-  Photon **pbal,
-  Photon **porg,
+  Photon *photons,
+  int *pbal,
+  int *porg,
   const int index,
   const int start,
-  const int end )
+  const int end,
+  const float *bbox_min,
+  const float *bbox_max,
+  const int threads )
 //****************************
 {
 
@@ -256,56 +426,70 @@ static void balance_segment(
   //--------------------------
 
   axis=2;
-  if ((map->bbox_max[0]-map->bbox_min[0])>(map->bbox_max[1]-map->bbox_min[1]) &&
-      (map->bbox_max[0]-map->bbox_min[0])>(map->bbox_max[2]-map->bbox_min[2]))
+  if ((bbox_max[0]-bbox_min[0])>(bbox_max[1]-bbox_min[1]) &&
+      (bbox_max[0]-bbox_min[0])>(bbox_max[2]-bbox_min[2]))
     axis=0;
-  else if ((map->bbox_max[1]-map->bbox_min[1])>(map->bbox_max[2]-map->bbox_min[2]))
+  else if ((bbox_max[1]-bbox_min[1])>(bbox_max[2]-bbox_min[2]))
     axis=1;
 
   //------------------------------------------
   // partition photon block around the median
   //------------------------------------------
 
-  median_split( porg, start, end, median, axis );
+  median_split( photons, porg, start, end, median, axis );
 
   pbal[ index ] = porg[ median ];
-  pbal[ index ]->plane = axis;
+  photons[ pbal[index] ].plane = axis;
 
   //----------------------------------------------
   // recursively balance the left and right block
   //----------------------------------------------
 
+  std::thread left;
+  int leftThreads = threads/2;
+  float left_max[3] = { bbox_max[0], bbox_max[1], bbox_max[2] };
+  float right_min[3] = { bbox_min[0], bbox_min[1], bbox_min[2] };
+  left_max[axis] = photons[pbal[index]].pos[axis];
+  right_min[axis] = photons[pbal[index]].pos[axis];
+
   if ( median > start ) {
     // balance left segment
     if ( start < median-1 ) {
-      const float tmp=map->bbox_max[axis];
-      map->bbox_max[axis] = pbal[index]->pos[axis];
-      balance_segment( map,pbal, porg, 2*index, start, median-1 );
-      map->bbox_max[axis] = tmp;
+      if ( leftThreads>0 && median-start>BALANCE_FORK_SIZE )
+        left = std::thread( balance_segment, photons, pbal, porg, 2*index, start, median-1,
+                            bbox_min, (const float*)left_max, leftThreads );
+      else {
+        balance_segment( photons, pbal, porg, 2*index, start, median-1, bbox_min, left_max, 1 );
+        leftThreads = 0;
+      }
     } else {
       pbal[ 2*index ] = porg[start];
+      leftThreads = 0;
     }
-  }
+  } else
+    leftThreads = 0;
 
   if ( median < end ) {
     // balance right segment
     if ( median+1 < end ) {
-      const float tmp = map->bbox_min[axis];		
-      map->bbox_min[axis] = pbal[index]->pos[axis];
-      balance_segment(map, pbal, porg, 2*index+1, median+1, end );
-      map->bbox_min[axis] = tmp;
+      balance_segment( photons, pbal, porg, 2*index+1, median+1, end, right_min, bbox_max,
+                       threads-leftThreads );
     } else {
       pbal[ 2*index+1 ] = porg[end];
     }
-  }	
+  }
+
+  if ( left.joinable() )
+    left.join();
 }
 
 /* balance creates a left balanced kd-tree from the flat photon array.
  * This function should be called before the photon map
  * is used for rendering.
+ * Subtrees are balanced on up to the given number of threads.
  */
 //******************************
-BalancedPhotonMap * balancePhotonMap(PhotonMap *map)
+BalancedPhotonMap * balancePhotonMap(PhotonMap *map, int threads)
 //******************************
 {
   BalancedPhotonMap *bmap;
@@ -313,24 +497,26 @@ BalancedPhotonMap * balancePhotonMap(PhotonMap *map)
     int i;
 	int d,j,foo;
 	Photon foo_photon;
-    // allocate two temporary arrays for the balancing procedure
-    Photon **pa1 = (Photon**)malloc(sizeof(Photon*)*(map->stored_photons+1));
-    Photon **pa2 = (Photon**)malloc(sizeof(Photon*)*(map->stored_photons+1));
+    // allocate two temporary index arrays for the balancing procedure
+    int *pa1 = (int*)malloc(sizeof(int)*(map->stored_photons+1));
+    int *pa2 = (int*)malloc(sizeof(int)*(map->stored_photons+1));
 
     for (i=0; i<=map->stored_photons; i++)
-      pa2[i] = &map->photons[i];
+      pa2[i] = i;
 
-    balance_segment(map, pa1, pa2, 1, 1, map->stored_photons );
+    balance_segment(map->photons, pa1, pa2, 1, 1, map->stored_photons,
+                    map->bbox_min, map->bbox_max, threads>1 ? threads : 1 );
     free(pa2);
 
     // reorganize balanced kd-tree (make a heap)
+    // (index 0 is never used, so it marks the moved photons)
     j=1;
 	foo=1;
     foo_photon = map->photons[j];
 
     for (i=1; i<=map->stored_photons; i++) {
-      d=pa1[j]-map->photons;
-      pa1[j] = NULL;
+      d=pa1[j];
+      pa1[j] = 0;
       if (d != foo)
         map->photons[j] = map->photons[d];
       else {
@@ -338,7 +524,7 @@ BalancedPhotonMap * balancePhotonMap(PhotonMap *map)
 
         if (i<map->stored_photons) {
           for (;foo<=map->stored_photons; foo++)
-            if (pa1[foo] != NULL)
+            if (pa1[foo] != 0)
               break;
           foo_photon = map->photons[foo];
           j = foo;
@@ -354,49 +540,46 @@ BalancedPhotonMap * balancePhotonMap(PhotonMap *map)
  bmap->stored_photons      = map->stored_photons;
  bmap->half_stored_photons = map->stored_photons/2-1;
  bmap->photons=map->photons;
+ bmap->mapped=NULL;
+ bmap->mapped_size=0;
+ bmap->compact=NULL;
  free(map);
  return (BalancedPhotonMap*) bmap;
 }
 
 
 
-/* locate_photons finds the nearest photons in the
- * photon map given the parameters in np
+/* add_nearest_photon inserts photon p in the candidate list
+ * of np if it is closer than the current maximum distance
 */
 //******************************************
-static void locatePhotons(
-	BalancedPhotonMap *map,
+template <class Photons>
+static void addNearestPhoton(
+  const Photons &photons,
   NearestPhotons *const np,
-  const int index)
+  const int p)
 //******************************************
 {
-  const Photon *p = &map->photons[index];
   float dist1;
   float dist2;
 
-  if (index<map->half_stored_photons) {
-    dist1 = np->pos[ p->plane ] - p->pos[ p->plane ];
-
-    if (dist1>0.0) { // if dist1 is positive search right plane
-      locatePhotons( map,np, 2*index+1 );
-      if ( dist1*dist1 < np->dist2[0] )
-        locatePhotons(map,np, 2*index );
-    } else {         // dist1 is negative search left first
-      locatePhotons(map,np, 2*index );
-      if ( dist1*dist1 < np->dist2[0] )
-        locatePhotons(map,np, 2*index+1 );
-    }
-  }
-
   // compute squared distance between current photon and np->pos
 
-  dist1 = p->pos[0] - np->pos[0];
+  dist1 = photons.pos(p,0) - np->pos[0];
   dist2 = dist1*dist1;
-  dist1 = p->pos[1] - np->pos[1];
+  dist1 = photons.pos(p,1) - np->pos[1];
   dist2 += dist1*dist1;
-  dist1 = p->pos[2] - np->pos[2];
+  dist1 = photons.pos(p,2) - np->pos[2];
   dist2 += dist1*dist1;
   
+  if ( dist2 < np->dist2[0] && np->check_normal ) {
+    // skip photons stored on surfaces facing another way
+    float n[3];
+    photons.normal( p, n );
+    if ( n[0]*np->normal[0]+n[1]*np->normal[1]+n[2]*np->normal[2] < IRRADIANCE_NORMAL_DOT )
+      return;
+  }
+
   if ( dist2 < np->dist2[0] ) {
     // we found a photon :) Insert it in the candidate list
     if ( np->found < np->max ) {
@@ -404,6 +587,10 @@ static void locatePhotons(
       np->found++;
       np->dist2[np->found] = dist2;
       np->index[np->found] = p;
+      // a single photon search keeps the nearest found so far,
+      // so only closer photons may replace it
+      if ( np->max==1 )
+        np->dist2[0] = dist2;
     } 
     else {
       int j,parent;
@@ -412,7 +599,7 @@ static void locatePhotons(
         // Build heap
         float dst2;
 		int k;
-        const Photon *phot;
+        int phot;
         int half_found = np->found>>1;
         for ( k=half_found; k>=1; k--) {
           parent=k;
@@ -457,12 +644,136 @@ static void locatePhotons(
   }
 }
 
+/* locate_photons finds the nearest photons in the
+ * photon map given the parameters in np
+ * The tree is walked with a small explicit stack, visiting
+ * the photons in the same order as the recursive search:
+ * near child, far child (if still in range), then the node.
+*/
+//******************************************
+template <class Photons>
+static void locatePhotons(
+  const Photons &photons,
+	BalancedPhotonMap *map,
+  NearestPhotons *const np,
+  const int index)
+//******************************************
+{
+  int node[64];                 // enough for any 32 bit photon index
+  unsigned char state[64];      // 0: new, 1: near child done, 2: both done
+  int top = 0;
+  node[0] = index;
+  state[0] = 0;
+
+  while (top>=0) {
+    const int i = node[top];
+
+    if (i<map->half_stored_photons && state[top]<2) {
+      const int plane = photons.plane(i);
+      const float dist1 = np->pos[ plane ] - photons.pos( i, plane );
+
+      if (state[top]==0) {    // search the plane np->pos is on first
+        state[top] = 1;
+        top++;
+        node[top] = dist1>0.0 ? 2*i+1 : 2*i;
+        state[top] = 0;
+        continue;
+      }
+
+      state[top] = 2;
+      if ( dist1*dist1 < np->dist2[0] ) {    // then the other one
+        top++;
+        node[top] = dist1>0.0 ? 2*i : 2*i+1;
+        state[top] = 0;
+        continue;
+      }
+    }
+
+    top--;
+    addNearestPhoton(photons, np, i);
+  }
+}
+
+/* sum_irradiance sums the photons found in np
+ * into an irradiance estimate
+*/
+//**********************************************
+template <class Photons>
+static void sumIrradiance(
+  const Photons &photons,
+  const NearestPhotons *np,
+  float irrad[3],
+  const float normal[3])
+//**********************************************
+{
+  float pdir[3], pw[3];
+  int i;
+
+  // sum irradiance from all photons
+  for (i=1; i<=np->found; i++) {
+    const int p = np->index[i];
+    // the photon_dir call and following if can be omitted (for speed)
+    // if the scene does not have any thin surfaces
+    photons.dir( p, pdir );
+    if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ){
+      photons.power( p, pw );
+      irrad[0] += pw[0];
+      irrad[1] += pw[1];
+      irrad[2] += pw[2];
+
+      }
+    }
+
+  {
+  const float tmp=(1.0f/M_PI)/(np->dist2[0]);  // estimate of density
+  irrad[0] *= tmp;
+  irrad[1] *= tmp;
+  irrad[2] *= tmp;
+  }
+}
+
+/* Each thread keeps its own query scratch (heap & batch order),
+ * grown as needed and freed when the thread ends
+ */
+//******************************
+struct PhotonQueryScratch {
+//******************************
+  PhotonQuery query;
+  PhotonQueryScratch() { memset(&query, 0, sizeof(query)); }
+  ~PhotonQueryScratch() {
+    free(query.dist2);
+    free(query.index);
+    free(query.order);
+  }
+};
+
+PhotonQuery *threadPhotonQuery(const int nphotons, const int batch)
+{
+  static thread_local PhotonQueryScratch scratch;
+  PhotonQuery *q = &scratch.query;
+  if (nphotons>q->max_photons) {
+    free(q->dist2);
+    free(q->index);
+    q->dist2 = (float*)malloc( sizeof(float)*(nphotons+1) );
+    q->index = (int*)malloc( sizeof(int)*(nphotons+1) );
+    q->max_photons = nphotons;
+  }
+  if (batch>q->max_batch) {
+    free(q->order);
+    q->order = (PhotonQueryKey*)malloc( sizeof(PhotonQueryKey)*batch );
+    q->max_batch = batch;
+  }
+  return q;
+}
+
 /* irradiance_estimate computes an irradiance estimate
  * at a given surface position
+ * (using the heap of the given query scratch)
 */
 //**********************************************
-void irradianceEstimate(
+void irradianceEstimateQuery(
   BalancedPhotonMap *map,
+  PhotonQuery *query,
   float irrad[3],                // returned irradiance
   const float pos[3],            // surface position
   const float normal[3],         // surface normal at pos
@@ -471,48 +782,536 @@ void irradianceEstimate(
 //**********************************************
 {
   NearestPhotons np;
-  float pdir[3];
-  int i;
   irrad[0] = irrad[1] = irrad[2] = 0.0;
   
-  np.dist2 = (float*)alloca( sizeof(float)*(nphotons+1) );
-  np.index = (const Photon**)alloca( sizeof(Photon*)*(nphotons+1) );
+  np.dist2 = query->dist2;
+  np.index = query->index;
 
   np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
   np.max = nphotons;
   np.found = 0;
   np.got_heap = 0;
+  np.check_normal = 0;
   np.dist2[0] = max_dist*max_dist;
 
   // locate the nearest photons
-  locatePhotons( map,&np, 1 );
+  if (map->compact) {
+    CompactPhotonAccess photons(map);
+    locatePhotons( photons, map,&np, 1 );
+    if (np.found>=8)
+      sumIrradiance( photons, &np, irrad, normal );
+    return;
+  }
+  FullPhotonAccess photons(map);
+  locatePhotons( photons, map,&np, 1 );
 
   //printf("Found %d photons\n",np.found);
   // if less than 8 photons return
   if (np.found<8)
     return;
 
+  sumIrradiance( photons, &np, irrad, normal );
+}
 
-  // sum irradiance from all photons
-  for (i=1; i<=np.found; i++) {
-    const Photon *p = np.index[i];
-    // the photon_dir call and following if can be omitted (for speed)
-    // if the scene does not have any thin surfaces
-    photonDir( pdir, p );
-    if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ){
-      irrad[0] += p->power[0];
-      irrad[1] += p->power[1];
-      irrad[2] += p->power[2];
+/* irradiance_estimate computes an irradiance estimate
+ * at a given surface position
+*/
+//**********************************************
+void irradianceEstimate(
+  BalancedPhotonMap *map,
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float max_dist,          // max distance to look for photons
+  const int nphotons )     // number of photons to use
+//**********************************************
+{
+  irradianceEstimateQuery( map, threadPhotonQuery(nphotons, 0), irrad, pos, normal, max_dist, nphotons );
+}
+
+/* morton interleaves three 10 bit coordinates
+*/
+static unsigned int mortonSpread(unsigned int x)
+{
+  x = (x | (x<<16)) & 0x030000ff;
+  x = (x | (x<<8)) & 0x0300f00f;
+  x = (x | (x<<4)) & 0x030c30c3;
+  x = (x | (x<<2)) & 0x09249249;
+  return x;
+}
+
+static int compareQueryKeys(const void *a, const void *b)
+{
+  const PhotonQueryKey *ka = (const PhotonQueryKey*)a;
+  const PhotonQueryKey *kb = (const PhotonQueryKey*)b;
+  if (ka->key!=kb->key)
+    return ka->key<kb->key ? -1 : 1;
+  return ka->point-kb->point;
+}
+
+/* irradiance_estimate_batch computes the irradiance estimates
+ * of many surface positions (3 floats per point in each array)
+ * The points are visited in Morton order, so nearby points
+ * reuse the photons already in the cache. Results are
+ * the same as calling irradianceEstimate for each point.
+*/
+//**********************************************
+void irradianceEstimateBatch(
+  BalancedPhotonMap *map,
+  float *irrad,                  // returned irradiance
+  const float *pos,              // surface positions
+  const float *normal,           // surface normals
+  const int count,               // number of points
+  const float max_dist,          // max distance to look for photons
+  const int nphotons )     // number of photons to use
+//**********************************************
+{
+  PhotonQuery *q = threadPhotonQuery(nphotons, count);
+  float lo[3], scale[3];
+  int i,k;
+  if (count<=0)
+    return;
+
+  // bounds of the batch
+  for (k=0; k<3; k++)
+    lo[k] = scale[k] = pos[k];
+  for (i=1; i<count; i++)
+    for (k=0; k<3; k++) {
+      if (pos[3*i+k]<lo[k])
+        lo[k] = pos[3*i+k];
+      if (pos[3*i+k]>scale[k])
+        scale[k] = pos[3*i+k];
+    }
+  for (k=0; k<3; k++)
+    scale[k] = scale[k]>lo[k] ? 1023.0f/(scale[k]-lo[k]) : 0.0f;
+
+  // sort the points by Morton code
+  for (i=0; i<count; i++) {
+    unsigned int c[3];
+    for (k=0; k<3; k++)
+      c[k] = (unsigned int)((pos[3*i+k]-lo[k])*scale[k]);
+    q->order[i].key = mortonSpread(c[0]) | (mortonSpread(c[1])<<1) | (mortonSpread(c[2])<<2);
+    q->order[i].point = i;
+  }
+  qsort( q->order, count, sizeof(PhotonQueryKey), compareQueryKeys );
+
+  for (i=0; i<count; i++) {
+    const int j = q->order[i].point;
+    irradianceEstimateQuery( map, q, &irrad[3*j], &pos[3*j], &normal[3*j], max_dist, nphotons );
+  }
+}
+
+/* Precomputed irradiance (Christensen, "Faster Photon Map Global
+ * Illumination", 1999): the irradiance estimate at every stride-th
+ * photon is stored as the power of a photon in a second map, so a
+ * lookup is a single nearest photon with a similar normal.
+ */
+#define PRECOMPUTE_BLOCK 1024
+
+//**********************************************
+static void precomputeIrradianceThread(
+  BalancedPhotonMap *map,
+  Photon *out,
+  const int count,
+  const int stride,
+  const float max_dist,
+  const int nphotons,
+  std::atomic<int> *next )
+//**********************************************
+{
+  PhotonQuery *q = threadPhotonQuery(nphotons, 0);
+  int b,i;
+  for (b=(*next)++; b*PRECOMPUTE_BLOCK<count; b=(*next)++) {
+    int end=(b+1)*PRECOMPUTE_BLOCK;
+    if (end>count)
+      end=count;
+    for (i=b*PRECOMPUTE_BLOCK; i<end; i++) {
+      const Photon *p = &map->photons[1+i*stride];
+      float normal[3];
+      photonNormal( normal, p );
+      out[i] = *p;
+      irradianceEstimateQuery( map, q, out[i].power, p->pos, normal, max_dist, nphotons );
+    }
+  }
+}
+
+//**********************************************
+BalancedPhotonMap *precomputeIrradiance(
+  BalancedPhotonMap *map,
+  const int stride,
+  const float max_dist,
+  const int nphotons,
+  const int threads )
+//**********************************************
+{
+  const int count = (map->stored_photons+stride-1)/stride;
+  PhotonMap *imap = createPhotonMap(count>0 ? count : 1);
+  Photon *out = (Photon*)malloc( sizeof(Photon)*(count>0 ? count : 1) );
+  std::atomic<int> next(0);
+  std::thread *t = new std::thread[threads>1 ? threads : 1];
+  int i;
+  assert(map->photons);   // not for compact maps
+
+  // estimate irradiance at the photons (in blocks, shared between the threads)
+  for (i=0; i<(threads>1 ? threads : 1); i++)
+    t[i] = std::thread( precomputeIrradianceThread, map, out, count, stride, max_dist, nphotons, &next );
+  for (i=0; i<(threads>1 ? threads : 1); i++)
+    t[i].join();
+  delete[] t;
+
+  storePhotons( imap, out, count );
+  free(out);
+  return balancePhotonMap( imap, threads );
+}
+
+/* irradiance_lookup returns the precomputed irradiance of
+ * the nearest photon with a similar normal (or none)
+*/
+//**********************************************
+void irradianceLookup(
+  BalancedPhotonMap *map,
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float max_dist )         // max distance to look for photons
+//**********************************************
+{
+  NearestPhotons np;
+  float dist2[2];
+  int index[2];
+  irrad[0] = irrad[1] = irrad[2] = 0.0;
+
+  np.dist2 = dist2;
+  np.index = index;
+  np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
+  np.normal[0] = normal[0]; np.normal[1] = normal[1]; np.normal[2] = normal[2];
+  np.max = 1;
+  np.found = 0;
+  np.got_heap = 0;
+  np.check_normal = 1;
+  np.dist2[0] = max_dist*max_dist;
 
+  if (map->compact) {
+    CompactPhotonAccess photons(map);
+    locatePhotons( photons, map,&np, 1 );
+    if (np.found>0)
+      photons.power( np.index[1], irrad );
+    return;
+  }
+  FullPhotonAccess photons(map);
+  locatePhotons( photons, map,&np, 1 );
+
+  if (np.found>0)
+    photons.power( np.index[1], irrad );
+}
+
+/* photons_within sums the power of all photons within radius
+ * of a surface position (arriving from above the surface, as in
+ * irradianceEstimate) and returns their count
+ * Used to gather a pass of progressive photon mapping.
+*/
+//**********************************************
+template <class Photons>
+static int photonsWithin(
+  const Photons &photons,
+  BalancedPhotonMap *map,
+  float flux[3],
+  const float pos[3],
+  const float normal[3],
+  const float radius )
+//**********************************************
+{
+  int stack[64];
+  int top = 0;
+  int count = 0;
+  const float r2 = radius*radius;
+  flux[0] = flux[1] = flux[2] = 0.0;
+  if (map->stored_photons<1)
+    return 0;
+  stack[0] = 1;
+
+  while (top>=0) {
+    const int i = stack[top--];
+    float d, dist2, pdir[3], pw[3];
+
+    // children (the far one only if the plane is within radius, the near one is popped first)
+    if (2*i<=map->stored_photons) {
+      const int plane = photons.plane(i);
+      d = pos[ plane ] - photons.pos( i, plane );
+      const int near_child = d>0.0f ? 2*i+1 : 2*i;
+      const int far_child = near_child==2*i ? 2*i+1 : 2*i;
+      if (d*d<r2 && far_child<=map->stored_photons)
+        stack[++top] = far_child;
+      if (near_child<=map->stored_photons)
+        stack[++top] = near_child;
+    }
+
+    d = photons.pos(i,0)-pos[0];
+    dist2 = d*d;
+    d = photons.pos(i,1)-pos[1];
+    dist2 += d*d;
+    d = photons.pos(i,2)-pos[2];
+    dist2 += d*d;
+    if (dist2>=r2)
+      continue;
+
+    photons.dir( i, pdir );
+    if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ) {
+      photons.power( i, pw );
+      flux[0] += pw[0];
+      flux[1] += pw[1];
+      flux[2] += pw[2];
+      count++;
+    }
+  }
+  return count;
+}
+
+//**********************************************
+int photonsWithin(
+  BalancedPhotonMap *map,
+  float flux[3],                 // returned power sum
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius )           // distance to look for photons
+//**********************************************
+{
+  if (map->compact)
+    return photonsWithin( CompactPhotonAccess(map), map, flux, pos, normal, radius );
+  return photonsWithin( FullPhotonAccess(map), map, flux, pos, normal, radius );
+}
+
+/* Hashed photon grid: the hash is from Teschner et al.,
+ * "Optimized Spatial Hashing for Collision Detection of
+ * Deformable Objects" (2003). Cells hashed to the same bucket
+ * share it, the distance test sorts them out.
+ */
+#define GRID_BLOCK 65536
+
+static unsigned int gridHash(const int x, const int y, const int z)
+{
+  return ((unsigned int)x*73856093u) ^ ((unsigned int)y*19349663u) ^ ((unsigned int)z*83492791u);
+}
+
+/* State shared by the threads building a grid
+ */
+//******************************
+typedef struct GridBuild {
+//******************************
+  BalancedPhotonMap *map;
+  PhotonGrid *grid;
+  unsigned int *bucket;          // bucket of each photon
+  int *order;                    // photons (indices in the map) by bucket
+  std::atomic<int> *fill;        // photons counted (then placed) in each bucket
+  std::atomic<int> next;         // next block of the stage
+} GridBuild;
+
+/* Each stage takes blocks of photons (or of buckets for the
+ * last one) until all are done:
+ * 0 - find & count the bucket of each photon
+ * 1 - place each photon in its bucket
+ * 2 - sort each bucket by photon index (so the grid does not
+ *     depend on the threads) and copy its photons
+ */
+//**********************************************
+static void gridBuildThread(GridBuild *b, const int stage)
+//**********************************************
+{
+  PhotonGrid *grid = b->grid;
+  const float inv_cell = 1.0f/grid->cell;
+  const int count = stage==2 ? (int)grid->mask+1 : grid->stored_photons;
+  int k,i,j;
+  for (k=b->next++; k*GRID_BLOCK<count; k=b->next++) {
+    int end=(k+1)*GRID_BLOCK;
+    if (end>count)
+      end=count;
+    for (i=k*GRID_BLOCK; i<end; i++) {
+      if (stage==0) {
+        const Photon *p = &b->map->photons[i+1];
+        b->bucket[i] = gridHash( (int)floorf(p->pos[0]*inv_cell), (int)floorf(p->pos[1]*inv_cell),
+                                 (int)floorf(p->pos[2]*inv_cell) ) & grid->mask;
+        b->fill[ b->bucket[i] ]++;
+      } else if (stage==1)
+        b->order[ grid->start[b->bucket[i]] + b->fill[b->bucket[i]]++ ] = i+1;
+      else {
+        std::sort( b->order+grid->start[i], b->order+grid->start[i+1] );
+        for (j=grid->start[i]; j<grid->start[i+1]; j++)
+          grid->photons[j] = b->map->photons[ b->order[j] ];
       }
     }
+  }
+}
 
-  {
-  const float tmp=(1.0f/M_PI)/(np.dist2[0]);  // estimate of density
+static void gridBuildStage(GridBuild *b, const int stage, const int threads)
+{
+  std::thread *t = new std::thread[threads>1 ? threads : 1];
+  int i;
+  b->next = 0;
+  for (i=0; i<(threads>1 ? threads : 1); i++)
+    t[i] = std::thread( gridBuildThread, b, stage );
+  for (i=0; i<(threads>1 ? threads : 1); i++)
+    t[i].join();
+  delete[] t;
+}
+
+/* build_photon_grid copies the photons of a map into a
+ * hashed grid (with twice as many buckets as photons)
+ * The map is not changed (and must not be compact).
+ */
+//**********************************************
+PhotonGrid *buildPhotonGrid(
+  BalancedPhotonMap *map,
+  const float cell,
+  const int threads )
+//**********************************************
+{
+  PhotonGrid *grid = (PhotonGrid*) malloc(sizeof(PhotonGrid));
+  GridBuild b;
+  unsigned int buckets = 1024;
+  int i;
+  assert(map->photons);   // not for compact maps
+
+  while (buckets<2u*(unsigned int)map->stored_photons)
+    buckets*=2;
+  grid->stored_photons = map->stored_photons;
+  grid->photons = (Photon*)malloc( sizeof(Photon)*(map->stored_photons>0 ? map->stored_photons : 1) );
+  grid->start = (int*)malloc( sizeof(int)*(buckets+1) );
+  grid->mask = buckets-1;
+  grid->cell = cell>0.0f ? cell : 1.0f;
+  b.map = map;
+  b.grid = grid;
+  b.bucket = (unsigned int*)malloc( sizeof(unsigned int)*(map->stored_photons>0 ? map->stored_photons : 1) );
+  b.order = (int*)malloc( sizeof(int)*(map->stored_photons>0 ? map->stored_photons : 1) );
+  b.fill = new std::atomic<int>[buckets]();
+  if (!grid->photons || !grid->start || !b.bucket || !b.order) {
+    fprintf(stderr,"Out of memory building photon grid\n");
+    exit(-1);
+  }
+
+  // count the photons of each bucket, then start each bucket after the ones before it
+  gridBuildStage( &b, 0, threads );
+  grid->start[0] = 0;
+  for (i=0; i<(int)buckets; i++) {
+    grid->start[i+1] = grid->start[i]+b.fill[i];
+    b.fill[i] = 0;
+  }
+
+  // place the photons, then order & copy them
+  gridBuildStage( &b, 1, threads );
+  gridBuildStage( &b, 2, threads );
+
+  free(b.bucket);
+  free(b.order);
+  delete[] b.fill;
+  initTables();
+  return grid;
+}
+
+/* photons_in_radius sums the power of all photons within
+ * radius of a surface position (as photonsWithin does)
+ * The radius is at most the cell size, so the sphere
+ * covers at most three cells on each axis.
+*/
+//**********************************************
+int photonsInRadius(
+  PhotonGrid *grid,
+  float flux[3],                 // returned power sum
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius )           // distance to look for photons (up to cell)
+//**********************************************
+{
+  const float inv_cell = 1.0f/grid->cell;
+  const float r2 = radius*radius;
+  unsigned int visited[27];
+  int lo[3], hi[3];
+  int nvisited = 0, count = 0;
+  int x,y,z,k,i;
+  flux[0] = flux[1] = flux[2] = 0.0;
+
+  for (k=0; k<3; k++) {
+    lo[k] = (int)floorf( (pos[k]-radius)*inv_cell );
+    hi[k] = (int)floorf( (pos[k]+radius)*inv_cell );
+    if (hi[k]>lo[k]+2)
+      hi[k] = lo[k]+2;
+  }
+
+  for (x=lo[0]; x<=hi[0]; x++)
+    for (y=lo[1]; y<=hi[1]; y++)
+      for (z=lo[2]; z<=hi[2]; z++) {
+        const int c[3] = { x, y, z };
+        unsigned int b;
+        float d2 = 0.0f;
+
+        // skip cells outside the sphere (the corners)
+        for (k=0; k<3; k++) {
+          const float d = pos[k]-grid->cell*c[k];
+          if (d<0.0f)
+            d2 += d*d;
+          else if (d>grid->cell)
+            d2 += (d-grid->cell)*(d-grid->cell);
+        }
+        if (d2>=r2)
+          continue;
+
+        b = gridHash(x,y,z) & grid->mask;
+
+        // skip buckets already searched (for cells hashed to the same one)
+        for (k=0; k<nvisited; k++)
+          if (visited[k]==b)
+            break;
+        if (k<nvisited)
+          continue;
+        visited[nvisited++] = b;
+
+        for (i=grid->start[b]; i<grid->start[b+1]; i++) {
+          const Photon *p = &grid->photons[i];
+          float d, dist2, pdir[3];
+          d = p->pos[0]-pos[0];
+          dist2 = d*d;
+          d = p->pos[1]-pos[1];
+          dist2 += d*d;
+          d = p->pos[2]-pos[2];
+          dist2 += d*d;
+          if (dist2>=r2)
+            continue;
+
+          photonDir( pdir, p );
+          if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ) {
+            flux[0] += p->power[0];
+            flux[1] += p->power[1];
+            flux[2] += p->power[2];
+            count++;
+          }
+        }
+      }
+  return count;
+}
+
+/* irradiance_estimate_grid is the density of the photons
+ * within a fixed radius (instead of the nearest photons)
+*/
+//**********************************************
+void irradianceEstimateGrid(
+  PhotonGrid *grid,
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius )           // distance to look for photons (up to cell)
+//**********************************************
+{
+  const float tmp=(1.0f/M_PI)/(radius*radius);
+  photonsInRadius( grid, irrad, pos, normal, radius );
   irrad[0] *= tmp;
   irrad[1] *= tmp;
   irrad[2] *= tmp;
-  }
+}
+
+void destroyPhotonGrid(PhotonGrid *grid)
+{
+  free(grid->photons);
+  free(grid->start);
+  free(grid);
 }
 
 void autoIrradianceEstimate
@@ -525,21 +1324,23 @@ void autoIrradianceEstimate
 {
   NearestPhotons np;
   static float max_dist=1000;
-  float pdir[3];
-  int i;
   irrad[0] = irrad[1] = irrad[2] = 0.0;
   
   np.dist2 = (float*)malloc( sizeof(float)*(nphotons+1) );
-  np.index = (const Photon**)malloc( sizeof(Photon*)*(nphotons+1) );
+  np.index = (int*)malloc( sizeof(int)*(nphotons+1) );
 
   np.pos[0] = pos[0]; np.pos[1] = pos[1]; np.pos[2] = pos[2];
   np.max = nphotons;
   np.found = 0;
   np.got_heap = 0;
+  np.check_normal = 0;
   np.dist2[0] = max_dist*max_dist;
 
   // locate the nearest photons
-  locatePhotons( map,&np, 1 );
+  if (map->compact)
+    locatePhotons( CompactPhotonAccess(map), map,&np, 1 );
+  else
+    locatePhotons( FullPhotonAccess(map), map,&np, 1 );
 
   if (np.found<nphotons*0.8 && max_dist<10000)
 	{
@@ -555,32 +1356,17 @@ void autoIrradianceEstimate
 	}
 
 
-  // sum irradiance from all photons
-  for (i=1; i<=np.found; i++) {
-    const Photon *p = np.index[i];
-    // the photon_dir call and following if can be omitted (for speed)
-    // if the scene does not have any thin surfaces
-    photonDir( pdir, p );
-    if ( (pdir[0]*normal[0]+pdir[1]*normal[1]+pdir[2]*normal[2]) < 0.0f ){
-      irrad[0] += p->power[0];
-      irrad[1] += p->power[1];
-      irrad[2] += p->power[2];
-
-      }
-    }
-
-  {
-  const float tmp=(1.0f/M_PI)/(np.dist2[0]);  // estimate of density
-  irrad[0] *= tmp;
-  irrad[1] *= tmp;
-  irrad[2] *= tmp;
-  }
-    free(np.dist2);
-    free(np.index);
+  if (map->compact)
+    sumIrradiance( CompactPhotonAccess(map), &np, irrad, normal );
+  else
+    sumIrradiance( FullPhotonAccess(map), &np, irrad, normal );
+  free(np.dist2);
+  free(np.index);
 }
 void savePhotonMap(BalancedPhotonMap *bmap,char *filename)
 	{
 	FILE *fp=fopen(filename,"wb");
+	assert(bmap->photons);   // not for compact maps
 	fwrite(bmap->photons,sizeof(Photon),bmap->stored_photons,fp);
 	fclose(fp);
 	}
@@ -595,6 +1381,9 @@ BalancedPhotonMap * loadPhotonMap(char *filename)
 	assert(fp);
 
 	bmap = (BalancedPhotonMap*) malloc(sizeof(BalancedPhotonMap));
+	bmap->mapped=NULL;
+	bmap->mapped_size=0;
+	bmap->compact=NULL;
 	stat(filename,&sbuf);
 	bmap->stored_photons=sbuf.st_size/sizeof(Photon);
 	bmap->photons = (Photon*) malloc(sbuf.st_size);
@@ -612,3 +1401,166 @@ BalancedPhotonMap * loadPhotonMap(char *filename)
 	return bmap;
 	}
 
+/* write saves a balanced map behind a header
+ * (photon 0 is written too, so the file maps as is).
+ * The file is written under a temporary name and renamed,
+ * so a crash never leaves half a map behind.
+ * Returns 0 on failure.
+ */
+int writePhotonMap(BalancedPhotonMap *bmap,
+    const char *filename,
+    PhotonMapHeader header)
+	{
+	char temp[4096];
+	FILE *fp;
+	int ok;
+	if (!bmap->photons)   // compact maps are not saved
+		return 0;
+	if (snprintf(temp,sizeof(temp),"%s.tmp",filename)>=(int)sizeof(temp))
+		return 0;
+	fp=fopen(temp,"wb");
+	if (!fp)
+		return 0;
+
+	header.magic=PHOTON_MAP_MAGIC;
+	header.stored_photons=bmap->stored_photons;
+	ok = fwrite(&header,sizeof(header),1,fp)==1 &&
+	     fwrite(bmap->photons,sizeof(Photon),bmap->stored_photons+1,fp)==(size_t)bmap->stored_photons+1;
+	ok = (fclose(fp)==0) && ok;
+	if (ok)
+		ok = rename(temp,filename)==0;
+	if (!ok)
+		remove(temp);
+	return ok;
+	}
+
+/* map reuses a map saved by writePhotonMap, the photons are
+ * mapped straight from the file (pages are read as lookups
+ * touch them). Returns NULL if the file is missing, short, or its
+ * header differs from the given one (apart from stored_photons).
+ */
+BalancedPhotonMap * mapPhotonMap(const char *filename,
+    PhotonMapHeader header)
+	{
+	PhotonMapHeader saved;
+	struct stat sbuf;
+	size_t size;
+	void *data;
+	BalancedPhotonMap *bmap;
+	int fd=open(filename,O_RDONLY);
+	if (fd<0)
+		return NULL;
+
+	if (read(fd,&saved,sizeof(saved))!=sizeof(saved) || fstat(fd,&sbuf)!=0 ||
+	    saved.magic!=PHOTON_MAP_MAGIC || saved.hash!=header.hash ||
+	    saved.bounces!=header.bounces || saved.power!=header.power || saved.stored_photons<1)
+		{
+		close(fd);
+		return NULL;
+		}
+	size=sizeof(saved)+sizeof(Photon)*((size_t)saved.stored_photons+1);
+	if ((size_t)sbuf.st_size!=size)
+		{
+		close(fd);
+		return NULL;
+		}
+
+	// private mapping, so the map can never write back to the file
+	data=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (data==MAP_FAILED)
+		return NULL;
+
+	bmap = (BalancedPhotonMap*) malloc(sizeof(BalancedPhotonMap));
+	bmap->stored_photons=saved.stored_photons;
+	bmap->half_stored_photons = bmap->stored_photons/2-1;
+	bmap->photons=(Photon*)((char*)data+sizeof(saved));
+	bmap->mapped=data;
+	bmap->mapped_size=size;
+	bmap->compact=NULL;
+
+	initTables();
+	return bmap;
+	}
+
+/* compact replaces the photons of a balanced map with compact
+ * ones (see CompactPhoton): positions are quantized to 16 bits
+ * in the bounding box (the same step on all axes, so distances
+ * keep their shape and the kd-tree its order), and the power is
+ * stored as RGBE. Lookups return nearly the same estimates.
+ * The map can no longer be saved or have irradiance precomputed.
+ */
+void compactPhotonMap(BalancedPhotonMap *map)
+	{
+	CompactPhotons *c;
+	float bbox_max[3];
+	int i,k;
+	if (map->compact || !map->photons)
+		return;
+
+	c=(CompactPhotons*) malloc(sizeof(CompactPhotons));
+	c->nodes=(CompactPhoton*) malloc(sizeof(CompactPhoton)*(map->stored_photons+1));
+	c->power=(unsigned char(*)[4]) malloc(4*(map->stored_photons+1));
+	c->dirs=(unsigned char(*)[4]) malloc(4*(map->stored_photons+1));
+	if (!c->nodes || !c->power || !c->dirs)
+		{
+		fprintf(stderr,"Out of memory compacting photon map\n");
+		exit(-1);
+		}
+
+	// bounding box, and the largest side in 65535 steps
+	for (k=0; k<3; k++)
+		c->bbox_min[k]=bbox_max[k]=map->stored_photons>0 ? map->photons[1].pos[k] : 0.0f;
+	for (i=2; i<=map->stored_photons; i++)
+		for (k=0; k<3; k++)
+			{
+			if (map->photons[i].pos[k]<c->bbox_min[k])
+				c->bbox_min[k]=map->photons[i].pos[k];
+			if (map->photons[i].pos[k]>bbox_max[k])
+				bbox_max[k]=map->photons[i].pos[k];
+			}
+	c->step=0.0f;
+	for (k=0; k<3; k++)
+		if (bbox_max[k]-c->bbox_min[k]>c->step)
+			c->step=bbox_max[k]-c->bbox_min[k];
+	c->step=c->step>0.0f ? c->step/65535.0f : 1.0f;
+
+	// photon 0 is never used, but is kept so the indices match
+	memset(&c->nodes[0],0,sizeof(CompactPhoton));
+	memset(c->power[0],0,4);
+	memset(c->dirs[0],0,4);
+	for (i=1; i<=map->stored_photons; i++)
+		{
+		const Photon *p=&map->photons[i];
+		for (k=0; k<3; k++)
+			{
+			float q=(p->pos[k]-c->bbox_min[k])/c->step+0.5f;
+			c->nodes[i].pos[k]=(unsigned short)(q<0.0f ? 0 : (q>65535.0f ? 65535 : q));
+			}
+		c->nodes[i].plane=(unsigned short)p->plane;
+		encodeRGBE(c->power[i],p->power);
+		c->dirs[i][0]=p->theta;
+		c->dirs[i][1]=p->phi;
+		c->dirs[i][2]=p->ntheta;
+		c->dirs[i][3]=p->nphi;
+		}
+
+	if (map->mapped)
+		munmap(map->mapped,map->mapped_size);
+	else
+		free(map->photons);
+	map->photons=NULL;
+	map->mapped=NULL;
+	map->mapped_size=0;
+	map->compact=c;
+	}
+
+/* bytes returns the memory held by the photons of a map
+ */
+size_t photonMapBytes(BalancedPhotonMap *map)
+	{
+	const size_t count=(size_t)map->stored_photons+1;
+	if (map->compact)
+		return count*(sizeof(CompactPhoton)+8);
+	return count*sizeof(Photon);
+	}
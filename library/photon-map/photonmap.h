@@ -11,7 +11,7 @@
 
 /* This is the photon
  * The power is not compressed so the
- * size is 28 bytes
+ * size is 32 bytes
 */
 //**********************
 typedef struct Photon {
@@ -19,19 +19,73 @@ typedef struct Photon {
   float pos[3];                 // photon position
   short plane;                  // splitting plane for kd-tree
   unsigned char theta, phi;     // incoming direction
+  unsigned char ntheta, nphi;   // surface normal
   float power[3];               // photon power (uncompressed)
 } Photon;
 
 
+/* Photons within this cosine of the normal count
+ * for precomputed irradiance lookups
+*/
+#define IRRADIANCE_NORMAL_DOT 0.9f
+
+
+/* This is a compact photon (see compactPhotonMap)
+ * Only the position & splitting plane are read while
+ * walking the kd-tree, so they are kept apart from
+ * the power and directions (8 bytes here, 8 more in
+ * CompactPhotons, instead of 32)
+*/
+//**********************
+typedef struct CompactPhoton {
+//**********************
+  unsigned short pos[3];        // position (steps from bbox_min)
+  unsigned short plane;         // splitting plane for kd-tree
+} CompactPhoton;
+
+//******************************
+typedef struct CompactPhotons {
+//******************************
+  float bbox_min[3];
+  float step;                   // size of a position step (on all axes)
+  CompactPhoton *nodes;         // kd-tree nodes
+  unsigned char (*power)[4];    // photon power (RGBE, shared exponent)
+  unsigned char (*dirs)[4];     // theta, phi, ntheta, nphi
+} CompactPhotons;
+
+
 //******************************
 typedef struct BalancedPhotonMap{
 //******************************
   int stored_photons;
   Photon *photons;
   int half_stored_photons;
+
+  //Set when the photons are mapped from a file (see mapPhotonMap)
+  void *mapped;
+  size_t mapped_size;
+
+  //Set when the map is compact (photons is NULL then)
+  CompactPhotons *compact;
 } BalancedPhotonMap;
 
 
+/* This is written in front of a saved balanced map,
+ * a saved map is only reused if all of it matches
+ */
+//******************************
+typedef struct PhotonMapHeader{
+//******************************
+  int magic;                    // PHOTON_MAP_MAGIC
+  int stored_photons;           // photons in the file
+  int bounces;                  // maximum photon bounces
+  float power;                  // total light power
+  unsigned long long hash;      // scene & photon settings
+} PhotonMapHeader;
+
+#define PHOTON_MAP_MAGIC 0x32504d50
+
+
 /* This is the biggy,
  * The actual photon map structure
  */
@@ -42,7 +96,8 @@ typedef struct PhotonMap{
   Photon *photons;
   int half_stored_photons;
 
-  //The photon map MUST be the same as the balanced map up to this point.
+  //The photon map MUST be the same as the balanced map up to this point
+  //(the fields for mapped photons are only in the balanced map).
   //What follows is only used when the map is created...
   int max_photons;
   int prev_scale;
@@ -56,15 +111,69 @@ void storePhoton(PhotonMap *map,
     const float power[3],          // photon power
     const float pos[3],            // photon position
     const float dir[3]);            // photon direction
+void encodePhoton(Photon *node,
+    const float power[3],          // photon power
+    const float pos[3],            // photon position
+    const float dir[3],            // photon direction
+    const float normal[3] = NULL);  // surface normal (up if NULL)
+void storePhotons(PhotonMap *map,
+    const Photon *photons,         // encoded photons
+    const int count);               // number of photons
 
 void scalePhotonPower(PhotonMap *map,
 					const float scale );   // 1/(number of emitted photons)
 
-BalancedPhotonMap *balancePhotonMap(PhotonMap *map);  // balance the kd-tree
+BalancedPhotonMap *balancePhotonMap(PhotonMap *map,
+    int threads = 1);              // balance the kd-tree (on up to threads)
 
 void savePhotonMap(BalancedPhotonMap *bmap,char *filename);
 BalancedPhotonMap * loadPhotonMap(char *filename);
+int writePhotonMap(BalancedPhotonMap *bmap,
+    const char *filename,
+    PhotonMapHeader header);        // stored_photons is filled in
+BalancedPhotonMap * mapPhotonMap(const char *filename,
+    PhotonMapHeader header);        // NULL unless the header matches
 
+void compactPhotonMap(BalancedPhotonMap *map);   // quantize the photons (in place)
+size_t photonMapBytes(BalancedPhotonMap *map);   // memory used by the photons
+
+/* Scratch for photon queries (the nearest photon heap
+ * and the order of a batch), see threadPhotonQuery
+ */
+typedef struct PhotonQueryKey {
+  unsigned int key;             // Morton code of the point
+  int point;                    // index of the point in the batch
+} PhotonQueryKey;
+
+//******************************
+typedef struct PhotonQuery {
+//******************************
+  int max_photons;
+  float *dist2;
+  int *index;
+  int max_batch;
+  PhotonQueryKey *order;
+} PhotonQuery;
+
+PhotonQuery *threadPhotonQuery(const int nphotons,  // this thread's scratch, big
+    const int batch);                               // enough for the query & batch
+
+void irradianceEstimateQuery(
+  BalancedPhotonMap *map,
+  PhotonQuery *query,            // scratch (from threadPhotonQuery)
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float max_dist,          // max distance to look for photons
+  const int nphotons );     // number of photons to use
+void irradianceEstimateBatch(
+  BalancedPhotonMap *map,
+  float *irrad,                  // returned irradiance (3 per point)
+  const float *pos,              // surface positions (3 per point)
+  const float *normal,           // surface normals (3 per point)
+  const int count,               // number of points
+  const float max_dist,          // max distance to look for photons
+  const int nphotons );     // number of photons to use
 void irradianceEstimate(
   BalancedPhotonMap *map,
   float irrad[3],                // returned irradiance
@@ -72,6 +181,24 @@ void irradianceEstimate(
   const float normal[3],         // surface normal at pos
   const float max_dist,          // max distance to look for photons
   const int nphotons );     // number of photons to use
+BalancedPhotonMap *precomputeIrradiance(   // irradiance at every stride-th photon
+  BalancedPhotonMap *map,
+  const int stride,              // photons per precomputed photon
+  const float max_dist,          // max distance to look for photons
+  const int nphotons,            // number of photons to use
+  const int threads );           // threads to compute (and balance) on
+void irradianceLookup(           // nearest precomputed irradiance
+  BalancedPhotonMap *map,
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float max_dist );        // max distance to look for photons
+int photonsWithin(               // power & count of the photons within radius
+  BalancedPhotonMap *map,
+  float flux[3],                 // returned power sum
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius );          // distance to look for photons
 void autoIrradianceEstimate(
   BalancedPhotonMap *map,
   float irrad[3],                // returned irradiance
@@ -80,4 +207,38 @@ void autoIrradianceEstimate(
   const int nphotons );
 void destroyPhotonMap(BalancedPhotonMap *map);
 
+
+/* A hashed grid of photons for fixed radius queries:
+ * cells as big as the query radius (so a query visits at
+ * most 27 of them), hashed to buckets, with the photons
+ * sorted by bucket in one array
+ */
+//******************************
+typedef struct PhotonGrid{
+//******************************
+  int stored_photons;
+  Photon *photons;              // photons, sorted by bucket
+  int *start;                   // first photon of each bucket (buckets+1)
+  unsigned int mask;            // buckets-1 (a power of two)
+  float cell;                   // cell size (largest query radius)
+} PhotonGrid;
+
+PhotonGrid *buildPhotonGrid(     // grid of the photons in a (full) map
+  BalancedPhotonMap *map,
+  const float cell,              // largest query radius
+  const int threads );           // threads to build on
+int photonsInRadius(             // power & count of the photons within radius
+  PhotonGrid *grid,
+  float flux[3],                 // returned power sum
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius );          // distance to look for photons (up to cell)
+void irradianceEstimateGrid(     // fixed radius irradiance estimate
+  PhotonGrid *grid,
+  float irrad[3],                // returned irradiance
+  const float pos[3],            // surface position
+  const float normal[3],         // surface normal at pos
+  const float radius );          // distance to look for photons (up to cell)
+void destroyPhotonGrid(PhotonGrid *grid);
+
 #endif // PHOTONMAP_H
@@ -6,6 +6,14 @@
 #ifndef _SCENE_
 #define _SCENE_
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstddef>
+#include <cstdio>
 #include "cyCodeBase/cyPoint.h"
 #include "cyCodeBase/cyMatrix3.h"
 #include "cyCodeBase/cyColor.h"
@@ -14,10 +22,13 @@
 using namespace std;
 typedef cyPoint3f Point;
 typedef cyPoint2f Point2;
+typedef cyPoint3x8 Point3x8;
 typedef cyMatrix3f Matrix;
 typedef cyColor Color;
 typedef cyColorA ColorA;
 typedef cyColor24 Color24;
+typedef cyColor8 Color8;
+typedef cyFloat8 Float8;
 typedef cyIrradianceMapColorZNormal IrradianceMap;
 typedef cyColorZNormal ColorIM;
 typedef unsigned char uchar;
@@ -64,6 +75,118 @@ float centerHalton(float val){
 }
 
 
+// integer hash (for scrambling sample sequences)
+unsigned int hashInt(unsigned int x){
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+
+// Sobol sequence (first two dimensions, a (0,2)-sequence), scrambled by xor with a seed
+float Sobol(unsigned int index, int dim, unsigned int scramble = 0){
+  
+  // first dimension: bit reversal of the index (van der Corput)
+  unsigned int r = scramble;
+  if(dim == 0){
+    for(unsigned int v = 1u << 31; index != 0; index >>= 1, v >>= 1)
+      if(index & 1)
+        r ^= v;
+  
+  // second dimension: Sobol direction numbers
+  }else{
+    for(unsigned int v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+      if(index & 1)
+        r ^= v;
+  }
+  
+  // return the Sobol sequence value (in [0, 1))
+  return (r >> 8) * (1.0f / 16777216.0f);
+}
+
+
+// per-pixel seed for scrambling low-discrepancy samples (one per render thread)
+thread_local unsigned int pixelSeed = 0;
+
+// set the seed when a thread starts on a new pixel
+void setPixelSeed(int pixel){
+  pixelSeed = hashInt(pixel + 1);
+}
+
+// get a new scramble value, deterministic for each pixel
+unsigned int nextScramble(){
+  pixelSeed = hashInt(pixelSeed);
+  return pixelSeed;
+}
+
+// get a uniform random number in [0, 1), deterministic for each pixel
+float pixelRandom(){
+  return (nextScramble() >> 8) * (1.0f / 16777216.0f);
+}
+
+
+// soft shadow sampling: scrambled Sobol points on the light disk, cast in batches until
+// the variance of the shadow estimate drops below a threshold (instead of fixed Halton counts)
+bool sobolShadowSampling = false;
+float shadowSampleVariance = 0.002;
+void setSoftShadowSampling(bool sobol, float variance){
+  sobolShadowSampling = sobol;
+  shadowSampleVariance = variance;
+}
+
+// set when a soft shadow in the current pixel lands in a penumbra (read by the pixel sampler)
+thread_local bool pixelPenumbra = false;
+
+
+// cosine-weighted hemisphere sampler (for indirect lighting)
+// builds the tangent frame once per shading point, and draws directions from a
+// Sobol sequence scrambled for each set of samples (averaging the incoming light of
+// all directions then gives the irradiance over pi, matching diffuse shading)
+class HemisphereSampler{
+  public:
+    
+    // set up the tangent frame around the normal, and a new scramble
+    HemisphereSampler(Point n){
+      
+      // calculate hemisphere vectors
+      w = n.GetNormalized();
+      u = Point(0.0, 1.0, 0.0);
+      if(u % w > 0.5 || u % w < -0.5)
+        u = Point(0.0, 0.0, 1.0);
+      v = (u ^ w).GetNormalized();
+      u = (v ^ w).GetNormalized();
+      
+      // scramble both dimensions
+      scrambleX = nextScramble();
+      scrambleY = nextScramble();
+    }
+    
+    // get the direction of sample s, alternating with environment samples when the environment
+    // is importance sampled (weight scales the radiance along the direction, see below)
+    Point direction(int s, float &weight);
+    
+    // get the direction of sample s
+    Point direction(int s){
+      float phi = Sobol(s, 0, scrambleX) * 2.0 * M_PI;
+      float r2 = Sobol(s, 1, scrambleY);
+      float sinT = sqrt(r2);
+      float cosT = sqrt(1.0 - r2);
+      return w * cosT + (u * cos(phi) + v * sin(phi)) * sinT;
+    }
+  
+  private:
+    
+    // tangent frame (w is the normal)
+    Point u, v, w;
+    
+    // scramble for each dimension
+    unsigned int scrambleX, scrambleY;
+};
+
+
 // Ray definition (position & direction)
 class Ray{
   public:
@@ -97,7 +220,10 @@ class Cone: public Ray{
     float tan, radius;
     
     // cone ray constructor
-    Cone(){}
+    Cone(){
+      tan = 0.0;
+      radius = 0.0;
+    }
     Cone(Point p, Point &d, float t = 0.0, float r = 0.0){
       pos = p;
       dir = d;
@@ -591,6 +717,18 @@ class Object{
     // bounding box function for each object
     virtual BoundingBox getBoundBox() = 0;
     
+    // any-hit test for shadow rays (closer than z), also returns which face blocked the ray
+    virtual bool occludeRay(Cone &r, float z, int &faceID){
+      HitInfo h = HitInfo();
+      faceID = -1;
+      return intersectRay(r, h) && h.z < z;
+    }
+    
+    // re-test a single face (found by occludeRay) against a shadow ray
+    virtual bool occludeFace(Cone &r, float z, int faceID){
+      return occludeRay(r, z, faceID);
+    }
+    
     // bias used in ray intersection hit detection
     float getBias(){
       return 0.001;
@@ -603,6 +741,63 @@ Object::~Object(){}
 typedef ItemFileList<Object> ObjFileList;
 
 
+// projection map of a photon source (the directions from the light that reach specular surfaces),
+// so caustic photons are only emitted where a reflection or refraction can focus them
+// cells are rings of constant polar angle (res) by azimuth (2 res), a cell is marked if any of a
+// few rays through it hits a reflective or refractive material, then grown by one cell
+class ProjectionMap{
+  public:
+    
+    // build the map by tracing rays from the center of the light
+    ProjectionMap(Point center, int res);
+    
+    // true if no direction from the light reaches a specular surface
+    bool empty(){
+      return cells.empty();
+    }
+    
+    // solid angle of all marked cells (the pdf of sample is one over it)
+    float solidAngle(){
+      return total;
+    }
+    
+    // pick a direction uniformly over the marked cells
+    Point sample(float u1, float u2, float u3){
+      
+      // pick a marked cell, by its solid angle
+      int i = upper_bound(cdf.begin(), cdf.end(), u1 * total) - cdf.begin();
+      if(i >= (int) cells.size())
+        i = cells.size() - 1;
+      int row = cells[i] / (2 * res);
+      int col = cells[i] % (2 * res);
+      
+      // uniform within the cell (in the cosine of the polar angle & the azimuth)
+      return cellDirection(row, col, u2, u3);
+    }
+    
+  private:
+    
+    // resolution, marked cells & their cumulative solid angle
+    int res;
+    vector<int> cells;
+    vector<float> cdf;
+    float total;
+    
+    // cosine of the polar angle at the top of a row
+    float cosTheta(int row){
+      return cos(row * M_PI / res);
+    }
+    
+    // direction through a point of a cell (u, v in [0, 1] across the cell)
+    Point cellDirection(int row, int col, float u, float v){
+      float z = cosTheta(row) + u * (cosTheta(row + 1) - cosTheta(row));
+      float phi = (col + v) * M_PI / res;
+      float s = sqrt(1.0 - z * z > 0.0 ? 1.0 - z * z : 0.0);
+      return Point(s * cos(phi), s * sin(phi), z);
+    }
+};
+
+
 // Light definition (extended to a GenericLight, and then nested to specific lights)
 class Light: public ItemBase{
   public:
@@ -620,17 +815,487 @@ class Light: public ItemBase{
     virtual Color getPhotonIntensity(){
       return Color(0.0, 0.0, 0.0);
     }
-    virtual Cone randomPhoton(){
+    virtual Cone randomPhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, ProjectionMap *projection = NULL){
       Point p = Point(0.0, 0.0, 0.0);
       Point d = Point(0.0, 0.0, 1.0);
       return Cone(p, d);
     }
+    
+    // extensions for path tracing
+    
+    // sample a direction to the light from p (without checking for shadows)
+    // returns the light's contribution over the sample's pdf, the direction & distance to
+    // the sample, and the solid angle pdf (0 for lights without an area)
+    virtual Color sampleDirect(Point p, float u1, float u2, Point &dir, float &distance, float &pdf){
+      pdf = 0.0;
+      return Color(0.0, 0.0, 0.0);
+    }
+    
+    // shadow ray toward the light (any hit closer than z), 0 if in shadow, 1 if lit directly
+    virtual float shadow(Cone ray, float z = FLOAT_MAX) = 0;
+    
+    // intersect a ray with the light's surface (only for lights with an area)
+    // returns the distance, emitted radiance, and solid angle pdf sampleDirect would use
+    virtual bool intersectLight(Cone &r, float &t, Color &radiance, float &pdf){
+      return false;
+    }
+    
+    // extensions for many-light sampling
+    
+    // position & radius of the light (false for lights without a position)
+    virtual bool getPosition(Point &p, float &radius){
+      return false;
+    }
+    
+    // power of the light, used to pick among many lights
+    virtual float getPower(){
+      return 0.0;
+    }
+};
+
+
+// LightTree definition (bounding volume hierarchy over lights with a position)
+// picks a light for a shading point with probability proportional to an estimate of its
+// contribution, from the power, distance and orientation bounds of each node
+class LightTree{
+  public:
+    
+    // build the tree over a list of lights (which all have a position)
+    void build(vector<Light*> &list, bool falloff){
+      inverseSquare = falloff;
+      lights = list;
+      int n = lights.size();
+      positions.resize(n);
+      radii.resize(n);
+      nodes.clear();
+      leafOf.clear();
+      vector<int> order(n);
+      for(int i = 0; i < n; i++){
+        lights[i]->getPosition(positions[i], radii[i]);
+        order[i] = i;
+      }
+      if(n > 0){
+        buildNode(order, 0, n);
+        nodes[0].parent = -1;
+      }
+    }
+    
+    // pick a light for point p with normal n, from a uniform random number u
+    // returns NULL if no light can contribute, otherwise the light and its probability
+    Light* pick(Point &p, Point &n, float u, float &pdf){
+      pdf = 1.0;
+      if(nodes.empty())
+        return NULL;
+      
+      // walk down the tree, picking a child by its importance
+      int i = 0;
+      while(nodes[i].light < 0){
+        float l = importance(nodes[i + 1], p, n);
+        float r = importance(nodes[nodes[i].right], p, n);
+        if(l + r <= 0.0)
+          return NULL;
+        float pl = l / (l + r);
+        if(u < pl){
+          u /= pl;
+          pdf *= pl;
+          i = i + 1;
+        }else{
+          u = (u - pl) / (1.0 - pl);
+          pdf *= 1.0 - pl;
+          i = nodes[i].right;
+        }
+        if(u >= 1.0)
+          u = 0.99999994;
+      }
+      return lights[nodes[i].light];
+    }
+    
+    // probability that pick returns a light (for weighting against other sampling strategies)
+    float pickPdf(Light *light, Point &p, Point &n){
+      map<Light*, int>::iterator it = leafOf.find(light);
+      if(it == leafOf.end())
+        return 0.0;
+      
+      // walk up the tree from the light's leaf
+      float pdf = 1.0;
+      for(int i = it->second; nodes[i].parent >= 0; i = nodes[i].parent){
+        int q = nodes[i].parent;
+        float l = importance(nodes[q + 1], p, n);
+        float r = importance(nodes[nodes[q].right], p, n);
+        if(l + r <= 0.0)
+          return 0.0;
+        pdf *= importance(nodes[i], p, n) / (l + r);
+      }
+      return pdf;
+    }
+    
+    // number of lights in the tree
+    int size(){
+      return lights.size();
+    }
+  
+  private:
+    
+    // tree node (bounds of its lights, total power, children & parent, light index for leaves)
+    // nodes are stored depth-first, so the left child directly follows its parent
+    struct LightNode{
+      Point boxMin, boxMax;
+      float power;
+      int right, parent, light;
+      
+      // an empty node (inverted bounds, no power, no children, parent or light)
+      LightNode(): boxMin(FLOAT_MAX, FLOAT_MAX, FLOAT_MAX), boxMax(-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX), power(0.0), right(-1), parent(-1), light(-1){}
+    };
+    
+    // lights, their positions & radii, and the tree
+    vector<Light*> lights;
+    vector<Point> positions;
+    vector<float> radii;
+    vector<LightNode> nodes;
+    map<Light*, int> leafOf;
+    
+    // whether lights fall off with the inverse square of the distance
+    bool inverseSquare;
+    
+    // recursively build the node over lights [start, end) of the order (split at the median)
+    int buildNode(vector<int> &order, int start, int end){
+      int index = nodes.size();
+      nodes.push_back(LightNode());
+      
+      // bounds and power of all lights in this node
+      LightNode node;
+      Point cMin = node.boxMin, cMax = node.boxMax;
+      for(int k = start; k < end; k++){
+        int i = order[k];
+        for(int a = 0; a < 3; a++){
+          node.boxMin[a] = min(node.boxMin[a], positions[i][a] - radii[i]);
+          node.boxMax[a] = max(node.boxMax[a], positions[i][a] + radii[i]);
+          cMin[a] = min(cMin[a], positions[i][a]);
+          cMax[a] = max(cMax[a], positions[i][a]);
+        }
+        node.power += lights[i]->getPower();
+      }
+      
+      // store leaves
+      if(end - start == 1){
+        node.light = order[start];
+        leafOf[lights[node.light]] = index;
+        nodes[index] = node;
+        return index;
+      }
+      
+      // split along the longest axis of the light positions
+      Point ext = cMax - cMin;
+      int axis = 0;
+      if(ext.y > ext.x)
+        axis = 1;
+      if(ext.z > ext[axis])
+        axis = 2;
+      int mid = (start + end) / 2;
+      vector<Point> &pos = positions;
+      nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&pos, axis](int a, int b){
+        return pos[a][axis] < pos[b][axis];
+      });
+      
+      // build children
+      nodes[index] = node;
+      int left = buildNode(order, start, mid);
+      nodes[left].parent = index;
+      int right = buildNode(order, mid, end);
+      nodes[right].parent = index;
+      nodes[index].right = right;
+      return index;
+    }
+    
+    // estimated contribution of a node to point p with normal n
+    // (an upper bound on the cosine, so lights that can contribute are never skipped)
+    float importance(LightNode &node, Point &p, Point &n){
+      
+      // distance to the node's bounding sphere (clamped inside it)
+      Point c = (node.boxMin + node.boxMax) * 0.5;
+      float r2 = (node.boxMax - node.boxMin).LengthSquared() * 0.25;
+      Point d = c - p;
+      float d2 = d.LengthSquared();
+      
+      // bound the angle between the normal and the node
+      float cosBound = 1.0;
+      if(d2 > r2){
+        float dl = sqrt(d2);
+        float cosT = (d % n) / (dl * n.Length());
+        if(cosT > 1.0)
+          cosT = 1.0;
+        if(cosT < -1.0)
+          cosT = -1.0;
+        float angle = acos(cosT) - asin(sqrt(r2) / dl);
+        if(angle > 0.0)
+          cosBound = angle < 0.5 * M_PI ? cos(angle) : 0.0;
+      }else
+        d2 = r2;
+      
+      // power over squared distance, scaled by the cosine bound
+      float imp = node.power * cosBound;
+      if(inverseSquare)
+        imp /= d2 > 0.0 ? d2 : 1.0;
+      return imp;
+    }
 };
 
 
 // LightLight definition (store all lights in a list)
-class LightList: public ItemList<Light> {};
+class LightList: public ItemList<Light> {
+  public:
+    
+    // light tree, for picking a few of many lights at each shading point
+    // lights in the tree are kept together in the list, at [treeStart, treeEnd)
+    LightTree *tree = NULL;
+    int treeStart = 0;
+    int treeEnd = 0;
+    int treeSamples = 0;
+    
+    // build the light tree over all lights with a position (if there are more than samples)
+    void buildTree(int samples, bool falloff){
+      tree = NULL;
+      
+      // move lights with a position to the end of the list
+      vector<Light*> others, treeLights;
+      int n = size();
+      for(int i = 0; i < n; i++){
+        Point p;
+        float r;
+        if(!at(i)->isAmbient() && at(i)->getPosition(p, r))
+          treeLights.push_back(at(i));
+        else
+          others.push_back(at(i));
+      }
+      if((int) treeLights.size() <= samples)
+        return;
+      clear();
+      insert(end(), others.begin(), others.end());
+      insert(end(), treeLights.begin(), treeLights.end());
+      
+      // build the tree
+      tree = new LightTree();
+      tree->build(treeLights, falloff);
+      treeStart = others.size();
+      treeEnd = size();
+      treeSamples = samples;
+    }
+};
+
 
+// irradiance record (Ward-style), for the world-space irradiance cache
+// stores the indirect light (irradiance over pi) at a point, the validity radius (harmonic mean
+// distance to the surroundings), and rotational & translational gradients for each color channel
+struct IrradianceRecord{
+  Point p, n;
+  Color value;
+  float radius;
+  Point rotGrad[3];
+  Point transGrad[3];
+  IrradianceRecord *next;
+  
+  // extrapolate the record to a nearby point & normal (no negative light)
+  Color extrapolate(Point &q, Point &m){
+    Point rot = n ^ m;
+    Point dp = q - p;
+    Color c;
+    for(int i = 0; i < 3; i++){
+      c[i] = value[i] + rot % rotGrad[i] + dp % transGrad[i];
+      if(c[i] < 0.0)
+        c[i] = 0.0;
+    }
+    return c;
+  }
+};
+
+
+// world-space irradiance cache (octree of irradiance records)
+// records are stored at the octree level whose cells are about their radius, so a lookup only
+// visits cells (grown by half their size) that hold the point; cells & records are only ever
+// added (with compare & swap), so lookups and inserts can run on all threads at once
+class IrradianceCache{
+  public:
+    
+    // constructor, over the scene's bounding box
+    // error is Ward's accuracy a (records are used up to a times their radius, at most 1)
+    IrradianceCache(BoundingBox box, float error, float minRadius, float maxRadius){
+      Point size = box.maxP - box.minP;
+      root.center = (box.minP + box.maxP) / 2.0;
+      root.half = max(max(size.x, size.y), size.z) / 2.0 + minRadius;
+      this->error = min(error, 1.0f);
+      this->minRadius = minRadius;
+      this->maxRadius = maxRadius;
+      count = 0;
+    }
+    
+    // interpolate the cached irradiance at a point (false when no record is close enough)
+    bool lookup(Point &p, Point &n, Color &c){
+      float weight = 0.0;
+      Color sum = Color(0.0, 0.0, 0.0);
+      lookupNode(&root, p, n, sum, weight);
+      if(weight <= 0.0)
+        return false;
+      c = sum / weight;
+      return true;
+    }
+    
+    // add a new record (clamping its radius)
+    void insert(IrradianceRecord *r){
+      r->radius = max(minRadius, min(maxRadius, r->radius));
+      
+      // go down to the cell size of the record
+      IrradianceNode *node = &root;
+      while(node->half / 2.0 >= r->radius){
+        int i = octant(node, r->p);
+        if(i < 0)
+          break;
+        IrradianceNode *c = node->child[i].load(memory_order_acquire);
+        
+        // create the child cell, if no other thread did first
+        if(!c){
+          IrradianceNode *fresh = new IrradianceNode();
+          fresh->half = node->half / 2.0;
+          fresh->center = node->center;
+          for(int k = 0; k < 3; k++)
+            fresh->center[k] += (i & (1 << k)) ? fresh->half : -fresh->half;
+          if(node->child[i].compare_exchange_strong(c, fresh, memory_order_acq_rel))
+            c = fresh;
+          else
+            delete fresh;
+        }
+        node = c;
+      }
+      
+      // push the record onto the cell's list
+      IrradianceRecord *head = node->records.load(memory_order_relaxed);
+      do{
+        r->next = head;
+      }while(!node->records.compare_exchange_weak(head, r, memory_order_release, memory_order_relaxed));
+      count++;
+    }
+    
+    // number of records
+    int size(){
+      return count;
+    }
+    
+    // save all records to a binary file, tagged with a hash of the scene & settings
+    // (written to a temporary file first, then renamed, so a crash never leaves half a cache)
+    bool save(string file, unsigned long long hash){
+      vector<IrradianceRecord*> all;
+      gather(&root, all);
+      string temp = file + ".tmp";
+      ofstream f(temp.c_str(), ios::out | ios::binary);
+      if(!f)
+        return false;
+      int header[2] = {CACHE_MAGIC, (int) all.size()};
+      f.write(reinterpret_cast<char*>(header), sizeof(header));
+      f.write(reinterpret_cast<char*>(&hash), sizeof(hash));
+      for(int i = 0; i < (int) all.size(); i++)
+        f.write(reinterpret_cast<char*>(all[i]), CACHE_RECORD_SIZE);
+      f.close();
+      if(!f)
+        return false;
+      return rename(temp.c_str(), file.c_str()) == 0;
+    }
+    
+    // load records from a file (only if saved for the same hash), returns the number loaded
+    // a partial file keeps the records read so far, the rest get computed again while rendering
+    int load(string file, unsigned long long hash){
+      ifstream f(file.c_str(), ios::in | ios::binary);
+      int header[2];
+      unsigned long long fileHash;
+      if(!f.read(reinterpret_cast<char*>(header), sizeof(header)) || !f.read(reinterpret_cast<char*>(&fileHash), sizeof(fileHash)))
+        return 0;
+      if(header[0] != CACHE_MAGIC || fileHash != hash)
+        return 0;
+      int loaded = 0;
+      for(int i = 0; i < header[1]; i++){
+        IrradianceRecord *r = new IrradianceRecord();
+        if(!f.read(reinterpret_cast<char*>(r), CACHE_RECORD_SIZE)){
+          delete r;
+          break;
+        }
+        insert(r);
+        loaded++;
+      }
+      return loaded;
+    }
+    
+  private:
+    
+    // file format: magic & record count, hash, then the records (all their data before the list link)
+    static const int CACHE_MAGIC = 0x31435249;
+    static const int CACHE_RECORD_SIZE = offsetof(IrradianceRecord, next);
+    
+    // octree cell (cube around a center), with its own records
+    struct IrradianceNode{
+      Point center;
+      float half;
+      atomic<IrradianceNode*> child[8];
+      atomic<IrradianceRecord*> records;
+      IrradianceNode(){
+        for(int i = 0; i < 8; i++)
+          child[i] = NULL;
+        records = NULL;
+      }
+    };
+    
+    // root cell, settings, record count
+    IrradianceNode root;
+    float error, minRadius, maxRadius;
+    atomic<int> count;
+    
+    // collect the records of a cell & its children
+    void gather(IrradianceNode *node, vector<IrradianceRecord*> &all){
+      for(IrradianceRecord *r = node->records.load(memory_order_acquire); r; r = r->next)
+        all.push_back(r);
+      for(int i = 0; i < 8; i++){
+        IrradianceNode *c = node->child[i].load(memory_order_acquire);
+        if(c)
+          gather(c, all);
+      }
+    }
+    
+    // child cell holding a point (-1 if outside the cell)
+    int octant(IrradianceNode *node, Point &p){
+      Point d = p - node->center;
+      if(abs(d.x) > node->half || abs(d.y) > node->half || abs(d.z) > node->half)
+        return -1;
+      return (d.x > 0.0 ? 1 : 0) | (d.y > 0.0 ? 2 : 0) | (d.z > 0.0 ? 4 : 0);
+    }
+    
+    // add up weighted records of a cell & its children (Ward's weights)
+    void lookupNode(IrradianceNode *node, Point &p, Point &n, Color &sum, float &weight){
+      for(IrradianceRecord *r = node->records.load(memory_order_acquire); r; r = r->next){
+        
+        // skip records in front of the point
+        Point dp = p - r->p;
+        if(dp % (n + r->n) < -0.02 * r->radius)
+          continue;
+        
+        // weight by distance & normal change, only within the error
+        // (Ward's 1 / e, shifted to fall off to zero at the error for smooth transitions)
+        float e = dp.Length() / r->radius + sqrt(max(0.0f, 1.0f - n % r->n));
+        if(e < error){
+          float w = 1.0 / max(e, 0.0001f) - 1.0 / error;
+          sum += r->extrapolate(p, n) * w;
+          weight += w;
+        }
+      }
+      
+      // visit the children (grown by half their size) that hold the point
+      for(int i = 0; i < 8; i++){
+        IrradianceNode *c = node->child[i].load(memory_order_acquire);
+        if(!c)
+          continue;
+        Point d = p - c->center;
+        float reach = c->half * 2.0;
+        if(abs(d.x) <= reach && abs(d.y) <= reach && abs(d.z) <= reach)
+          lookupNode(c, p, n, sum, weight);
+      }
+    }
+};
 
 // Material definition (extended to specific materials for shading)
 class Material: public ItemBase{
@@ -641,6 +1306,37 @@ class Material: public ItemBase{
     // also keeps an integer count of how many reflection bounces remaining
     virtual Color shade(Cone &r, HitInfo &h, LightList &lights, int bounceCount = 1) = 0;
     
+    // prepare the material for shading once all of its properties are loaded
+    virtual void compile(){}
+    
+    // extensions for iterative path tracing
+    
+    // if true, continue the path along one randomly chosen reflection or refraction
+    // (updates the cone, path throughput and absorption of the medium entered)
+    virtual bool sampleBounce(Cone &r, HitInfo &h, Color &throughput, Color &absorb, float u){
+      return false;
+    }
+    
+    // extensions for path tracing
+    
+    // emitted radiance at a hit
+    virtual Color getEmission(HitInfo &h){
+      return Color(0.0, 0.0, 0.0);
+    }
+    
+    // evaluate the (non-specular) BRDF times the cosine for light from direction l
+    // also returns the solid angle pdf that sampleBSDF would use for that direction
+    virtual Color evalBSDF(Cone &r, HitInfo &h, Point &l, float &pdf){
+      pdf = 0.0;
+      return Color(0.0, 0.0, 0.0);
+    }
+    
+    // if true, continue the path along a sampled direction (diffuse, reflection or refraction)
+    // updates the cone, path throughput and absorption, the pdf is 0 for specular lobes
+    virtual bool sampleBSDF(Cone &r, HitInfo &h, Color &throughput, Color &absorb, float &pdf, float u0, float u1, float u2){
+      return false;
+    }
+    
     // extensions for photon mapping
     
     // if true, store the hit for the photon
@@ -648,8 +1344,19 @@ class Material: public ItemBase{
       return true;
     }
     
-    // if true, get the next photon's direction and color
-    virtual bool randomPhotonBounce(Cone &r, Color &c, HitInfo &h){
+    // diffuse color at a hit (what photons arriving there are seen with)
+    virtual Color getDiffuse(HitInfo &h){
+      return Color(0.0, 0.0, 0.0);
+    }
+    
+    // if true, the surface reflects or refracts photons (and may focus them into caustics)
+    virtual bool isSpecularSurface(){
+      return false;
+    }
+    
+    // if true, get the next photon's direction and color (and whether the bounce was specular)
+    virtual bool randomPhotonBounce(Cone &r, Color &c, HitInfo &h, mt19937 &rnd, uniform_real_distribution<float> &dist, bool &specular){
+      specular = false;
       return false;
     }
 };
@@ -853,6 +1560,157 @@ class TexturedColor{
 };
 
 
+// importance sampler for the environment texture (environment light for indirect lighting)
+// builds a 2D luminance distribution over the environment's texture space once, then picks a
+// row & cell by binary search (rows first), and converts the texture-space pdf to solid angle
+// with the Jacobian of the environment mapping (square rings of constant polar angle)
+class EnvironmentSampler{
+  public:
+    
+    // build the distribution from a res x res grid of (filtered) texture cells
+    EnvironmentSampler(TexturedColor &env, int res){
+      size = res;
+      rowCdf.assign(size + 1, 0.0);
+      cellCdf.assign(size * (size + 1), 0.0);
+      
+      // weight cells by luminance & solid angle
+      Point duvw[2] = {Point(0.5 / size, 0.0, 0.0), Point(0.0, 0.5 / size, 0.0)};
+      for(int j = 0; j < size; j++){
+        float *cdf = &cellCdf[j * (size + 1)];
+        for(int i = 0; i < size; i++){
+          Point uvw = Point((i + 0.5) / size, (j + 0.5) / size, 0.0);
+          float lum = env.sample(uvw, duvw).Grey();
+          cdf[i + 1] = cdf[i] + lum * jacobian(uvw.x, uvw.y);
+        }
+        rowCdf[j + 1] = rowCdf[j] + cdf[size];
+        
+        // normalize the row (uniform for black rows)
+        for(int i = 1; i <= size; i++)
+          cdf[i] = cdf[size] > 0.0 ? cdf[i] / cdf[size] : (float) i / size;
+      }
+      
+      // normalize the rows (uniform for a black environment)
+      float total = rowCdf[size];
+      for(int j = 1; j <= size; j++)
+        rowCdf[j] = total > 0.0 ? rowCdf[j] / total : (float) j / size;
+    }
+    
+    // sample a direction toward the environment (and its solid angle pdf)
+    Point sample(float u1, float u2, float &pdf){
+      
+      // pick a row, then a cell in the row (reusing the random numbers inside the cell)
+      int j = pick(&rowCdf[0], u1);
+      float *cdf = &cellCdf[j * (size + 1)];
+      int i = pick(cdf, u2);
+      float v = (j + u1) / size;
+      float u = (i + u2) / size;
+      
+      // convert the texture-space pdf to solid angle
+      float prob = (rowCdf[j + 1] - rowCdf[j]) * (cdf[i + 1] - cdf[i]);
+      pdf = prob * size * size / jacobian(u, v);
+      return direction(u, v);
+    }
+    
+    // solid angle pdf of sampling a direction
+    float pdf(Point dir){
+      
+      // find the texture coordinates (same mapping as the environment)
+      dir.Normalize();
+      float z = asin(max(-1.0f, min(1.0f, -dir.z))) / float(M_PI) + 0.5;
+      float x = dir.x / (abs(dir.x) + abs(dir.y) + 0.00001);
+      float y = dir.y / (abs(dir.x) + abs(dir.y) + 0.00001);
+      float u = 0.5 + z * 0.5 * (x - y);
+      float v = 0.5 + z * 0.5 * (x + y);
+      
+      // grab the cell probability
+      int i = min((int) (u * size), size - 1);
+      int j = min((int) (v * size), size - 1);
+      float *cdf = &cellCdf[j * (size + 1)];
+      float prob = (rowCdf[j + 1] - rowCdf[j]) * (cdf[i + 1] - cdf[i]);
+      return prob * size * size / jacobian(u, v);
+    }
+    
+  private:
+    
+    // grid resolution, row & cell cumulative distributions
+    int size;
+    vector<float> rowCdf;
+    vector<float> cellCdf;
+    
+    // pick an interval of a cumulative distribution, and rescale the random number inside it
+    int pick(float *cdf, float &u){
+      int k = upper_bound(cdf + 1, cdf + size, u) - (cdf + 1);
+      float width = cdf[k + 1] - cdf[k];
+      u = width > 0.0 ? (u - cdf[k]) / width : 0.5;
+      if(u >= 1.0)
+        u = 0.99999;
+      return k;
+    }
+    
+    // direction of texture coordinates (inverse of the environment mapping)
+    static Point direction(float u, float v){
+      float a = u - 0.5;
+      float b = v - 0.5;
+      float z = 2.0 * max(abs(a), abs(b));
+      if(z < 0.00001)
+        return Point(0.0, 0.0, 1.0);
+      float x = (a + b) / z;
+      float y = (b - a) / z;
+      float sinT = sin(z * M_PI) / sqrt(x * x + y * y);
+      return Point(x * sinT, y * sinT, cos(z * M_PI));
+    }
+    
+    // solid angle per unit area of texture space
+    static float jacobian(float u, float v){
+      float a = u - 0.5;
+      float b = v - 0.5;
+      float z = 2.0 * max(abs(a), abs(b));
+      if(z < 0.00001)
+        return 4.0 * M_PI * M_PI;
+      float x = (a + b) / z;
+      float y = (b - a) / z;
+      return 2.0 * M_PI * sin(z * M_PI) / (z * (x * x + y * y));
+    }
+};
+
+
+// environment sampler (only when importance sampling the environment)
+EnvironmentSampler *environmentSampler = NULL;
+void setEnvironmentSampling(TexturedColor &env, int res){
+  if(env.getTexture())
+    environmentSampler = new EnvironmentSampler(env, res);
+}
+
+
+// mix cosine-weighted & environment samples (even & odd samples) with the balance heuristic
+// the weight is the cosine pdf over the mixed pdf, so the average of weighted radiance stays
+// the irradiance over pi (zero weight for environment samples below the surface)
+Point HemisphereSampler::direction(int s, float &weight){
+  weight = 1.0;
+  if(!environmentSampler)
+    return direction(s);
+  
+  // grab the sample from either technique
+  Point dir;
+  float envPdf;
+  if(s % 2 == 0){
+    dir = direction(s / 2);
+    envPdf = environmentSampler->pdf(dir);
+  }else
+    dir = environmentSampler->sample(Sobol(s / 2, 0, hashInt(scrambleY)), Sobol(s / 2, 1, hashInt(scrambleX)), envPdf);
+  
+  // weight against both techniques
+  float cosT = dir % w;
+  if(cosT <= 0.0){
+    weight = 0.0;
+    return dir;
+  }
+  float cosPdf = cosT / M_PI;
+  weight = cosPdf / (0.5 * cosPdf + 0.5 * envPdf);
+  return dir;
+}
+
+
 // Node definition (pieces of the scene which store objects)
 class Node: public ItemBase, public Transformation{
   private:
@@ -1069,6 +1927,8 @@ class Camera{
 class Render{
   private:
     Color24 *render;
+    float *hdr;
+    int *hdrCount;
     float *z;
     uchar *zImage;
     float *sample;
@@ -1083,10 +1943,13 @@ class Render{
     // empty constructor
     Render(){
       render = NULL;
+      hdr = NULL;
+      hdrCount = NULL;
       z = NULL;
       zImage = NULL;
       sample = NULL;
       sampleImage = NULL;
+      irradImage = NULL;
       width = 0;
       height = 0;
       size = 0;
@@ -1101,6 +1964,12 @@ class Render{
       if(render)
         delete[] render;
       render = new Color24[size];
+      if(hdr)
+        delete[] hdr;
+      hdr = new float[3 * size]();
+      if(hdrCount)
+        delete[] hdrCount;
+      hdrCount = new int[size]();
       if(z)
         delete[] z;
       z = new float[size];
@@ -1134,6 +2003,12 @@ class Render{
     Color24* getRender(){
       return render;
     }
+    float* getHdr(){
+      return hdr;
+    }
+    int* getHdrCount(){
+      return hdrCount;
+    }
     float* getZBuffer(){
       return z;
     }
@@ -1173,6 +2048,78 @@ class Render{
       return rendered >= size;
     }
     
+    // linear color of a pixel (mean of its samples), and its sample count
+    Color getHdrPixel(int i){
+      return Color(&hdr[3 * i]);
+    }
+    int getHdrSamples(int i){
+      return hdrCount[i];
+    }
+    
+    // add one sample to a pixel's linear color (a running mean)
+    void addSample(int i, Color c){
+      addSamples(i, c, 1);
+    }
+    
+    // add the mean of n samples to a pixel (merging renders of the same pixel, weighted by their samples)
+    void addSamples(int i, Color c, int n){
+      if(n <= 0)
+        return;
+      int total = hdrCount[i] + n;
+      for(int k = 0; k < 3; k++)
+        hdr[3 * i + k] = hdrCount[i] == 0 ? c[k] : hdr[3 * i + k] + (c[k] - hdr[3 * i + k]) * n / total;
+      hdrCount[i] = total;
+    }
+    
+    // tone map the linear colors into the rendered image (exposure, then gamma, then clamped to 8 bits)
+    void tonemap(float exposure, bool gamma){
+      for(int i = 0; i < size; i++){
+        Color c = getHdrPixel(i);
+        if(exposure != 1.0)
+          c *= exposure;
+        if(gamma){
+          c.r = pow(c.r, 1.0 / 2.2);
+          c.g = pow(c.g, 1.0 / 2.2);
+          c.b = pow(c.b, 1.0 / 2.2);
+        }
+        render[i] = Color24(c);
+      }
+    }
+    
+    // save the linear colors to a portable float map (rows bottom to top, straight from the buffer)
+    bool savePFM(string file){
+      ofstream f;
+      f.open(file, ios::binary);
+      if(!f)
+        return false;
+      
+      // the sign of the scale gives the byte order (negative for little-endian)
+      unsigned short one = 1;
+      bool little = *reinterpret_cast<unsigned char*>(&one) == 1;
+      f << "PF\n" << width << " " << height << "\n" << (little ? "-1.0" : "1.0") << "\n";
+      for(int y = height - 1; y >= 0; y--)
+        f.write(reinterpret_cast<char*>(&hdr[3 * y * width]), 3 * width * sizeof(float));
+      f.close();
+      return !f.fail();
+    }
+    
+    // write the linear colors, sample counts, z-buffer & sample image (for a checkpoint)
+    void writeBuffers(ostream &f){
+      f.write(reinterpret_cast<char*>(hdr), 3 * size * sizeof(float));
+      f.write(reinterpret_cast<char*>(hdrCount), size * sizeof(int));
+      f.write(reinterpret_cast<char*>(z), size * sizeof(float));
+      f.write(reinterpret_cast<char*>(sample), size * sizeof(float));
+    }
+    
+    // read them back (for the same image size), false if the file is short
+    bool readBuffers(istream &f){
+      f.read(reinterpret_cast<char*>(hdr), 3 * size * sizeof(float));
+      f.read(reinterpret_cast<char*>(hdrCount), size * sizeof(int));
+      f.read(reinterpret_cast<char*>(z), size * sizeof(float));
+      f.read(reinterpret_cast<char*>(sample), size * sizeof(float));
+      return (bool) f;
+    }
+    
     // initialize the irradiance computation image
     void initializeIrradianceImage(){
       if(!irradImage)
@@ -1342,7 +2289,7 @@ void setSpecularGeometry(bool b){
 bool traceRayToNode(Cone r, HitInfo &h, Node &n){
   
   // if object gets hit and hit first
-  bool objectHit;
+  bool objectHit = false;
   
   // grab node's object
   Object *obj = n.getObject();
@@ -1410,5 +2357,175 @@ bool traceRay(Cone r, HitInfo &h){
 }
 
 
+// build a projection map (needs the scene for tracing its rays)
+ProjectionMap::ProjectionMap(Point center, int res): res(res), total(0.0){
+  int cols = 2 * res;
+  
+  // mark the cells where a ray (on a small grid across the cell) hits a specular surface
+  static const int grid = 3;
+  vector<bool> hit(res * cols, false);
+  for(int row = 0; row < res; row++){
+    for(int col = 0; col < cols; col++){
+      for(int k = 0; k < grid * grid && !hit[row * cols + col]; k++){
+        Point d = cellDirection(row, col, (k / grid + 0.5) / grid, (k % grid + 0.5) / grid);
+        Cone r = Cone(center, d);
+        HitInfo h = HitInfo();
+        if(traceRay(r, h) && h.node){
+          Material *m = h.node->getMaterial();
+          if(m && m->isSpecularSurface())
+            hit[row * cols + col] = true;
+        }
+      }
+    }
+  }
+  
+  // grow the marked cells by one (wrapping around in azimuth), summing up their solid angles
+  for(int row = 0; row < res; row++){
+    for(int col = 0; col < cols; col++){
+      bool marked = false;
+      for(int dr = -1; dr <= 1 && !marked; dr++){
+        for(int dc = -1; dc <= 1 && !marked; dc++){
+          int r = row + dr;
+          if(r >= 0 && r < res && hit[r * cols + (col + dc + cols) % cols])
+            marked = true;
+        }
+      }
+      if(marked){
+        total += (cosTheta(row) - cosTheta(row + 1)) * M_PI / res;
+        cells.push_back(row * cols + col);
+        cdf.push_back(total);
+      }
+    }
+  }
+}
+
+
+// the last object (& face) that blocked a shadow ray, with its chain of nodes from the root
+#define OCCLUDER_DEPTH 32
+struct Occluder{
+  Node *path[OCCLUDER_DEPTH];
+  int depth = 0;
+  int face = -1;
+};
+
+
+// shadow ray statistics (counted per thread, summed up as each thread finishes)
+atomic<long long> shadowRayTotal(0);
+atomic<long long> shadowCacheTotal(0);
+atomic<long long> shadowCacheHitTotal(0);
+atomic<long long> shadowBlockedTotal(0);
+struct ShadowCounter{
+  long long rays = 0;
+  long long cacheTests = 0;
+  long long cacheHits = 0;
+  long long blocked = 0;
+  ~ShadowCounter(){
+    shadowRayTotal += rays;
+    shadowCacheTotal += cacheTests;
+    shadowCacheHitTotal += cacheHits;
+    shadowBlockedTotal += blocked;
+  }
+};
+
+
+// per-thread occluder cache (one slot per light) & statistics
+thread_local vector<Occluder> occluders;
+thread_local ShadowCounter shadowCounter;
+
+
+// hand out a new slot in the occluder cache (for each light, and anything else casting its own shadow rays)
+int newOccluderSlot(){
+  static atomic<int> slots(0);
+  return slots++;
+}
+
+
+// print out how often the occluder cache saved a full shadow ray traversal
+void printShadowStats(){
+  long long rays = shadowRayTotal;
+  long long tests = shadowCacheTotal;
+  long long hits = shadowCacheHitTotal;
+  long long blocked = shadowBlockedTotal;
+  cout << "shadow rays: " << rays << " (" << blocked << " blocked)" << endl;
+  cout << "occluder cache: " << hits << " hits of " << tests << " tests";
+  if(tests > 0)
+    cout << " (" << 100.0 * hits / tests << "%)";
+  if(blocked > 0)
+    cout << ", found " << 100.0 * hits / blocked << "% of blocked rays";
+  cout << endl;
+  cout << "full traversals: " << rays - hits;
+  if(rays > 0)
+    cout << " (" << 100.0 * (rays - hits) / rays << "% of shadow rays)";
+  cout << endl;
+}
+
+
+// recursively go through node & descendants, stop at the first object that blocks the ray (closer than z)
+bool traceShadowToNode(Cone r, float z, Node &n, Occluder &o){
+  
+  // transform ray into model space (or local space), keep track of the node chain
+  Cone ray = n.toModelSpace(r);
+  if(o.depth < OCCLUDER_DEPTH)
+    o.path[o.depth] = &n;
+  o.depth++;
+  
+  // check if the node's object blocks the ray
+  Object *obj = n.getObject();
+  if(obj && obj->occludeRay(ray, z, o.face))
+    return true;
+  
+  // otherwise, check the child nodes (if their bounding box gets hit)
+  if(n.getChildBoundBox().intersectRay(ray, z)){
+    int numChild = n.getNumChild();
+    for(int j = 0; j < numChild; j++)
+      if(traceShadowToNode(ray, z, *n.getChild(j), o))
+        return true;
+  }
+  
+  // no hit on this node or its descendants
+  o.depth--;
+  return false;
+}
+
+
+// re-test a cached occluder (transforming the ray down its node chain)
+bool traceShadowToOccluder(Cone r, float z, Occluder &o){
+  for(int i = 0; i < o.depth; i++)
+    r = o.path[i]->toModelSpace(r);
+  return o.path[o.depth - 1]->getObject()->occludeFace(r, z, o.face);
+}
+
+
+// shadow ray tracing function (any hit closer than z), tries the last occluder for this light slot first
+bool traceShadowRay(Cone r, float z, int slot){
+  shadowCounter.rays++;
+  
+  // grab the light's cached occluder
+  if(slot >= (int) occluders.size())
+    occluders.resize(slot + 1);
+  Occluder &o = occluders[slot];
+  
+  // neighboring shadow rays are usually blocked by the same object
+  if(o.depth > 0){
+    shadowCounter.cacheTests++;
+    if(traceShadowToOccluder(r, z, o)){
+      shadowCounter.cacheHits++;
+      shadowCounter.blocked++;
+      return true;
+    }
+  }
+  
+  // otherwise, traverse the whole scene (and cache the new occluder)
+  Occluder hit;
+  if(traceShadowToNode(r, z, *scene, hit)){
+    shadowCounter.blocked++;
+    if(hit.depth <= OCCLUDER_DEPTH)
+      o = hit;
+    return true;
+  }
+  return false;
+}
+
+
 }
 #endif
@@ -9,6 +9,7 @@
 #include <string>
 #include <cmath>
 #include <random>
+#include <chrono>
 #include "library/loadXML.cpp"
 #include "library/scene.cpp"
 using namespace std;
@@ -20,32 +21,79 @@ bool printXML = false;
 bool zBuffer = false;
 bool sampleCount = false;
 int bounceCount = 5;
+bool iterativePaths = false;
+int rouletteDepth = 2;
 int sampleMin = 64;
 int sampleMax = 256;
 float sampleThreshold = 0.001;
 int shadowMin = 32;
 int shadowMax = 128;
+bool sobolShadows = false;
+float shadowVariance = 0.002;
+bool shadowStats = false;
+int lightSamples = 0;
 bool gammaCorr = true;
+float exposure = 1.0;
+bool hdrImage = false;
 bool globalIllum = false;
+bool pathTracing = false;
 bool irradCache = false;
+bool screenCache = false;
+float cacheError = 0.3;
+float cacheMinRadius = 0.05;
+float cacheMaxRadius = 5.0;
+int cachePrepass = 4;
+string cacheFile = "";
 int samplesGI = 128;
+bool envSampling = false;
+int envSamplingRes = 128;
 bool invSqFO = true;
 bool photonMap = true;
 int samplesPM = 10000000;
 int bounceCountPM = 5;
 float photonRad = 5.0;
 int maxPhotons = 100;
+string photonFile = "";
+bool photonIrrad = false;
+int photonIrradStride = 4;
+bool compactPM = false;
+bool photonGrid = false;
+bool causticMap = false;
+int samplesCM = 200000;
+float causticRad = 1.0;
+int maxCaustic = 50;
+int projectionRes = 64;
+bool progressivePM = false;
+int passesPM = 16;
+int photonsPerPass = 500000;
+float alphaPM = 0.7;
+float radiusPM = 1.0;
+bool progressive = false;
+int tileSize = 16;
+float timeBudget = 0.0;
+float noiseTarget = 0.0;
+float saveInterval = 0.0;
+bool adaptiveTiles = false;
+int adaptiveInitial = 4;
+int sampleBudget = 64;
+string checkpointFile = "";
+float checkpointInterval = 60.0;
+bool resume = false;
 
 
 // variables for ray tracing
 int w;
 int h;
 int size;
-Color24* img;
 float* zImg;
 float* sampleImg;
 IrradianceMap im;
+IrradianceCache *irradianceOctree = NULL;
+unsigned long long cacheHash = 0;
 BalancedPhotonMap *pm;
+BalancedPhotonMap *pmIrrad = NULL;
+BalancedPhotonMap *pmCaustic = NULL;
+PhotonGrid *pmGrid = NULL;
 
 
 // variables for anti-aliasing brightness calculations (XYZ, Lab)
@@ -59,7 +107,113 @@ float Yprecalc = (1.0 / 3.0) * pow(29.0 / 6.0, 2.0);
 // setup threading
 static const int numThreads = 8;
 void rayTracing(int i);
-void irradianceCache(int i, int m, LightList lightCache);
+void setThreadLights(LightList &threadLights);
+void setPixelIrradiance(LightList &threadLights, float pX, float pY);
+Color samplePixel(float pX, float pY, int s, float dcR, LightList &threadLights, mt19937 &rnd, uniform_real_distribution<float> &dist, float &z);
+ColorIM irradianceCache(int i, LightList &lightCache);
+void irradianceCacheThread();
+void irradianceCacheLevel(string level);
+
+
+// irradiance cache points of one level (pixels), their results, and the next point to compute
+vector<int> cachePoints;
+vector<ColorIM> cacheValues;
+atomic<int> cacheNext;
+LightList cacheLights;
+
+// photon emission (fixed-size chunks of emitted photons, each with its own seed, taken by the threads)
+static const int photonChunk = 4096;
+struct PhotonChunk{
+  int index;
+  vector<Photon> photons;
+  vector<int> ends;
+};
+vector<vector<PhotonChunk> > photonBuffers;
+atomic<int> photonNext;
+atomic<long long> photonStored;
+unsigned int photonSeed = 0;
+float powTot = 0.0;
+float *lightPow;
+float *lightProb;
+BalancedPhotonMap* tracePhotonMap(string name, int target, bool caustic);
+void compactPhotons(string name, BalancedPhotonMap *map);
+void photonTracingThread(int i, int target, bool caustic);
+void tracePhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, vector<Photon> &photons);
+
+// caustic photon emission (only lights whose projection map reaches specular surfaces)
+vector<ProjectionMap*> projections;
+float causticPowTot = 0.0;
+float *causticPow;
+float *causticProb;
+void traceCausticPhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, vector<Photon> &photons);
+
+// progressive photon mapping (a visible point per pixel, with its radius, photon count & flux kept
+// across passes, while each pass's photon map is freed after gathering)
+struct VisiblePoint{
+  Point p, n;
+  Color weight;
+  float radius;
+  float count;
+  Color flux;
+};
+vector<VisiblePoint> visiblePoints;
+atomic<int> visibleNext;
+BalancedPhotonMap *passMap = NULL;
+PhotonGrid *passGrid = NULL;
+int progressivePasses = 0;
+void progressivePhotonMapping();
+void progressiveThread(int pass);
+Color progressiveColor(int pixel);
+
+
+// progressive & adaptive rendering (sums of each pixel's luminances & squared luminances, the colors are in the render,
+// with the time & samples spent on each tile, and the tiles to render next)
+vector<float> progressiveLum;
+int tilesX, tilesY;
+vector<double> tileTime;
+vector<long long> tileSamples;
+vector<int> tileList;
+atomic<int> tileNext;
+chrono::steady_clock::time_point progressiveStart;
+void progressiveRendering();
+void adaptiveRendering();
+chrono::steady_clock::time_point setupTiles();
+template <class F> void forTilePixels(int tile, F f);
+void renderTiles(int pass, int samples);
+float pixelVariance(int pixel);
+float displayVariance(int pixel);
+float resolveTiles();
+void saveTiles(chrono::steady_clock::time_point now, chrono::steady_clock::time_point &saved);
+void tileThread(int i, int pass, int samples);
+
+
+// checkpoints of a long render (written by the main thread while the render threads wait at a pixel or tile boundary)
+// with each thread's next pixel & random state (per pixel) or the tiles left in the pass (progressive & adaptive)
+atomic<bool> checkpointPause(false);
+atomic<int> threadsWaiting(0);
+atomic<int> threadsRunning(0);
+int threadPixel[numThreads];
+mt19937 threadRnd[numThreads];
+static const int checkpointMagic = 0x31504b43;
+int checkpointMode = 0;
+int checkpointPass = 0;
+int checkpointSamples = 0;
+int checkpointTotal = 0;
+unsigned long long checkpointHash = 0;
+chrono::steady_clock::time_point checkpointTime;
+double checkpointEvery = 0.0;
+void joinThreads(thread t[]);
+void waitForCheckpoint();
+double saveCheckpoint();
+bool loadCheckpoint();
+
+
+// path tracing (the environment's shadow rays get an occluder cache slot, like a light)
+int environmentSlot = newOccluderSlot();
+Color tracePath(Cone &ray, HitInfo &hi, Material *m, LightList &lights, mt19937 &rnd, uniform_real_distribution<float> &dist);
+Color tracePathGI(Cone &ray, HitInfo &hi, Material *m, LightList &lights, mt19937 &rnd, uniform_real_distribution<float> &dist);
+Color sampleLight(Light *light, float pick, int count, Material *m, Cone &r, HitInfo &h, bool last, mt19937 &rnd, uniform_real_distribution<float> &dist);
+Color sampleEnvironmentLight(Material *m, Cone &r, HitInfo &h, LightList &lights, bool last, mt19937 &rnd, uniform_real_distribution<float> &dist);
 
 
 // for camera ray generation
@@ -78,31 +232,86 @@ Point cameraRay(float pX, float pY, Point offset);
 // ray tracer
 int main(){
   
+  // the path tracer computes all global illumination itself (no caches or photon maps)
+  if(pathTracing){
+    irradCache = false;
+    photonMap = false;
+  }
+  
   // load scene: root node, camera, image (and set shadow casting variables)
   loadScene(xml, printXML, shadowMin, shadowMax, globalIllum, irradCache, samplesGI, invSqFO, photonMap);
   
   // set the scene as the root node
   setScene(rootNode);
   
+  // set soft shadow sampling (Halton or Sobol with variance-driven termination)
+  setSoftShadowSampling(sobolShadows, shadowVariance);
+  
+  // importance sample the environment texture for indirect lighting
+  if(envSampling)
+    setEnvironmentSampling(environment, envSamplingRes);
+  
+  // with many lights, pick a few per shading point from a light tree
+  if(lightSamples > 0)
+    lights.buildTree(lightSamples, invSqFO);
+  
   // set variables for ray tracing
   w = render.getWidth();
   h = render.getHeight();
   size = render.getSize();
-  img = render.getRender();
   zImg = render.getZBuffer();
   sampleImg = render.getSample();
-  if(globalIllum && irradCache)
+  if(globalIllum && irradCache && screenCache)
     im.Initialize(w, h);
   
   // set variables for generating camera rays
   cameraRayVars();
   
-  // compute an irradiance cache for global illumination
-  if(globalIllum && irradCache){
+  // use a world-space irradiance cache (filled in while rendering)
+  if(globalIllum && irradCache && !screenCache){
+    irradianceOctree = new IrradianceCache(rootNode.getChildBoundBox(), cacheError, cacheMinRadius, cacheMaxRadius);
+    
+    // load a cache saved for the same scene & GI settings (only missing records get computed)
+    // or the one saved with the checkpoint being resumed
+    stringstream settings;
+    settings << samplesGI << " " << cacheError << " " << cacheMinRadius << " " << cacheMaxRadius << " " << shadowMin << " " << shadowMax << " " << invSqFO << " " << sobolShadows << " " << shadowVariance << " " << lightSamples;
+    cacheHash = hashBytes(settings.str().c_str(), settings.str().size(), hashScene(xml));
+    string cacheLoad = cacheFile;
+    if(cacheLoad == "" && resume && checkpointFile != "")
+      cacheLoad = checkpointFile + ".cache";
+    if(cacheLoad != ""){
+      int loaded = irradianceOctree->load(cacheLoad, cacheHash);
+      cout << "irradiance cache: " << loaded << " records loaded from " << cacheLoad << endl;
+    }
+    
+    // seed the cache from coarse to fine pixel grids (in parallel), so records do not depend on pixel order
+    if(cachePrepass > 0){
+      IrradianceOctreeLight *l = new IrradianceOctreeLight();
+      l->setCache(irradianceOctree);
+      l->setLightList(&lights);
+      l->setEnvironment(environment);
+      l->setSamples(samplesGI);
+      string name = "irradianceOctree";
+      Light *light = l;
+      light->setName(name);
+      cacheLights.deleteAll();
+      cacheLights.push_back(light);
+      for(int stride = 32; stride >= cachePrepass; stride /= 2){
+        cachePoints.clear();
+        for(int y = 0; y < h; y += stride)
+          for(int x = 0; x < w; x += stride)
+            if(stride == 32 || x % (stride * 2) != 0 || y % (stride * 2) != 0)
+              cachePoints.push_back(x + y * w);
+        irradianceCacheLevel("prepass stride " + to_string(stride));
+      }
+    }
+  }
+  
+  // compute a (screen-space) irradiance cache for global illumination
+  if(globalIllum && irradCache && screenCache){
     
     // caching light list
-    LightList lightCache;
-    lightCache.deleteAll();
+    cacheLights.deleteAll();
     string name = "indirect";
     IrradianceCacheLight *l = new IrradianceCacheLight();
     Light *light = NULL;
@@ -111,7 +320,7 @@ int main(){
     l->setSamples(samplesGI);
     light = l;
     light->setName(name);
-    lightCache.push_back(light);
+    cacheLights.push_back(light);
     
     // subdivide our image to compute indirect illumination
     bool subdivide = true;
@@ -121,40 +330,47 @@ int main(){
       if(im.GetSubdivLevel() == 0)
         subdivide = false;
       
-      // calculate indirect illumination
-      int cnt = 0;
+      // find the points that need computing (invalid ones)
+      vector<int> index;
+      cachePoints.clear();
       for(int i = 0; i < im.GetDataCount(); i++){
-        
-        // grab position on image plane
-        float px;
-        float py;
-        im.GetPosition(i, px, py);
-        
-        // get the pixel number
-        int pixel = px + py * w;
-        
-        // compute the ray tracing cache (if needs to be set)
-        if(!im.IsValid(i))
-          irradianceCache(pixel, i, lightCache);
+        if(!im.IsValid(i)){
+          
+          // grab position on image plane, get the pixel number
+          float px;
+          float py;
+          im.GetPosition(i, px, py);
+          cachePoints.push_back(px + py * w);
+          index.push_back(i);
+        }
       }
       
+      // calculate indirect illumination (in parallel), then store it in the map
+      irradianceCacheLevel("level " + to_string(im.GetSubdivLevel()));
+      for(int k = 0; k < (int) index.size(); k++)
+        im.Set(index[k], cacheValues[k]);
+      
       // subdivide (if necessary)
       if(subdivide)
         im.Subdivide();
     }
   }
   
-  // compute a photon map for global illumination
-  if(photonMap){
-    
-    // initialize photon map
-    PhotonMap *map = createPhotonMap(samplesPM);
-    
-    // calculate total light power for random selection
-    float powTot = 0.0;
-    int numLights = lights.size();
-    float *lightPow = new float[numLights];
-    float *lightProb = new float[numLights];
+  // progressive photon mapping replaces the (single) photon map, for direct photon lookups only
+  if(progressivePM && (globalIllum || pathTracing)){
+    cout << "progressive photon mapping needs globalIllum & pathTracing off" << endl;
+    progressivePM = false;
+  }
+  if(progressivePM){
+    photonMap = false;
+    causticMap = false;
+  }
+  
+  // calculate total light power for random selection
+  int numLights = lights.size();
+  if(photonMap || progressivePM){
+    lightPow = new float[numLights];
+    lightProb = new float[numLights];
     for(int i = 0; i < numLights; i++){
       if(lights[i]->isPhotonSource()){
         powTot += lights[i]->getPhotonIntensity().Grey();
@@ -165,120 +381,161 @@ int main(){
     }
     for(int i = 0; i < numLights; i++)
       lightProb[i] = lights[i]->getPhotonIntensity().Grey() / powTot;
+  }
+  
+  // run the passes of progressive photon mapping (gathered into each pixel when rendering)
+  if(progressivePM)
+    progressivePhotonMapping();
+  
+  // with checkpoints, save the photon map next to them (so a resumed render maps it instead of tracing it again)
+  if(checkpointFile != "" && photonFile == "")
+    photonFile = checkpointFile + ".photons";
+  
+  // compute a photon map for global illumination
+  if(photonMap){
     
-    // keep track of generated photons
-    int genPhotons = 0;
+    // reuse a photon map saved for the same scene & photon settings (mapped, not copied)
+    PhotonMapHeader header;
+    if(photonFile != ""){
+      stringstream settings;
+      settings << samplesPM << " " << bounceCountPM << " " << globalIllum << " " << causticMap;
+      header.hash = hashBytes(settings.str().c_str(), settings.str().size(), hashScene(xml));
+      header.bounces = bounceCountPM;
+      header.power = powTot;
+      pm = mapPhotonMap(photonFile.c_str(), header);
+      if(pm)
+        cout << "photon map: " << pm->stored_photons << " photons mapped from " << photonFile << endl;
+    }
     
-    // setup random generator for photon mapping
-    mt19937 rnd;
-    uniform_real_distribution<float> dist{0.0, 1.0};
+    // otherwise, trace a new one (and save it for the next run)
+    if(!pm){
+      pm = tracePhotonMap("photon map", samplesPM, false);
+      if(photonFile != "" && !writePhotonMap(pm, photonFile.c_str(), header))
+        cout << "could not save the photon map to " << photonFile << endl;
+    }
     
-    // fill our photon map
-    while(map->stored_photons < samplesPM){
-      
-      // photon variables
-      Color pow;
-      int bounce = 1;
-      bool cont = true;
+    // precompute irradiance at a subset of the photons (so lookups only need the nearest one)
+    if(photonIrrad){
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      pmIrrad = precomputeIrradiance(pm, photonIrradStride, photonRad, maxPhotons, numThreads);
+      chrono::duration<double> time = chrono::steady_clock::now() - start;
+      cout << "photon irradiance: " << pmIrrad->stored_photons << " photons in " << time.count() << " s" << endl;
+    }
+    
+    // trace a separate caustic map (light, specular bounces, then a diffuse surface)
+    if(causticMap){
       
-      // select random light
-      Light *light;
-      float probLight;
-      int l = 0;
-      bool foundLight = false;
-      float randomPow = dist(rnd) * powTot;
-      while(!foundLight){
-        if(randomPow <= lightPow[l]){
-          light = lights[l];
-          probLight = lightProb[l];
-          foundLight = true;
+      // projection maps of the photon sources, and their power toward specular surfaces
+      causticPow = new float[numLights];
+      causticProb = new float[numLights];
+      for(int i = 0; i < numLights; i++){
+        Point center;
+        float radius;
+        ProjectionMap *projection = NULL;
+        if(lights[i]->isPhotonSource() && lights[i]->getPosition(center, radius))
+          projection = new ProjectionMap(center, projectionRes);
+        if(projection && !projection->empty()){
+          causticProb[i] = lights[i]->getPhotonIntensity().Grey();
+          causticPowTot += causticProb[i];
+          causticPow[i] = causticPowTot;
+        }else{
+          causticProb[i] = 0.0;
+          causticPow[i] = -1.0;
         }
-        l++;
+        projections.push_back(projection);
       }
+      for(int i = 0; i < numLights; i++)
+        causticProb[i] /= causticPowTot;
       
-      // initialize our photon
-      pow = light->getPhotonIntensity() * 4.0 * M_PI / probLight;
-      Cone randPhoton = light->randomPhoton();
-      
-      // ignore first hit (direct lighting) unless using Monte Carlo GI
-      bool store = false;
-      if(globalIllum)
-        store = true;
-      
-      // loop for tracing a photon
-      while(cont){
-        
-        // trace photon in scene
-        HitInfo hi = HitInfo();
-        bool hit = traceRay(randPhoton, hi);
-        
-        // if hit, get the node's material
-        if(hit){
-          Node *n = hi.node;
-          Material *m;
-          if(n)
-            m = n->getMaterial();
-          
-          // if there is a material that is a photon surface, calculate probabilities
-          if(m){
-            
-            // first, save our photon hit (only if a photon surface & a front hit!)
-            if(m->isPhotonSurface() && hi.front && store){
-              float *power, *position, *direction;
-              power = new float[3];
-              pow.GetValue(power);
-              position = new float[3];
-              hi.p.GetValue(position);
-              direction = new float[3];
-              randPhoton.dir.GetValue(direction);
-              storePhoton(map, power, position, direction);
-            }
-            
-            // pass our photon hit to the surface to get next photon (if not absorbed)
-            cont = m->randomPhotonBounce(randPhoton, pow, hi);
-            
-            // be sure to store following protons
-            if(!store)
-              store = true;
-          }
-          
-          // otherwise, terminate photon
-          else
-            cont = false;
-        
-        // if we hit nothing, terminate photon
-        }else
-          cont = false;
-          
-        // check our photon bounce count
-        bounce++;
-        if(bounce > bounceCountPM)
-          cont = false;
+      // nothing to focus the light, so no caustics
+      if(causticPowTot <= 0.0)
+        cout << "caustic map: no specular surfaces seen from the lights" << endl;
+      else{
+        pmCaustic = tracePhotonMap("caustic map", samplesCM, true);
+        if(pmCaustic->stored_photons == 0){
+          cout << "caustic map: no caustic photons stored" << endl;
+          pmCaustic = NULL;
+        }
       }
-      
-      // add to our generated photons
-      genPhotons++;
     }
     
-    // scale photon map by number of generated photons
-    float scale = 1.0 / ((float) genPhotons);
-    scalePhotonPower(map, scale);
+    // look up photons in a hashed grid instead of the kd-tree (fixed radius, unless irradiance is precomputed)
+    if(photonGrid && !pmIrrad){
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      pmGrid = buildPhotonGrid(pm, photonRad, numThreads);
+      chrono::duration<double> time = chrono::steady_clock::now() - start;
+      cout << "photon grid: " << pmGrid->stored_photons << " photons in " << time.count() << " s" << endl;
+      destroyPhotonMap(pm);
+      pm = NULL;
+    }
     
-    // balance our photon map
-    pm = balancePhotonMap(map);
+    // store the photons compact (once saved & precomputed from)
+    if(compactPM){
+      if(pm)
+        compactPhotons("photon map", pm);
+      if(pmIrrad)
+        compactPhotons("photon irradiance", pmIrrad);
+      if(pmCaustic)
+        compactPhotons("caustic map", pmCaustic);
+    }
   }
   
-  // start ray tracing loop (in parallel with threads)
-  thread t[numThreads];
-  for(int i = 0; i < numThreads; i++)
-    t[i] = thread(rayTracing, i);
+  // checkpoints only resume a render of the same scene, image & settings
+  checkpointMode = adaptiveTiles ? 2 : progressive ? 1 : 0;
+  if(checkpointFile != ""){
+    stringstream settings;
+    settings << checkpointMode << " " << w << " " << h << " " << (checkpointMode == 0 ? sampleMax : 0) << " " << sampleMin << " " << sampleThreshold << " " << tileSize << " " << adaptiveInitial;
+    settings << " " << bounceCount << " " << iterativePaths << " " << rouletteDepth << " " << shadowMin << " " << shadowMax << " " << sobolShadows << " " << shadowVariance << " " << lightSamples;
+    settings << " " << globalIllum << " " << pathTracing << " " << irradCache << " " << screenCache << " " << samplesGI << " " << envSampling << " " << invSqFO << " " << zBuffer;
+    settings << " " << photonMap << " " << samplesPM << " " << photonRad << " " << maxPhotons << " " << photonIrrad << " " << causticMap << " " << samplesCM << " " << progressivePM << " " << passesPM << " " << photonsPerPass << " " << alphaPM << " " << radiusPM;
+    checkpointHash = hashBytes(settings.str().c_str(), settings.str().size(), hashScene(xml));
+  }
+  checkpointTime = chrono::steady_clock::now();
+  checkpointEvery = checkpointInterval;
   
-  // when finished, join all threads back to main
-  for(int i = 0; i < numThreads; i++)
-    t[i].join();
+  // render the whole image in passes (stopping at a time budget or noise target)
+  // or spread a sample budget over the tiles with the most error
+  if(adaptiveTiles)
+    adaptiveRendering();
+  else if(progressive)
+    progressiveRendering();
+  
+  // or, start ray tracing loop (in parallel with threads), from the pixels a resumed checkpoint got to
+  else{
+    progressiveStart = checkpointTime;
+    for(int i = 0; i < numThreads; i++)
+      threadPixel[i] = i;
+    if(resume)
+      loadCheckpoint();
+    thread t[numThreads];
+    threadsRunning = numThreads;
+    for(int i = 0; i < numThreads; i++)
+      t[i] = thread(rayTracing, i);
+    
+    // when finished, join all threads back to main
+    joinThreads(t);
+  }
   
-  // output ray-traced image & z-buffer & sample count image (if set)
+  // checkpoint the finished (or stopped) render, so it can be resumed with a larger budget
+  if(checkpointFile != "")
+    saveCheckpoint();
+  
+  // report the size of the world-space irradiance cache (and save it for the next render)
+  if(irradianceOctree){
+    cout << "irradiance cache: " << irradianceOctree->size() << " records" << endl;
+    if(cacheFile != "" && !irradianceOctree->save(cacheFile, cacheHash))
+      cout << "could not save the irradiance cache to " << cacheFile << endl;
+  }
+  
+  // report how much the occluder cache saved on shadow rays
+  if(shadowStats)
+    printShadowStats();
+  
+  // tone map & output ray-traced image (and its linear colors) & z-buffer & sample count image (if set)
+  render.tonemap(exposure, gammaCorr);
   render.save("images/image.ppm");
+  if(hdrImage)
+    render.savePFM("images/image.pfm");
   if(zBuffer){
     render.computeZImage();
     render.saveZImage("images/imageZ.ppm");
@@ -294,56 +551,26 @@ int main(){
 void rayTracing(int i){
   
   // initial starting pixel
-  int pixel = i;
+  int pixel = threadPixel[i];
   
-  // setup random generator for anti-aliasing & depth-of-field
-  mt19937 rnd;
+  // setup random generator for anti-aliasing & depth-of-field (as it was at that pixel)
+  mt19937 rnd = threadRnd[i];
   uniform_real_distribution<float> dist{0.0, 1.0};
   
   // create new light list for thread
   LightList threadLights;
-  threadLights.deleteAll();
-  
-  // update our thread light list
-  threadLights = lights;
-  
-  // if necessary, add new irradiance map light
-  if(globalIllum && irradCache){
-    IrradianceMapLight *l = new IrradianceMapLight();
-    string name = "irradianceMap";
-    Light *light = NULL;
-    light = l;
-    light->setName(name);
-    threadLights.push_back(light);
-  }
-  
-  // if necessary, add a photon map light
-  if(photonMap && !globalIllum){
-    PhotonMapLight *l = new PhotonMapLight();
-    l->setPhotonMap(pm, photonRad, maxPhotons);
-    string name = "photonMap";
-    Light *light = NULL;
-    light = l;
-    light->setName(name);
-    threadLights.push_back(light);
-  }
-  
-  // if necessary, add a Monte Carlo photon map light
-  if(photonMap && globalIllum){
-    MonteCarloPhotonMapLight *l = new MonteCarloPhotonMapLight();
-    l->setPhotonMap(pm, photonRad, maxPhotons);
-    l->setEnvironment(environment);
-    l->setSamples(samplesGI);
-    string name = "monteCarloPhotonMap";
-    Light *light = NULL;
-    light = l;
-    light->setName(name);
-    threadLights.push_back(light);
-  }
+  setThreadLights(threadLights);
    
   // thread continuation condition
   while(pixel < size){
     
+    // wait while a checkpoint is written (from this pixel on)
+    if(checkpointPause){
+      threadPixel[i] = pixel;
+      threadRnd[i] = rnd;
+      waitForCheckpoint();
+    }
+    
     // number of samples
     int s = 0;
     
@@ -353,7 +580,7 @@ void rayTracing(int i){
     
     // color values to store across samples
     Color col;
-    Color colAvg;
+    Color colAvg = Color(0.0, 0.0, 0.0);
     float zAvg = 0.0;
     float rVar = 0.0;
     float gVar = 0.0;
@@ -364,77 +591,26 @@ void rayTracing(int i){
     // random rotation of Halton sequence on circle of confusion
     float dcR = dist(rnd) * 2.0 * M_PI;
     
+    // scramble low-discrepancy sampling for this pixel
+    setPixelSeed(pixel);
+    
+    // take more samples for pixels with a penumbra (detected by the soft shadows)
+    int minSamples = sampleMin;
+    pixelPenumbra = false;
+    
     // if necessary, update irradiance map light with indirect color
-    if(globalIllum && irradCache){
-      Color c;
-      float z;
-      Point N;
-      ColorIM cim;
-      cim.c = c;
-      cim.z = z;
-      cim.N = N;
-      im.Eval(cim, pX, pY);
-      int index = threadLights.size() - 1;
-      Light *light = threadLights[index];
-      light->setColor(cim.c);
-    }
+    setPixelIrradiance(threadLights, pX, pY);
     
     // compute multi-adaptive sampling for each pixel (anti-aliasing)
-    while(s < sampleMin || (s != sampleMax && (rVar * perR > var + brightness * var || gVar * perG > var + brightness * var || bVar * perB > var + brightness * var))){
-      
-      // grab Halton sequence to shift point by on image plane
-      float dpX = centerHalton(Halton(s, 3));
-      float dpY = centerHalton(Halton(s, 2));
-      
-      // grab Halton sequence to shift point along circle of confusion
-      float dcS = sqrt(Halton(s, 2)) * camera.dof;
+    while(s < minSamples || (s != sampleMax && (rVar * perR > var + brightness * var || gVar * perG > var + brightness * var || bVar * perB > var + brightness * var))){
       
-      // grab Halton sequence to shift point around circle of confusion
-      float dcT = Halton(s, 3) * 2.0 * M_PI;
-      
-      // compute the offset for depth of field sampling
-      Point posOffset = (*dVx * cos(dcR + dcT) + *dVy * sin(dcR + dcT)) * dcS;
-      
-      // transform ray into world space (offset by Halton seqeunce for sampling)
-      Point rayDir = cameraRay(pX + dpX, pY + dpY, posOffset);
-      Cone *ray = new Cone();
-      ray->pos = camera.pos + c->transformFrom(posOffset);
-      ray->dir = c->transformFrom(rayDir);
-      ray->radius = 0.0;
-      ray->tan = dXV->x / (2.0 * imageDistance);
-      
-      // traverse through scene DOM
-      // transform rays into model space
-      // detect ray intersections and get back HitInfo
-      HitInfo hi = HitInfo();
-      bool hit = traceRay(*ray, hi);
+      // trace one camera ray through the pixel
+      float z;
+      col = samplePixel(pX, pY, s, dcR, threadLights, rnd, dist, z);
       
       // update z-buffer, if necessary
       if(zBuffer)
-        zAvg = (zAvg * s + hi.z) / (float) (s + 1);
-      
-      // if hit, get the node's material
-      if(hit){
-        Node *n = hi.node;
-        Material *m;
-        if(n)
-          m = n->getMaterial();
-        
-        // if there is a material, shade the pixel
-        // 5-passes for reflections and refractions
-        if(m)
-          col = m->shade(*ray, hi, threadLights, bounceCount);
-        
-        // otherwise color it white (as a hit)
-        else
-          col.Set(0.929, 0.929, 0.929);
-        
-      // if we hit nothing, draw the background
-      }else{
-        Point p = Point((float) pX / w, (float) pY / h, 0.0);
-        Color b = background.sample(p);
-        col = b;
-      }
+        zAvg = (zAvg * s + z) / (float) (s + 1);
       
       // compute average color
       float rAvg = (colAvg.r * s + col.r) / (float) (s + 1);
@@ -459,6 +635,10 @@ void rayTracing(int i){
       // increment sample count
       s++;
       
+      // penumbra pixels need at least twice the minimum samples
+      if(pixelPenumbra && minSamples == sampleMin)
+        minSamples = min(2 * sampleMin, sampleMax);
+      
       // watch for errors at any individual sample, terminate thread if so
       if(colAvg[0] != colAvg[0] || colAvg[1] != colAvg[1] || colAvg[2] != colAvg[2]){
         cout << "ERROR - pixel " << pixel << " & sample " << s << endl;
@@ -467,15 +647,10 @@ void rayTracing(int i){
       }
     }
     
-    // gamma correction
-    if(gammaCorr){
-      colAvg.r = pow(colAvg.r, 1.0 / 2.2);
-      colAvg.g = pow(colAvg.g, 1.0 / 2.2);
-      colAvg.b = pow(colAvg.b, 1.0 / 2.2);
-    }
-    
-    // color the pixel image
-    img[pixel] = Color24(colAvg);
+    // store the pixel's linear color (with the photons gathered at its visible points, for progressive photon mapping)
+    if(progressivePM)
+      colAvg += progressiveColor(pixel);
+    render.addSamples(pixel, colAvg, s);
     
     // update the z-buffer image, if necessary
     if(zBuffer)
@@ -488,57 +663,1286 @@ void rayTracing(int i){
     // re-assign next pixel (naive, but works)
     pixel += numThreads;
   }
+  threadPixel[i] = pixel;
+  threadRnd[i] = rnd;
+  threadsRunning--;
+}
+
+
+// fill a render thread's light list (the scene lights, plus the indirect light used for global illumination)
+void setThreadLights(LightList &threadLights){
+  
+  // update our thread light list
+  threadLights.deleteAll();
+  threadLights = lights;
+  
+  // if necessary, add new irradiance map light
+  if(globalIllum && irradCache && screenCache){
+    IrradianceMapLight *l = new IrradianceMapLight();
+    string name = "irradianceMap";
+    Light *light = NULL;
+    light = l;
+    light->setName(name);
+    threadLights.push_back(light);
+  }
+  
+  // if necessary, add a world-space irradiance cache light
+  if(globalIllum && irradCache && !screenCache){
+    IrradianceOctreeLight *l = new IrradianceOctreeLight();
+    l->setCache(irradianceOctree);
+    l->setLightList(&lights);
+    l->setEnvironment(environment);
+    l->setSamples(samplesGI);
+    string name = "irradianceOctree";
+    Light *light = NULL;
+    light = l;
+    light->setName(name);
+    threadLights.push_back(light);
+  }
+  
+  // if necessary, add a photon map light
+  if(photonMap && !globalIllum){
+    PhotonMapLight *l = new PhotonMapLight();
+    l->setPhotonMap(pm, photonRad, maxPhotons);
+    l->setIrradianceMap(pmIrrad);
+    l->setPhotonGrid(pmGrid);
+    l->setCausticMap(pmCaustic, causticRad, maxCaustic);
+    string name = "photonMap";
+    Light *light = NULL;
+    light = l;
+    light->setName(name);
+    threadLights.push_back(light);
+  }
+  
+  // if necessary, add a Monte Carlo photon map light
+  if(photonMap && globalIllum){
+    MonteCarloPhotonMapLight *l = new MonteCarloPhotonMapLight();
+    l->setPhotonMap(pm, photonRad, maxPhotons);
+    l->setIrradianceMap(pmIrrad);
+    l->setPhotonGrid(pmGrid);
+    l->setCausticMap(pmCaustic, causticRad, maxCaustic);
+    l->setEnvironment(environment);
+    l->setSamples(samplesGI);
+    string name = "monteCarloPhotonMap";
+    Light *light = NULL;
+    light = l;
+    light->setName(name);
+    threadLights.push_back(light);
+  }
+}
+
+
+// set the indirect color of a pixel from the (screen-space) irradiance map, if used
+void setPixelIrradiance(LightList &threadLights, float pX, float pY){
+  if(globalIllum && irradCache && screenCache){
+    Color c;
+    float z = 0.0;
+    Point N;
+    ColorIM cim;
+    cim.c = c;
+    cim.z = z;
+    cim.N = N;
+    im.Eval(cim, pX, pY);
+    int index = threadLights.size() - 1;
+    Light *light = threadLights[index];
+    light->setColor(cim.c);
+  }
+}
+
+
+// trace sample s of a pixel (the camera ray, shaded), and return its color & depth
+Color samplePixel(float pX, float pY, int s, float dcR, LightList &threadLights, mt19937 &rnd, uniform_real_distribution<float> &dist, float &z){
+  Color col;
+  
+  // grab Halton sequence to shift point by on image plane
+  float dpX = centerHalton(Halton(s, 3));
+  float dpY = centerHalton(Halton(s, 2));
+  
+  // grab Halton sequence to shift point along circle of confusion
+  float dcS = sqrt(Halton(s, 2)) * camera.dof;
+  
+  // grab Halton sequence to shift point around circle of confusion
+  float dcT = Halton(s, 3) * 2.0 * M_PI;
+  
+  // compute the offset for depth of field sampling
+  Point posOffset = (*dVx * cos(dcR + dcT) + *dVy * sin(dcR + dcT)) * dcS;
+  
+  // transform ray into world space (offset by Halton seqeunce for sampling)
+  Point rayDir = cameraRay(pX + dpX, pY + dpY, posOffset);
+  Cone ray = Cone();
+  ray.pos = camera.pos + c->transformFrom(posOffset);
+  ray.dir = c->transformFrom(rayDir);
+  ray.radius = 0.0;
+  ray.tan = dXV->x / (2.0 * imageDistance);
+  
+  // traverse through scene DOM
+  // transform rays into model space
+  // detect ray intersections and get back HitInfo
+  HitInfo hi = HitInfo();
+  bool hit = traceRay(ray, hi);
+  z = hi.z;
+  
+  // if hit, get the node's material
+  if(hit){
+    Node *n = hi.node;
+    Material *m = NULL;
+    if(n)
+      m = n->getMaterial();
+    
+    // if there is a material, shade the pixel
+    // 5-passes for reflections and refractions (recursive, or one lobe per bounce)
+    if(m && pathTracing)
+      col = tracePathGI(ray, hi, m, threadLights, rnd, dist);
+    else if(m && iterativePaths)
+      col = tracePath(ray, hi, m, threadLights, rnd, dist);
+    else if(m)
+      col = m->shade(ray, hi, threadLights, bounceCount);
+    
+    // otherwise color it white (as a hit)
+    else
+      col.Set(0.929, 0.929, 0.929);
+    
+  // if we hit nothing, draw the background
+  }else{
+    Point p = Point((float) pX / w, (float) pY / h, 0.0);
+    Color b = background.sample(p);
+    col = b;
+  }
+  return col;
+}
+
+
+// progressive rendering: passes over the whole image (1, 2, 4, ... samples per pixel, up to sampleMax in all)
+// taken tile by tile, accumulated in a float buffer, until the time budget or noise target is reached
+void progressiveRendering(){
+  chrono::steady_clock::time_point saved = setupTiles();
+  tileList.clear();
+  for(int tile = 0; tile < tilesX * tilesY; tile++)
+    tileList.push_back(tile);
+  
+  // or continue the pass a checkpoint stopped in (with the tiles it had left)
+  bool resumed = resume && loadCheckpoint();
+  int pass = resumed ? checkpointPass : 0;
+  int total = resumed ? checkpointTotal : 0;
+  for(; total < sampleMax; pass++){
+    
+    // render the tiles of this pass, and resolve the image
+    int samples = resumed ? checkpointSamples : min(1 << pass, sampleMax - total);
+    checkpointPass = pass;
+    checkpointSamples = samples;
+    checkpointTotal = total;
+    renderTiles(pass, samples);
+    total += samples;
+    if(resumed){
+      resumed = false;
+      tileList.clear();
+      for(int tile = 0; tile < tilesX * tilesY; tile++)
+        tileList.push_back(tile);
+    }
+    float noise = resolveTiles();
+    
+    // report progress
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    chrono::duration<double> time = now - progressiveStart;
+    bool outOfTime = timeBudget > 0.0 && time.count() >= timeBudget;
+    cout << "progressive pass " << pass + 1 << ": " << total << " samples per pixel in " << time.count() << " s (noise " << noise << ")";
+    cout << (outOfTime ? ", out of time" : "") << endl;
+    
+    // stop at the time budget or noise target
+    if(outOfTime || (noiseTarget > 0.0 && noise <= noiseTarget))
+      break;
+    
+    // otherwise, write out the image so far (at most every saveInterval seconds)
+    if(total < sampleMax)
+      saveTiles(now, saved);
+  }
+}
+
+
+// adaptive rendering: a cheap pass of adaptiveInitial samples per pixel, then rounds that double the samples
+// of the tiles with the most error removed per second (estimated from each tile's pixel variances & timing),
+// until the image has used sampleBudget samples per pixel or its noise reaches noiseTarget
+void adaptiveRendering(){
+  chrono::steady_clock::time_point saved = setupTiles();
+  int tiles = tilesX * tilesY;
+  tileList.clear();
+  for(int tile = 0; tile < tiles; tile++)
+    tileList.push_back(tile);
+  
+  // or continue the round a checkpoint stopped in (with the tiles it had left)
+  bool resumed = resume && loadCheckpoint();
+  int round = resumed ? checkpointPass : 0;
+  int samples = resumed ? checkpointSamples : min(max(adaptiveInitial, 1), sampleMax);
+  long long budget = (long long) sampleBudget * size;
+  long long usedBefore = -1;
+  for(; ; ){
+    checkpointPass = round;
+    checkpointSamples = samples;
+    renderTiles(round, samples);
+    round++;
+    float noise = resolveTiles();
+    
+    // error (summed variances of the pixel means) & samples per pixel of each tile, and their priority:
+    // the error removed by doubling its samples, over the time that takes
+    long long used = 0;
+    vector<pair<double, int> > priority;
+    for(int tile = 0; tile < tiles; tile++){
+      double error = 0.0;
+      int pixels = 0, spp = sampleMax;
+      forTilePixels(tile, [&](int pixel, int x, int y){
+        error += displayVariance(pixel);
+        spp = min(spp, render.getHdrSamples(pixel));
+        used += render.getHdrSamples(pixel);
+        pixels++;
+      });
+      double cost = tileTime[tile] / max(tileSamples[tile], 1LL) * pixels * spp;
+      if(spp < sampleMax && error > 0.0)
+        priority.push_back(make_pair(error * 0.5 / max(cost, 1e-9), tile));
+    }
+    
+    // report progress
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    chrono::duration<double> time = now - progressiveStart;
+    bool outOfTime = timeBudget > 0.0 && time.count() >= timeBudget;
+    cout << "adaptive round " << round << ": " << (float) used / size << " samples per pixel in " << time.count() << " s (noise " << noise << ")";
+    cout << (outOfTime ? ", out of time" : "") << endl;
+    
+    // stop at the time budget, sample budget or noise target (or with every tile at sampleMax,
+    // or when a round added no samples, as for pixels whose samples are all errors)
+    if(outOfTime || used >= budget || priority.empty() || used == usedBefore || (noiseTarget > 0.0 && noise <= noiseTarget))
+      break;
+    usedBefore = used;
+    saveTiles(now, saved);
+    
+    // double the samples of the best quarter of the tiles (as far as the sample budget allows)
+    sort(priority.begin(), priority.end(), greater<pair<double, int> >());
+    tileList.clear();
+    long long planned = used;
+    for(int k = 0; k < (int) priority.size() && (k == 0 || k < ((int) priority.size() + 3) / 4); k++){
+      int tile = priority[k].second;
+      long long added = 0;
+      forTilePixels(tile, [&](int pixel, int x, int y){
+        added += min(max(render.getHdrSamples(pixel), 1), sampleMax - render.getHdrSamples(pixel));
+      });
+      if(k > 0 && planned + added > budget)
+        break;
+      tileList.push_back(tile);
+      planned += added;
+    }
+    samples = 0;
+  }
+}
+
+
+// setup the float buffers & tile grid for progressive or adaptive rendering (returns the start time)
+chrono::steady_clock::time_point setupTiles(){
+  progressiveStart = chrono::steady_clock::now();
+  progressiveLum.assign(2 * size, 0.0);
+  tilesX = (w + tileSize - 1) / tileSize;
+  tilesY = (h + tileSize - 1) / tileSize;
+  tileTime.assign(tilesX * tilesY, 0.0);
+  tileSamples.assign(tilesX * tilesY, 0);
+  return progressiveStart;
+}
+
+
+// call f(pixel, x, y) for every pixel of a tile
+template <class F> void forTilePixels(int tile, F f){
+  int x0 = (tile % tilesX) * tileSize;
+  int y0 = (tile / tilesX) * tileSize;
+  for(int y = y0; y < min(y0 + tileSize, h); y++)
+    for(int x = x0; x < min(x0 + tileSize, w); x++)
+      f(y * w + x, x, y);
+}
+
+
+// render the tiles of the tile list (in parallel), adding samples to every pixel (or doubling them, if 0, starting from one)
+void renderTiles(int pass, int samples){
+  tileNext = 0;
+  thread t[numThreads];
+  threadsRunning = numThreads;
+  for(int i = 0; i < numThreads; i++)
+    t[i] = thread(tileThread, i, pass, samples);
+  joinThreads(t);
+}
+
+
+// variance of a pixel's mean luminance (1 with too few samples to tell)
+float pixelVariance(int pixel){
+  int n = render.getHdrSamples(pixel);
+  if(n < 2)
+    return 1.0;
+  float mean = progressiveLum[2 * pixel] / n;
+  return max((progressiveLum[2 * pixel + 1] / n - mean * mean) / (n - 1), 0.0f);
+}
+
+
+// variance of a pixel's mean luminance as displayed (after gamma correction, so dark pixels count for more)
+float displayVariance(int pixel){
+  float variance = pixelVariance(pixel);
+  if(!gammaCorr || render.getHdrSamples(pixel) == 0)
+    return variance;
+  float mean = max(exposure * progressiveLum[2 * pixel] / render.getHdrSamples(pixel), 0.01f);
+  float slope = exposure * pow(mean, 1.0 / 2.2 - 1.0) / 2.2;
+  return variance * slope * slope;
+}
+
+
+// tone map the image so far, returning its noise (root mean square standard error of the displayed pixel luminances)
+float resolveTiles(){
+  float noise = 0.0;
+  render.tonemap(exposure, gammaCorr);
+  for(int pixel = 0; pixel < size; pixel++){
+    if(render.getHdrSamples(pixel) == 0)
+      continue;
+    if(sampleCount)
+      sampleImg[pixel] = render.getHdrSamples(pixel);
+    noise += displayVariance(pixel) / size;
+  }
+  return sqrt(noise);
+}
+
+
+// write out the image so far (at most every saveInterval seconds)
+void saveTiles(chrono::steady_clock::time_point now, chrono::steady_clock::time_point &saved){
+  chrono::duration<double> sinceSave = now - saved;
+  if(saveInterval > 0.0 && sinceSave.count() >= saveInterval){
+    render.save("images/image.ppm");
+    saved = now;
+  }
+}
+
+
+// tile rendering thread (takes the next tile of the list until all are done, or time is up)
+// each pass continues the Halton sequence of every pixel, with scrambles of its own
+void tileThread(int i, int pass, int samples){
+  
+  // setup random generator & light list for thread (the generator is seeded again for every tile)
+  mt19937 rnd;
+  uniform_real_distribution<float> dist{0.0, 1.0};
+  LightList threadLights;
+  setThreadLights(threadLights);
+  
+  while(true){
+    
+    // wait while a checkpoint is written, then (before taking a tile) the time budget ends the pass early
+    // (pixels keep the samples they have, the tiles not taken are left for a resumed render)
+    if(checkpointPause)
+      waitForCheckpoint();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::duration<double> time = start - progressiveStart;
+    if(timeBudget > 0.0 && time.count() >= timeBudget)
+      break;
+    int k = tileNext++;
+    if(k >= (int) tileList.size())
+      break;
+    int tile = tileList[k];
+    
+    // seed by pass & tile, so a tile renders the same whichever thread takes it (and when)
+    rnd.seed(hashInt(pass * tilesX * tilesY + tile + 1));
+    
+    forTilePixels(tile, [&](int pixel, int x, int y){
+      
+      // same rotation on the circle of confusion in every pass, new scrambles
+      float dcR = (hashInt(pixel + 1) >> 8) * (1.0f / 16777216.0f) * 2.0 * M_PI;
+      setPixelSeed(pixel + pass * size);
+      setPixelIrradiance(threadLights, x, y);
+      
+      // accumulate the samples of this pass (color with the photons gathered at the pixel, luminance & its square, depth)
+      int n = render.getHdrSamples(pixel);
+      Color gathered = progressivePM ? progressiveColor(pixel) : Color(0.0, 0.0, 0.0);
+      int first = n;
+      int count = samples > 0 ? samples : min(max(n, 1), sampleMax - n);
+      for(int s = first; s < first + count; s++){
+        float z;
+        Color col = samplePixel(x, y, s, dcR, threadLights, rnd, dist, z);
+        if(col.r != col.r || col.g != col.g || col.b != col.b){
+          cout << "ERROR - pixel " << pixel << " & sample " << s << endl;
+          continue;
+        }
+        col += gathered;
+        float Y = perR * col.r + perG * col.g + perB * col.b;
+        render.addSample(pixel, col);
+        progressiveLum[2 * pixel] += Y;
+        progressiveLum[2 * pixel + 1] += Y * Y;
+        if(zBuffer)
+          zImg[pixel] = (zImg[pixel] * n + z) / (float) (n + 1);
+        n++;
+      }
+      tileSamples[tile] += count;
+    });
+    chrono::duration<double> tileDuration = chrono::steady_clock::now() - start;
+    tileTime[tile] += tileDuration.count();
+  }
+  threadsRunning--;
+}
+
+
+// join the render threads, pausing them for a checkpoint every checkpointInterval seconds
+// (or less often, so writing them takes at most 2% of the render time)
+void joinThreads(thread t[]){
+  while(checkpointFile != "" && threadsRunning > 0){
+    this_thread::sleep_for(chrono::milliseconds(10));
+    chrono::duration<double> sinceCheckpoint = chrono::steady_clock::now() - checkpointTime;
+    if(sinceCheckpoint.count() < checkpointEvery)
+      continue;
+    checkpointPause = true;
+    while(threadsWaiting < threadsRunning)
+      this_thread::sleep_for(chrono::milliseconds(1));
+    double time = saveCheckpoint();
+    checkpointPause = false;
+    checkpointEvery = max(checkpointInterval, 50.0 * time);
+  }
+  for(int i = 0; i < numThreads; i++)
+    t[i].join();
+}
+
+
+// wait at a pixel or tile boundary until the checkpoint is written
+void waitForCheckpoint(){
+  threadsWaiting++;
+  while(checkpointPause)
+    this_thread::sleep_for(chrono::milliseconds(1));
+  threadsWaiting--;
+}
+
+
+// write a checkpoint of the render so far (to a temporary file, renamed over the last one), returning the seconds taken
+// file format: magic, hash, mode & elapsed time, then the threads' next pixels & random states (per pixel), or the pass,
+// its samples & the samples before it, the luminance sums, tile times & samples, and the tiles left (progressive & adaptive),
+// then the render's linear colors, sample counts, z-buffer & sample image
+double saveCheckpoint(){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  chrono::duration<double> elapsed = start - progressiveStart;
+  double seconds = elapsed.count();
+  string temp = checkpointFile + ".tmp";
+  ofstream f(temp.c_str(), ios::out | ios::binary);
+  int header[2] = {checkpointMagic, checkpointMode};
+  f.write(reinterpret_cast<char*>(header), sizeof(header));
+  f.write(reinterpret_cast<char*>(&checkpointHash), sizeof(checkpointHash));
+  f.write(reinterpret_cast<char*>(&seconds), sizeof(seconds));
+  if(checkpointMode == 0){
+    for(int i = 0; i < numThreads; i++){
+      stringstream state;
+      state << threadRnd[i];
+      int length = state.str().size();
+      f.write(reinterpret_cast<char*>(&threadPixel[i]), sizeof(int));
+      f.write(reinterpret_cast<char*>(&length), sizeof(int));
+      f.write(state.str().c_str(), length);
+    }
+  }else{
+    int tiles = tilesX * tilesY;
+    int first = min((int) tileNext, (int) tileList.size());
+    int left = tileList.size() - first;
+    int pass[4] = {checkpointPass, checkpointSamples, checkpointTotal, left};
+    f.write(reinterpret_cast<char*>(pass), sizeof(pass));
+    f.write(reinterpret_cast<char*>(&progressiveLum[0]), 2 * size * sizeof(float));
+    f.write(reinterpret_cast<char*>(&tileTime[0]), tiles * sizeof(double));
+    f.write(reinterpret_cast<char*>(&tileSamples[0]), tiles * sizeof(long long));
+    f.write(reinterpret_cast<char*>(&tileList[0] + first), left * sizeof(int));
+  }
+  render.writeBuffers(f);
+  f.close();
+  if(!f || rename(temp.c_str(), checkpointFile.c_str()) != 0)
+    cout << "could not save the checkpoint to " << checkpointFile << endl;
+  
+  // with the world-space irradiance cache (the photon map was saved once traced)
+  if(irradianceOctree){
+    string cache = cacheFile != "" ? cacheFile : checkpointFile + ".cache";
+    if(!irradianceOctree->save(cache, cacheHash))
+      cout << "could not save the irradiance cache to " << cache << endl;
+  }
+  checkpointTime = chrono::steady_clock::now();
+  chrono::duration<double> time = checkpointTime - start;
+  return time.count();
+}
+
+
+// resume from the checkpoint (if saved for the same scene & settings), false to render from the start
+// the render's buffers are only read once the rest of the file checks out
+bool loadCheckpoint(){
+  if(checkpointFile == "")
+    return false;
+  ifstream f(checkpointFile.c_str(), ios::in | ios::binary);
+  int header[2];
+  unsigned long long hash;
+  double seconds;
+  if(!f.read(reinterpret_cast<char*>(header), sizeof(header)) || !f.read(reinterpret_cast<char*>(&hash), sizeof(hash)) || !f.read(reinterpret_cast<char*>(&seconds), sizeof(seconds))){
+    cout << "checkpoint: nothing to resume in " << checkpointFile << endl;
+    return false;
+  }
+  if(header[0] != checkpointMagic || header[1] != checkpointMode || hash != checkpointHash){
+    cout << "checkpoint: " << checkpointFile << " is for another scene or settings" << endl;
+    return false;
+  }
+  
+  // per pixel: each thread's next pixel & random state
+  int pixels[numThreads];
+  mt19937 rnds[numThreads];
+  int pass[4] = {0, 0, 0, 0};
+  vector<float> lum;
+  vector<double> times;
+  vector<long long> samples;
+  vector<int> left;
+  if(checkpointMode == 0){
+    for(int i = 0; i < numThreads && f; i++){
+      int length = 0;
+      f.read(reinterpret_cast<char*>(&pixels[i]), sizeof(int));
+      f.read(reinterpret_cast<char*>(&length), sizeof(int));
+      string state(max(length, 0), ' ');
+      if(f && length > 0 && f.read(&state[0], length)){
+        stringstream ss(state);
+        ss >> rnds[i];
+      }
+    }
+  }
+  
+  // progressive & adaptive: the pass, luminance sums, tile times & samples, and the tiles left
+  else{
+    int tiles = tilesX * tilesY;
+    lum.resize(2 * size);
+    times.resize(tiles);
+    samples.resize(tiles);
+    if(f.read(reinterpret_cast<char*>(pass), sizeof(pass)) && pass[3] >= 0 && pass[3] <= tiles){
+      left.resize(pass[3]);
+      f.read(reinterpret_cast<char*>(&lum[0]), 2 * size * sizeof(float));
+      f.read(reinterpret_cast<char*>(&times[0]), tiles * sizeof(double));
+      f.read(reinterpret_cast<char*>(&samples[0]), tiles * sizeof(long long));
+      f.read(reinterpret_cast<char*>(left.data()), left.size() * sizeof(int));
+    }else
+      f.setstate(ios::failbit);
+  }
+  
+  // the render's buffers take the rest of the file
+  streampos here = f.tellg();
+  f.seekg(0, ios::end);
+  if(!f || f.tellg() - here != (streamoff) (size * (5 * sizeof(float) + sizeof(int)))){
+    cout << "checkpoint: " << checkpointFile << " is damaged" << endl;
+    return false;
+  }
+  f.seekg(here);
+  if(!render.readBuffers(f)){
+    cout << "checkpoint: " << checkpointFile << " is damaged" << endl;
+    exit(EXIT_FAILURE);
+  }
+  if(checkpointMode == 0){
+    for(int i = 0; i < numThreads; i++){
+      threadPixel[i] = pixels[i];
+      threadRnd[i] = rnds[i];
+    }
+  }else{
+    checkpointPass = pass[0];
+    checkpointSamples = pass[1];
+    checkpointTotal = pass[2];
+    progressiveLum = lum;
+    tileTime = times;
+    tileSamples = samples;
+    tileList = left;
+  }
+  
+  // continue the clock (for the time budget) where the checkpoint left off
+  progressiveStart = chrono::steady_clock::now() - chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+  cout << "checkpoint: resumed from " << checkpointFile << " after " << seconds << " s" << endl;
+  return true;
+}
+
+
+// iterative path tracing from a camera hit (follows one reflection / refraction per bounce)
+// carries the path throughput instead of recursing, and ends paths with Russian roulette
+Color tracePath(Cone &ray, HitInfo &hi, Material *m, LightList &lights, mt19937 &rnd, uniform_real_distribution<float> &dist){
+  
+  // path color, throughput, and absorption of the medium the path is in
+  Color col = Color(0.0, 0.0, 0.0);
+  Color throughput = Color(1.0, 1.0, 1.0);
+  Color absorb = Color(0.0, 0.0, 0.0);
+  
+  // current path segment
+  Cone r = ray;
+  HitInfo h = hi;
+  
+  // follow the path, up to the bounce count
+  for(int bounce = 0; ; bounce++){
+    
+    // add the local shading at this hit (no recursive bounces)
+    col += throughput * m->shade(r, h, lights, 0);
+    
+    // pick the next lobe (stop when out of bounces or the material ends the path)
+    if(bounce >= bounceCount || !m->sampleBounce(r, h, throughput, absorb, dist(rnd)))
+      break;
+    
+    // Russian roulette termination (after a few bounces)
+    if(bounce + 1 >= rouletteDepth){
+      float survive = throughput.Grey();
+      if(survive > 0.95)
+        survive = 0.95;
+      if(dist(rnd) >= survive)
+        break;
+      throughput /= survive;
+    }
+    
+    // trace the next path segment (ray hits environment texture if nothing else)
+    h = HitInfo();
+    if(!traceRay(r, h)){
+      col += throughput * environment.sampleEnvironment(r.dir);
+      break;
+    }
+    
+    // attenuate by absorption when leaving a medium
+    if(!h.front){
+      throughput.r *= exp(-absorb.r * h.z);
+      throughput.g *= exp(-absorb.g * h.z);
+      throughput.b *= exp(-absorb.b * h.z);
+    }
+    
+    // grab the node material hit (for no material, show the hit)
+    m = NULL;
+    if(h.node)
+      m = h.node->getMaterial();
+    if(!m){
+      col += throughput * Color(0.929, 0.929, 0.929);
+      break;
+    }
+  }
+  
+  // return the path color
+  return col;
+}
+
+
+// path tracing from a camera hit (global illumination)
+// traces one continuation ray per bounce, samples each light at every hit (weighted against
+// hitting spherical lights by chance, with multiple importance sampling), adds material
+// emission, and ends paths with Russian roulette
+Color tracePathGI(Cone &ray, HitInfo &hi, Material *m, LightList &lights, mt19937 &rnd, uniform_real_distribution<float> &dist){
+  
+  // path color, throughput, and absorption of the medium the path is in
+  Color col = Color(0.0, 0.0, 0.0);
+  Color throughput = Color(1.0, 1.0, 1.0);
+  Color absorb = Color(0.0, 0.0, 0.0);
+  
+  // current path segment
+  Cone r = ray;
+  HitInfo h = hi;
+  int numLights = lights.size();
+  
+  // follow the path, up to the bounce count
+  for(int bounce = 0; ; bounce++){
+    
+    // add emitted light at this hit
+    col += throughput * m->getEmission(h);
+    
+    // next-event estimation, one sample for each light (ambient terms are replaced by the path)
+    // lights in a light tree are picked a few at a time, by their estimated contribution
+    // the last hit of a path sends no continuation ray, so its light samples take full weight
+    bool last = bounce >= bounceCount;
+    Point n = h.n.GetNormalized();
+    if(n % r.dir > 0.0)
+      n = -n;
+    int skipFrom = lights.tree ? lights.treeStart : numLights;
+    for(int i = 0; i < numLights; i++){
+      if(i == skipFrom)
+        i = lights.treeEnd;
+      if(i >= numLights)
+        break;
+      if(!lights[i]->isAmbient())
+        col += throughput * sampleLight(lights[i], 1.0, 1, m, r, h, last, rnd, dist);
+    }
+    if(lights.tree){
+      int samples = lights.treeSamples;
+      for(int i = 0; i < samples; i++){
+        float pick;
+        Light *light = lights.tree->pick(h.p, n, dist(rnd), pick);
+        if(light)
+          col += throughput * sampleLight(light, pick, samples, m, r, h, last, rnd, dist);
+      }
+    }
+    if(environmentSampler)
+      col += throughput * sampleEnvironmentLight(m, r, h, lights, last, rnd, dist);
+    
+    // sample the next direction (stop when out of bounces or absorbed)
+    float pdf;
+    if(last || !m->sampleBSDF(r, h, throughput, absorb, pdf, dist(rnd), dist(rnd), dist(rnd)))
+      break;
+    
+    // Russian roulette termination (after a few bounces)
+    if(bounce + 1 >= rouletteDepth){
+      float survive = throughput.Grey();
+      if(survive > 0.95)
+        survive = 0.95;
+      if(dist(rnd) >= survive)
+        break;
+      throughput /= survive;
+    }
+    
+    // trace the next path segment
+    HitInfo next = HitInfo();
+    bool hit = traceRay(r, next);
+    
+    // find the closest spherical light hit by the path (before any surface)
+    float tLight = hit ? next.z : FLOAT_MAX;
+    Color lightRad = Color(0.0, 0.0, 0.0);
+    float lightPdf = 0.0;
+    bool hitLight = false;
+    for(int i = 0; i < numLights; i++){
+      float t, lPdf;
+      Color rad;
+      if(lights[i]->intersectLight(r, t, rad, lPdf) && t < tLight){
+        
+        // lights in the tree are sampled with their pick probability, for each of the tree samples
+        if(lights.tree && i >= lights.treeStart && i < lights.treeEnd)
+          lPdf *= lights.treeSamples * lights.tree->pickPdf(lights[i], h.p, n);
+        tLight = t;
+        lightRad = rad;
+        lightPdf = lPdf;
+        hitLight = true;
+      }
+    }
+    
+    // add light hits (weighted against sampling the light, unless specular)
+    if(hitLight){
+      float w = 1.0;
+      if(pdf > 0.0)
+        w = pdf * pdf / (pdf * pdf + lightPdf * lightPdf);
+      col += throughput * lightRad * w;
+      break;
+    }
+    
+    // ray hits environment texture (weighted against sampling the environment, unless specular)
+    if(!hit){
+      float w = 1.0;
+      if(environmentSampler && pdf > 0.0){
+        float envPdf = environmentSampler->pdf(r.dir);
+        w = pdf * pdf / (pdf * pdf + envPdf * envPdf);
+      }
+      col += throughput * environment.sampleEnvironment(r.dir) * w;
+      break;
+    }
+    
+    // attenuate by absorption inside a medium
+    if(absorb.Grey() != 0.0){
+      throughput.r *= exp(-absorb.r * next.z);
+      throughput.g *= exp(-absorb.g * next.z);
+      throughput.b *= exp(-absorb.b * next.z);
+    }
+    
+    // grab the node material hit (for no material, show the hit)
+    m = NULL;
+    if(next.node)
+      m = next.node->getMaterial();
+    if(!m){
+      col += throughput * Color(0.929, 0.929, 0.929);
+      break;
+    }
+    h = next;
+  }
+  
+  // return the path color
+  return col;
+}
+
+
+// next-event estimation for one light sample at a path hit (with shadow ray)
+// the light was picked with probability pick for one of count samples, and the result is
+// weighted against hitting the light with the path (power heuristic, unless last hit)
+Color sampleLight(Light *light, float pick, int count, Material *m, Cone &r, HitInfo &h, bool last, mt19937 &rnd, uniform_real_distribution<float> &dist){
+  
+  // sample the light and evaluate the surface for that direction
+  Point dir;
+  float distance, lightPdf, bsdfPdf;
+  Color li = light->sampleDirect(h.p, dist(rnd), dist(rnd), dir, distance, lightPdf);
+  if(li.Grey() <= 0.0)
+    return Color(0.0, 0.0, 0.0);
+  Color f = m->evalBSDF(r, h, dir, bsdfPdf);
+  if(f.Grey() <= 0.0)
+    return Color(0.0, 0.0, 0.0);
+  
+  // cast shadow ray (any hit before the light, trying the light's last occluder first)
+  Cone shadowRay = Cone(h.p, dir);
+  if(light->shadow(shadowRay, distance) == 0.0)
+    return Color(0.0, 0.0, 0.0);
+  
+  // weight against hitting the light with the path (power heuristic)
+  float w = 1.0;
+  if(lightPdf > 0.0 && !last){
+    float lp = lightPdf * pick * count;
+    w = lp * lp / (lp * lp + bsdfPdf * bsdfPdf);
+  }
+  return f * li * w / (pick * count);
+}
+
+
+// next-event estimation for the (importance sampled) environment at a path hit
+// the environment is only seen past all surfaces & spherical lights, and the result is
+// weighted against escaping with the path (power heuristic, unless last hit)
+Color sampleEnvironmentLight(Material *m, Cone &r, HitInfo &h, LightList &lights, bool last, mt19937 &rnd, uniform_real_distribution<float> &dist){
+  
+  // sample the environment and evaluate the surface for that direction
+  float envPdf, bsdfPdf;
+  Point dir = environmentSampler->sample(dist(rnd), dist(rnd), envPdf);
+  if(envPdf <= 0.0)
+    return Color(0.0, 0.0, 0.0);
+  Color f = m->evalBSDF(r, h, dir, bsdfPdf);
+  if(f.Grey() <= 0.0)
+    return Color(0.0, 0.0, 0.0);
+  
+  // cast shadow ray (any hit, to infinity, with an occluder cache slot of its own)
+  Cone shadowRay = Cone(h.p, dir);
+  if(traceShadowRay(shadowRay, FLOAT_MAX, environmentSlot))
+    return Color(0.0, 0.0, 0.0);
+  for(int i = 0; i < (int) lights.size(); i++){
+    float t, lPdf;
+    Color rad;
+    if(lights[i]->intersectLight(shadowRay, t, rad, lPdf))
+      return Color(0.0, 0.0, 0.0);
+  }
+  
+  // weight against escaping with the path (power heuristic)
+  float w = 1.0;
+  if(!last)
+    w = envPdf * envPdf / (envPdf * envPdf + bsdfPdf * bsdfPdf);
+  return f * environment.sampleEnvironment(dir) * w / envPdf;
+}
+
+
+// compute the irradiance cache points of one level on all threads (with a timing readout)
+void irradianceCacheLevel(string level){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  
+  // share the points between the threads
+  cacheValues.assign(cachePoints.size(), ColorIM());
+  cacheNext = 0;
+  thread t[numThreads];
+  for(int i = 0; i < numThreads; i++)
+    t[i] = thread(irradianceCacheThread);
+  for(int i = 0; i < numThreads; i++)
+    t[i].join();
+  
+  // report progress
+  chrono::duration<double> time = chrono::steady_clock::now() - start;
+  cout << "irradiance cache " << level << ": " << cachePoints.size() << " points in " << time.count() << " s";
+  if(irradianceOctree)
+    cout << " (" << irradianceOctree->size() << " records)";
+  cout << endl;
+}
+
+
+// irradiance cache thread (takes the next point of the level until all are done)
+void irradianceCacheThread(){
+  for(int k = cacheNext++; k < (int) cachePoints.size(); k = cacheNext++){
+    setPixelSeed(cachePoints[k]);
+    cacheValues[k] = irradianceCache(cachePoints[k], cacheLights);
+  }
 }
 
 
 // irradiance cache (for global illumination & indirect lighting at a single pixel)
-void irradianceCache(int i, int m, LightList lightCache){
+ColorIM irradianceCache(int i, LightList &lightCache){
   
   // establish pixel location (center)
   float pX = i % w;
   float pY = i / w;
   
   // color value for cache
-  Color col;
+  Color col = Color(0.0, 0.0, 0.0);
   
   // set offset to zero
   Point posOffset = Point(0,0,0);
   
   // transform ray into world space
   Point rayDir = cameraRay(pX, pY, posOffset);
-  Cone *ray = new Cone();
-  ray->pos = camera.pos;
-  ray->dir = c->transformFrom(rayDir);
-  ray->radius = 0.0;
-  ray->tan = dXV->x / (2.0 * imageDistance);
+  Cone ray = Cone();
+  ray.pos = camera.pos;
+  ray.dir = c->transformFrom(rayDir);
+  ray.radius = 0.0;
+  ray.tan = dXV->x / (2.0 * imageDistance);
   
   // traverse through scene DOM
   // transform rays into model space
   // detect ray intersections and get back HitInfo
   HitInfo hi = HitInfo();
-  bool hit = traceRay(*ray, hi);
+  bool hit = traceRay(ray, hi);
   
   // if hit, get the node's material
   if(hit){
     Node *n = hi.node;
-    Material *m;
+    Material *m = NULL;
     if(n)
       m = n->getMaterial();
     
     // if there is a material, get our indirect light color for cache
     if(m)
-      col = m->shade(*ray, hi, lightCache);
+      col = m->shade(ray, hi, lightCache);
   }
   
-  // set our irradiance map variables
+  // return our irradiance map variables
   ColorIM cim;
   cim.c = col;
   cim.z = hi.z;
   cim.N = hi.n;
-  im.Set(m, cim);
+  return cim;
 }
 
 
+// trace, merge & balance a new photon (or caustic) map with target photons (in parallel with threads)
+BalancedPhotonMap* tracePhotonMap(string name, int target, bool caustic){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  
+  // trace photon chunks in parallel (into a buffer per thread)
+  photonNext = 0;
+  photonStored = 0;
+  photonBuffers.assign(numThreads, vector<PhotonChunk>());
+  thread t[numThreads];
+  for(int i = 0; i < numThreads; i++)
+    t[i] = thread(photonTracingThread, i, target, caustic);
+  for(int i = 0; i < numThreads; i++)
+    t[i].join();
+  
+  // order the chunks by index (so the map does not depend on the threads)
+  vector<PhotonChunk*> chunks(photonNext, NULL);
+  for(int i = 0; i < numThreads; i++)
+    for(int k = 0; k < (int) photonBuffers[i].size(); k++)
+      chunks[photonBuffers[i][k].index] = &photonBuffers[i][k];
+  
+  // merge the chunks into the photon map, up to the photon that fills it
+  PhotonMap *map = createPhotonMap(target + bounceCountPM);
+  int genPhotons = 0;
+  for(int k = 0; k < (int) chunks.size() && chunks[k] && map->stored_photons < target; k++){
+    PhotonChunk *chunk = chunks[k];
+    int used = 0;
+    while(used < photonChunk - 1 && map->stored_photons + chunk->ends[used] < target)
+      used++;
+    storePhotons(map, chunk->photons.data(), chunk->ends[used]);
+    genPhotons += used + 1;
+  }
+  photonBuffers.clear();
+  
+  // scale photon map by number of generated photons
+  float scale = 1.0 / ((float) genPhotons);
+  scalePhotonPower(map, scale);
+  
+  // balance our photon map
+  chrono::duration<double> time = chrono::steady_clock::now() - start;
+  chrono::steady_clock::time_point balanceStart = chrono::steady_clock::now();
+  int storedPhotons = map->stored_photons;
+  BalancedPhotonMap *bmap = balancePhotonMap(map, numThreads);
+  
+  // report progress
+  chrono::duration<double> balanceTime = chrono::steady_clock::now() - balanceStart;
+  cout << name << ": " << storedPhotons << " photons (" << genPhotons << " emitted) in " << time.count() << " s";
+  cout << ", balanced in " << balanceTime.count() << " s" << endl;
+  return bmap;
+}
+
+// quantize a photon map's positions & power (reporting the memory of both formats)
+void compactPhotons(string name, BalancedPhotonMap *map){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  double full = photonMapBytes(map) / 1048576.0;
+  compactPhotonMap(map);
+  double compact = photonMapBytes(map) / 1048576.0;
+  chrono::duration<double> time = chrono::steady_clock::now() - start;
+  cout << name << ": " << full << " MB, compact " << compact << " MB in " << time.count() << " s" << endl;
+}
+
+
+// photon tracing thread (takes the next chunk until the threads have stored enough photons)
+// gives up after emitting 64 times the target, for scenes where few photons are ever stored
+void photonTracingThread(int i, int target, bool caustic){
+  uniform_real_distribution<float> dist{0.0, 1.0};
+  long long maxChunks = 64LL * target / photonChunk + 1;
+  while(photonStored < target){
+    
+    // claim the next chunk only when more photons are needed (so every claimed chunk gets traced,
+    // and the merge finds no gaps before the chunk that fills the map)
+    int k = photonNext++;
+    if(k >= maxChunks)
+      break;
+    
+    // trace the chunk with its own seed, keeping the stored count after each emitted photon
+    PhotonChunk chunk;
+    chunk.index = k;
+    chunk.ends.resize(photonChunk);
+    mt19937 rnd((caustic ? hashInt(~k) : hashInt(k + 1)) ^ photonSeed);
+    for(int j = 0; j < photonChunk; j++){
+      if(caustic)
+        traceCausticPhoton(rnd, dist, chunk.photons);
+      else
+        tracePhoton(rnd, dist, chunk.photons);
+      chunk.ends[j] = chunk.photons.size();
+    }
+    photonStored += chunk.photons.size();
+    photonBuffers[i].push_back(move(chunk));
+  }
+}
+
+
+// trace a single photon from a random light through the scene (storing its hits)
+void tracePhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, vector<Photon> &photons){
+  
+  // photon variables
+  Color pow;
+  int bounce = 1;
+  bool cont = true;
+  
+  // select random light
+  Light *light;
+  float probLight;
+  int l = 0;
+  bool foundLight = false;
+  float randomPow = dist(rnd) * powTot;
+  while(!foundLight){
+    if(randomPow <= lightPow[l]){
+      light = lights[l];
+      probLight = lightProb[l];
+      foundLight = true;
+    }
+    l++;
+  }
+  
+  // initialize our photon
+  pow = light->getPhotonIntensity() * 4.0 * M_PI / probLight;
+  Cone randPhoton = light->randomPhoton(rnd, dist);
+  
+  // ignore first hit (direct lighting) unless using Monte Carlo GI
+  bool store = false;
+  if(globalIllum)
+    store = true;
+  
+  // caustics (only specular bounces so far) go into the caustic map instead, when it is seen directly
+  bool excludeCaustics = causticMap && !globalIllum;
+  bool causticPath = true;
+  int specularBounces = 0;
+  
+  // loop for tracing a photon
+  while(cont){
+    
+    // trace photon in scene
+    HitInfo hi = HitInfo();
+    bool hit = traceRay(randPhoton, hi);
+    
+    // if hit, get the node's material
+    if(hit){
+      Node *n = hi.node;
+      Material *m = NULL;
+      if(n)
+        m = n->getMaterial();
+      
+      // if there is a material that is a photon surface, calculate probabilities
+      if(m){
+        
+        // first, save our photon hit (only if a photon surface & a front hit!)
+        bool caustic = excludeCaustics && causticPath && specularBounces > 0;
+        if(m->isPhotonSurface() && hi.front && store && !caustic){
+          float power[3], position[3], direction[3], normal[3];
+          pow.GetValue(power);
+          hi.p.GetValue(position);
+          randPhoton.dir.GetValue(direction);
+          hi.n.GetNormalized().GetValue(normal);
+          Photon photon;
+          encodePhoton(&photon, power, position, direction, normal);
+          photons.push_back(photon);
+        }
+        
+        // pass our photon hit to the surface to get next photon (if not absorbed)
+        bool specular;
+        cont = m->randomPhotonBounce(randPhoton, pow, hi, rnd, dist, specular);
+        if(specular)
+          specularBounces++;
+        else
+          causticPath = false;
+        
+        // be sure to store following protons
+        if(!store)
+          store = true;
+      }
+      
+      // otherwise, terminate photon
+      else
+        cont = false;
+    
+    // if we hit nothing, terminate photon
+    }else
+      cont = false;
+      
+    // check our photon bounce count
+    bounce++;
+    if(bounce > bounceCountPM)
+      cont = false;
+  }
+}
+
+
+// trace a caustic photon (toward specular surfaces from a random light), stored at the first
+// diffuse surface after one or more specular bounces
+void traceCausticPhoton(mt19937 &rnd, uniform_real_distribution<float> &dist, vector<Photon> &photons){
+  
+  // select random light (with a projection map)
+  int l = 0;
+  float randomPow = dist(rnd) * causticPowTot;
+  while(randomPow > causticPow[l] || causticPow[l] < 0.0)
+    l++;
+  Light *light = lights[l];
+  
+  // initialize our photon (only emitted over the solid angle of the projection map)
+  Color pow = light->getPhotonIntensity() * projections[l]->solidAngle() / causticProb[l];
+  Cone randPhoton = light->randomPhoton(rnd, dist, projections[l]);
+  
+  // follow specular bounces
+  for(int bounce = 1; bounce <= bounceCountPM; bounce++){
+    HitInfo hi = HitInfo();
+    if(!traceRay(randPhoton, hi) || !hi.node)
+      return;
+    Material *m = hi.node->getMaterial();
+    if(!m)
+      return;
+    
+    // store at a diffuse surface after a specular bounce (and end the path)
+    if(bounce > 1 && m->isPhotonSurface()){
+      if(hi.front){
+        float power[3], position[3], direction[3], normal[3];
+        pow.GetValue(power);
+        hi.p.GetValue(position);
+        randPhoton.dir.GetValue(direction);
+        hi.n.GetNormalized().GetValue(normal);
+        Photon photon;
+        encodePhoton(&photon, power, position, direction, normal);
+        photons.push_back(photon);
+      }
+      return;
+    }
+    
+    // continue only along reflections & refractions
+    bool specular;
+    if(!m->randomPhotonBounce(randPhoton, pow, hi, rnd, dist, specular) || !specular)
+      return;
+  }
+}
+
+// progressive photon mapping: passes of photonsPerPass photons, each gathered at new visible points
+// (jittered in the pixel), shrinking the radius to keep alphaPM of the new photons (Hachisuka & Jensen)
+void progressivePhotonMapping(){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  VisiblePoint v;
+  v.radius = radiusPM;
+  v.count = 0.0;
+  v.flux = Color(0.0, 0.0, 0.0);
+  visiblePoints.assign(size, v);
+  for(int pass = 0; pass < passesPM; pass++){
+    
+    // emit a new photon map for this pass (with its own seeds)
+    photonSeed = hashInt(pass + 1);
+    passMap = tracePhotonMap("photon pass " + to_string(pass + 1), photonsPerPass, false);
+    
+    // move it into a grid with cells as big as the largest radius (or keep it compact)
+    if(photonGrid){
+      float radius = 0.0;
+      for(int i = 0; i < size; i++)
+        if(visiblePoints[i].radius > radius)
+          radius = visiblePoints[i].radius;
+      passGrid = buildPhotonGrid(passMap, radius, numThreads);
+      destroyPhotonMap(passMap);
+      passMap = NULL;
+    }else if(compactPM)
+      compactPhotons("photon pass " + to_string(pass + 1), passMap);
+    
+    // gather it at the visible points (in parallel), then free it
+    visibleNext = 0;
+    thread t[numThreads];
+    for(int i = 0; i < numThreads; i++)
+      t[i] = thread(progressiveThread, pass);
+    for(int i = 0; i < numThreads; i++)
+      t[i].join();
+    if(passGrid)
+      destroyPhotonGrid(passGrid);
+    else
+      destroyPhotonMap(passMap);
+    passGrid = NULL;
+    progressivePasses++;
+  }
+  photonSeed = 0;
+  
+  // report progress (average radius)
+  float radius = 0.0;
+  for(int i = 0; i < size; i++)
+    radius += visiblePoints[i].radius / size;
+  chrono::duration<double> time = chrono::steady_clock::now() - start;
+  cout << "progressive photon mapping: " << progressivePasses << " passes in " << time.count() << " s (average radius " << radius << ")" << endl;
+}
+
+
+// progressive photon mapping thread (takes the next pixel until all are done)
+void progressiveThread(int pass){
+  for(int pixel = visibleNext++; pixel < size; pixel = visibleNext++){
+    VisiblePoint &v = visiblePoints[pixel];
+    setPixelSeed(hashInt(pass + 1) ^ pixel);
+    
+    // jittered camera ray through the pixel
+    Point rayDir = cameraRay(pixel % w + pixelRandom() - 0.5, pixel / w + pixelRandom() - 0.5, Point(0, 0, 0));
+    Cone r = Cone();
+    r.pos = camera.pos;
+    r.dir = c->transformFrom(rayDir);
+    r.radius = 0.0;
+    r.tan = dXV->x / (2.0 * imageDistance);
+    
+    // follow reflections & refractions to the first surface that photons are stored on
+    Color throughput = Color(1.0, 1.0, 1.0);
+    Color absorb = Color(0.0, 0.0, 0.0);
+    v.weight = Color(0.0, 0.0, 0.0);
+    for(int bounce = 0; bounce <= bounceCount; bounce++){
+      HitInfo h = HitInfo();
+      if(!traceRay(r, h) || !h.node)
+        break;
+      
+      // attenuate by absorption when leaving a medium
+      if(!h.front){
+        throughput.r *= exp(-absorb.r * h.z);
+        throughput.g *= exp(-absorb.g * h.z);
+        throughput.b *= exp(-absorb.b * h.z);
+      }
+      
+      // the visible point (front hits only, as for ambient lights)
+      Material *m = h.node->getMaterial();
+      if(!m)
+        break;
+      if(m->isPhotonSurface()){
+        if(h.front){
+          v.p = h.p;
+          v.n = h.n.GetNormalized();
+          v.weight = throughput * m->getDiffuse(h);
+        }
+        break;
+      }
+      
+      // otherwise, continue along one reflection or refraction
+      if(!m->sampleBounce(r, h, throughput, absorb, pixelRandom()))
+        break;
+    }
+    if(v.weight.Grey() <= 0.0)
+      continue;
+    
+    // gather this pass's photons, keeping alpha of the new ones (the radius shrinks to match)
+    float position[3], normal[3], flux[3];
+    v.p.GetValue(position);
+    v.n.GetValue(normal);
+    int found = passGrid ? photonsInRadius(passGrid, flux, position, normal, v.radius) : photonsWithin(passMap, flux, position, normal, v.radius);
+    if(found > 0){
+      float count = v.count + alphaPM * found;
+      float scale = count / (v.count + found);
+      v.radius *= sqrt(scale);
+      v.flux = (v.flux + v.weight * Color(flux)) * scale;
+      v.count = count;
+    }
+  }
+}
+
+
+// radiance of the photons gathered at a pixel (over all passes)
+Color progressiveColor(int pixel){
+  VisiblePoint &v = visiblePoints[pixel];
+  if(progressivePasses == 0 || v.radius <= 0.0)
+    return Color(0.0, 0.0, 0.0);
+  return v.flux / (M_PI * v.radius * v.radius * progressivePasses);
+}
+
 // create variables for camera ray generation
 void cameraRayVars(){
   float fov = camera.fov * M_PI / 180.0;